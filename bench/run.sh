@@ -0,0 +1,121 @@
+#!/bin/sh
+# Runs benchmarks against a clox binary and reports how long each took, as measured by the script
+# itself: every benchmark ends by printing "elapsed: <seconds>", which leaves out starting the VM
+# and compiling the script. Each one is run a few times first to warm up caches and the CPU's
+# clock, and then the given number of times for real.
+#
+#   run.sh [-w warmups] [-n runs] [-o results.tsv] [-b baseline.tsv] [-t percent] clox [name...]
+#
+# With no names, every script here that prints an elapsed time is run. Results are printed as a
+# table, one line per benchmark, and with -o also written out tab separated for later runs to be
+# compared against. With -b, each benchmark's median is compared with the one in that file, and
+# the exit status is 1 if any got slower by more than the threshold, 5% unless -t says otherwise.
+
+set -e
+
+usage() {
+    echo "Usage: run.sh [-w warmups] [-n runs] [-o results.tsv] [-b baseline.tsv]" \
+         "[-t percent] clox [name...]" >&2
+    exit 64
+}
+
+warmups=1
+runs=5
+out=
+baseline=
+threshold=5
+while getopts w:n:o:b:t: option; do
+    case $option in
+        w) warmups=$OPTARG ;;
+        n) runs=$OPTARG ;;
+        o) out=$OPTARG ;;
+        b) baseline=$OPTARG ;;
+        t) threshold=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -ge 1 ] && [ "$runs" -ge 1 ] || usage
+
+clox=$1
+shift
+dir=$(dirname "$0")
+if [ $# -eq 0 ]; then
+    for script in "$dir"/*.lox; do
+        grep -q '"elapsed: "' "$script" && set -- "$@" "$(basename "$script" .lox)"
+    done
+fi
+if [ -n "$baseline" ] && [ ! -r "$baseline" ]; then
+    echo "Could not read baseline \"$baseline\"." >&2
+    exit 66
+fi
+
+commit=$(git -C "$dir" describe --always --dirty 2>/dev/null || echo unknown)
+results=$(mktemp)
+trap 'rm -f "$results"' EXIT
+printf 'benchmark\tcommit\truns\tmin\tmedian\tmean\tmax\n' > "$results"
+
+# Prints the elapsed time from one run of the named benchmark.
+measure() {
+    if ! output=$("$clox" "$dir/$1.lox" 2>&1); then
+        echo "$1 failed:" >&2
+        echo "$output" >&2
+        exit 70
+    fi
+    echo "$output" | sed -n 's/^elapsed: //p' | tail -n 1
+}
+
+for name in "$@"; do
+    i=0
+    while [ $i -lt "$warmups" ]; do
+        measure "$name" > /dev/null
+        i=$((i + 1))
+    done
+
+    times=
+    i=0
+    while [ $i -lt "$runs" ]; do
+        times="$times $(measure "$name")"
+        i=$((i + 1))
+    done
+
+    echo "$times" | tr ' ' '\n' | grep . | sort -g | awk -v name="$name" -v commit="$commit" '
+        { time[NR] = $1; sum += $1 }
+        END {
+            median = NR % 2 ? time[(NR + 1) / 2] : (time[NR / 2] + time[NR / 2 + 1]) / 2
+            printf "%s\t%s\t%d\t%.6f\t%.6f\t%.6f\t%.6f\n",
+                   name, commit, NR, time[1], median, sum / NR, time[NR]
+        }' >> "$results"
+done
+
+[ -n "$out" ] && cp "$results" "$out"
+
+if [ -z "$baseline" ]; then
+    awk -F '\t' '{ printf "%-16s %-16s %5s %10s %10s %10s %10s\n", $1, $2, $3, $4, $5, $6, $7 }' \
+        "$results"
+    exit 0
+fi
+
+# Medians are compared rather than means, so one run disturbed by something else on the machine
+# can't make a benchmark look slower or faster than it is.
+awk -F '\t' -v threshold="$threshold" '
+    BEGIN { printf "%-16s %10s %10s %9s\n", "benchmark", "baseline", "median", "change" }
+    FNR == 1 { next }
+    NR == FNR { base[$1] = $5; baseCommit = $2; next }
+    {
+        if (!($1 in base)) {
+            printf "%-16s %10s %10.4f\n", $1, "-", $5
+            next
+        }
+        change = base[$1] > 0 ? ($5 - base[$1]) / base[$1] * 100 : 0
+        flag   = change > threshold ? "  slower" : change < -threshold ? "  faster" : ""
+        if (change > threshold) regressions++
+        printf "%-16s %10.4f %10.4f %+8.1f%%%s\n", $1, base[$1], $5, change, flag
+    }
+    END {
+        if (regressions > 0) {
+            printf "%d benchmark(s) more than %s%% slower than %s\n", regressions, threshold,
+                   baseCommit
+            exit 1
+        }
+    }' "$baseline" "$results"
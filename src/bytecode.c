@@ -0,0 +1,468 @@
+#include "bytecode.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+/* File layout. Every count and length is a uint32_t.
+
+    header     "LOXC", version, OPCODE_COUNT, whether it was optimized, source hash, payload
+               checksum (both uint64_t)
+    globals    count, then for each in slot order: slot, name
+    function   the top-level script, with nested functions inside its constants
+
+    function   arity, upvalueCount, maxSlots, name, code count, code bytes, line run count,
+               the runs as (offset, line) int pairs, inline cache count, constant count,
+               then for each constant a tag byte and its value
+    name       length followed by the characters, or UINT32_MAX for the script's missing name
+
+The global slots in the code are the ones the compiler handed out in the VM that wrote the file.
+The loading VM may number its globals differently, so the globals section lets it rewrite every
+global instruction to refer to its own slot for the same name.
+
+The checksum catches files that were truncated or damaged on disk. Beyond that the loader only
+checks that the code splits into whole instructions; it is not a verifier, and a deliberately
+crafted file can still make the VM misbehave. */
+
+typedef enum ConstantTag {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} ConstantTag;
+
+#define NO_NAME UINT32_MAX
+
+// 64-bit FNV-1a, which also serves as the payload checksum. Both only have to catch accidents.
+#define FNV_OFFSET_BASIS 14695981039346656037ull
+
+static uint64_t extendHash(uint64_t hash, const char* bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t hashSource(const char* source, size_t length) {
+    return extendHash(FNV_OFFSET_BASIS, source, length);
+}
+
+// Hashes the rest of the file open on fd the same way, without holding more than a block of it.
+// Returns false if it can't be read.
+bool hashFile(int fd, uint64_t* hash) {
+    char    block[65536];
+    ssize_t count;
+    *hash = FNV_OFFSET_BASIS;
+    while ((count = read(fd, block, sizeof(block))) != 0) {
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        *hash = extendHash(*hash, block, count);
+    }
+    return true;
+}
+
+// ---- Writing ---- //
+
+// The payload is built up in memory so its checksum can go in the header in front of it.
+typedef struct Buffer {
+    uint8_t* bytes;
+    size_t   count;
+    size_t   capacity;
+} Buffer;
+
+static void writeBytes(Buffer* buffer, const void* bytes, size_t count) {
+    if (buffer->count + count > buffer->capacity) {
+        size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+        while (capacity < buffer->count + count) capacity *= 2;
+        buffer->bytes = realloc(buffer->bytes, capacity);
+        if (buffer->bytes == NULL) exit(1);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+static void writeU8(Buffer* buffer, uint8_t value) { writeBytes(buffer, &value, sizeof(value)); }
+
+static void writeU32(Buffer* buffer, uint32_t value) { writeBytes(buffer, &value, sizeof(value)); }
+
+static void writeName(Buffer* buffer, ObjString* name) {
+    if (name == NULL) {
+        writeU32(buffer, NO_NAME);
+        return;
+    }
+    writeU32(buffer, (uint32_t)name->length);
+    writeBytes(buffer, name->chars, name->length);
+}
+
+static void writeFunction(Buffer* buffer, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+
+    writeU32(buffer, (uint32_t)function->arity);
+    writeU32(buffer, (uint32_t)function->upvalueCount);
+    writeU32(buffer, (uint32_t)function->maxSlots);
+    writeName(buffer, function->name);
+
+    writeU32(buffer, (uint32_t)chunk->count);
+    writeBytes(buffer, chunk->code, chunk->count);
+    writeU32(buffer, (uint32_t)chunk->lineCount);
+    writeBytes(buffer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+    writeU32(buffer, (uint32_t)chunk->cacheCount);
+
+    writeU32(buffer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_NUMBER(constant)) {
+            double number = AS_NUMBER(constant);
+            writeU8(buffer, CONSTANT_NUMBER);
+            writeBytes(buffer, &number, sizeof(number));
+        } else if (IS_STRING(constant)) {
+            writeU8(buffer, CONSTANT_STRING);
+            writeName(buffer, AS_STRING(constant));
+        } else if (IS_FUNCTION(constant)) {
+            writeU8(buffer, CONSTANT_FUNCTION);
+            writeFunction(buffer, AS_FUNCTION(constant));
+        } else if (IS_BOOL(constant)) {
+            writeU8(buffer, AS_BOOL(constant) ? CONSTANT_TRUE : CONSTANT_FALSE);
+        } else {
+            writeU8(buffer, CONSTANT_NIL);
+        }
+    }
+}
+
+// Writes the script to path, replacing whatever was there. The file is written under a temporary
+// name and renamed into place, so a reader never sees half of one.
+bool writeBytecode(const char* path, ObjFunction* function, uint64_t sourceHash) {
+    Buffer payload = {NULL, 0, 0};
+
+    // Every global the VM knows about, not just the ones this script uses. It's only a handful of
+    // names more, and it saves walking the code to find out which are referenced. They go in slot
+    // order, so that a fresh VM loading the file hands out the same slots, and each still fits
+    // the short or long form the compiler picked for it.
+    int         globals = vm.globalValues.count;
+    ObjString** names   = malloc(sizeof(ObjString*) * (globals > 0 ? globals : 1));
+    if (names == NULL) exit(1);
+    for (int i = 0; i < vm.globalNames.capacity; i++) {
+        Entry* entry = &vm.globalNames.entries[i];
+        if (entry->key != NULL) names[(int)AS_NUMBER(entry->value)] = entry->key;
+    }
+    writeU32(&payload, (uint32_t)globals);
+    for (int slot = 0; slot < globals; slot++) {
+        writeU32(&payload, (uint32_t)slot);
+        writeName(&payload, names[slot]);
+    }
+    free(names);
+    writeFunction(&payload, function);
+
+    Buffer header = {NULL, 0, 0};
+    writeBytes(&header, "LOXC", 4);
+    writeU32(&header, BYTECODE_VERSION);
+    writeU32(&header, OPCODE_COUNT);
+    writeU32(&header, vm.optimize ? 1 : 0);
+    writeBytes(&header, &sourceHash, sizeof(sourceHash));
+    uint64_t checksum = hashSource((const char*)payload.bytes, payload.count);
+    writeBytes(&header, &checksum, sizeof(checksum));
+
+    size_t length   = strlen(path);
+    char*  tempPath = malloc(length + 5);
+    if (tempPath == NULL) exit(1);
+    memcpy(tempPath, path, length);
+    memcpy(tempPath + length, ".tmp", 5);
+
+    bool  ok   = false;
+    FILE* file = fopen(tempPath, "wb");
+    if (file != NULL) {
+        ok = fwrite(header.bytes, 1, header.count, file) == header.count &&
+             fwrite(payload.bytes, 1, payload.count, file) == payload.count;
+        ok = fclose(file) == 0 && ok;
+        if (ok) ok = rename(tempPath, path) == 0;
+        if (!ok) remove(tempPath);
+    }
+
+    free(tempPath);
+    free(header.bytes);
+    free(payload.bytes);
+    return ok;
+}
+
+// ---- Reading ---- //
+
+typedef struct Reader {
+    const uint8_t* current;
+    const uint8_t* end;
+    bool           failed;  // Set on the first read past the end, after which every read gives 0.
+    int*           globals;  // Maps a slot number in the file to this VM's slot for the same name.
+    uint32_t       globalCount;
+} Reader;
+
+static const uint8_t* readBytes(Reader* reader, size_t count) {
+    if (reader->failed || (size_t)(reader->end - reader->current) < count) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->current;
+    reader->current += count;
+    return bytes;
+}
+
+static uint32_t readU32(Reader* reader) {
+    uint32_t       value = 0;
+    const uint8_t* bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint8_t readU8(Reader* reader) {
+    const uint8_t* bytes = readBytes(reader, 1);
+    return bytes != NULL ? *bytes : 0;
+}
+
+// Reads a name straight out of the mapped file into the intern table.
+static ObjString* readName(Reader* reader) {
+    uint32_t length = readU32(reader);
+    if (length == NO_NAME) return NULL;
+
+    const char* chars = (const char*)readBytes(reader, length);
+    if (chars == NULL) return NULL;
+    return copyString(chars, (int)length);
+}
+
+// Points every global instruction in the chunk at this VM's slot for the variable, and checks on
+// the way that the code decodes into whole instructions.
+static void relinkGlobals(Reader* reader, Chunk* chunk) {
+    for (int offset = 0; offset < chunk->count && !reader->failed;) {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction >= OPCODE_COUNT) break;
+        if (instruction == OP_CLOSURE || instruction == OP_CLOSURE_LONG) {
+            bool isLong = instruction == OP_CLOSURE_LONG;
+            if (offset + (isLong ? 3 : 1) >= chunk->count) break;
+            uint32_t constant =
+                isLong ? readLongOperand(chunk, offset + 1) : chunk->code[offset + 1];
+            if (constant >= (uint32_t)chunk->constants.count) break;
+            if (!IS_FUNCTION(chunk->constants.values[constant])) break;
+        }
+
+        int length = instructionLength(chunk, offset);
+        if (offset + length > chunk->count) break;
+
+        if (instruction == OP_GET_GLOBAL || instruction == OP_DEFINE_GLOBAL ||
+            instruction == OP_SET_GLOBAL) {
+            uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+            if (slot >= reader->globalCount || reader->globals[slot] == -1) break;
+            // The slot the name has here may not fit the short form the file was compiled with,
+            // and it can't be widened in place, so then the script is compiled afresh instead.
+            int local = reader->globals[slot];
+            if (local > UINT16_MAX) break;
+            chunk->code[offset + 1] = (local >> 8) & 0xff;
+            chunk->code[offset + 2] = local & 0xff;
+        } else if (instruction == OP_GET_GLOBAL_LONG || instruction == OP_DEFINE_GLOBAL_LONG ||
+                   instruction == OP_SET_GLOBAL_LONG) {
+            uint32_t slot = readLongOperand(chunk, offset + 1);
+            if (slot >= reader->globalCount || reader->globals[slot] == -1) break;
+            int local = reader->globals[slot];
+            if (local > UINT24_MAX) break;
+            chunk->code[offset + 1] = (local >> 16) & 0xff;
+            chunk->code[offset + 2] = (local >> 8) & 0xff;
+            chunk->code[offset + 3] = local & 0xff;
+        }
+        offset += length;
+        if (offset == chunk->count) return;
+    }
+    reader->failed = true;
+}
+
+static ObjFunction* readFunction(Reader* reader) {
+    // Nested functions stack up a slot each below, so a deeply nested script can need more room
+    // than the VM always keeps spare.
+    if (!reserveStack(STACK_SLACK)) {
+        reader->failed = true;
+        return NULL;
+    }
+
+    // Everything read from here on allocates, so the function stays on the stack until it's
+    // complete.
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+    Chunk* chunk = &function->chunk;
+
+    uint32_t arity        = readU32(reader);
+    uint32_t upvalueCount = readU32(reader);
+    uint32_t maxSlots     = readU32(reader);
+    if (arity > 255 || upvalueCount > UINT24_COUNT || maxSlots > UINT24_COUNT) {
+        reader->failed = true;
+    }
+    function->arity        = (int)arity;
+    function->upvalueCount = (int)upvalueCount;
+    function->maxSlots     = (int)maxSlots;
+    function->name         = readName(reader);
+    if (function->name != NULL) writeBarrier((Obj*)function, OBJ_VAL(function->name));
+
+    uint32_t       count     = readU32(reader);
+    const uint8_t* code      = readBytes(reader, count);
+    uint32_t       lineCount = readU32(reader);
+    // Every chunk ends in a return, so there's at least one run, and never more than one a byte.
+    if (lineCount == 0 || lineCount > count) reader->failed = true;
+    const uint8_t* lines = readBytes(reader, (size_t)lineCount * sizeof(LineStart));
+    if (!reader->failed) {
+        chunk->code         = ALLOCATE(uint8_t, count);
+        chunk->lines        = ALLOCATE(LineStart, lineCount);
+        chunk->capacity     = (int)count;
+        chunk->count        = (int)count;
+        chunk->lineCapacity = (int)lineCount;
+        chunk->lineCount    = (int)lineCount;
+        memcpy(chunk->code, code, count);
+        memcpy(chunk->lines, lines, (size_t)lineCount * sizeof(LineStart));
+
+        // getLine() relies on the runs starting at the first byte and going up from there.
+        for (uint32_t i = 0; i < lineCount; i++) {
+            int previous = i == 0 ? -1 : chunk->lines[i - 1].offset;
+            int offset   = chunk->lines[i].offset;
+            if ((i == 0 && offset != 0) || offset <= previous || offset >= (int)count) {
+                reader->failed = true;
+            }
+        }
+    }
+
+    // Inline caches start out empty, so only their number is stored. Each one belongs to an
+    // instruction, and constants are addressed by at most three bytes, which bounds both counts.
+    uint32_t caches = readU32(reader);
+    if (caches > count) reader->failed = true;
+    for (uint32_t i = 0; i < caches && !reader->failed; i++) {
+        addInlineCache(chunk);
+    }
+
+    uint32_t constants = readU32(reader);
+    if (constants > UINT24_COUNT) reader->failed = true;
+    for (uint32_t i = 0; i < constants && !reader->failed; i++) {
+        Value value = NIL_VAL;
+        switch (readU8(reader)) {
+            case CONSTANT_NIL: value = NIL_VAL; break;
+            case CONSTANT_FALSE: value = BOOL_VAL(false); break;
+            case CONSTANT_TRUE: value = BOOL_VAL(true); break;
+            case CONSTANT_NUMBER: {
+                double         number = 0;
+                const uint8_t* bytes  = readBytes(reader, sizeof(number));
+                if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+                value = NUMBER_VAL(number);
+                break;
+            }
+            case CONSTANT_STRING: {
+                ObjString* string = readName(reader);
+                if (string == NULL) reader->failed = true;
+                value = string != NULL ? OBJ_VAL(string) : NIL_VAL;
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction* nested = readFunction(reader);
+                value               = nested != NULL ? OBJ_VAL(nested) : NIL_VAL;
+                break;
+            }
+            default: reader->failed = true; break;
+        }
+        addConstant(chunk, value);
+        writeBarrier((Obj*)function, value);
+    }
+
+    if (!reader->failed) relinkGlobals(reader, chunk);
+
+    pop();
+    return reader->failed ? NULL : function;
+}
+
+/* Loads a script saved by writeBytecode(). Returns NULL if the file is missing, damaged, written by
+an incompatible clox, or, when sourceHash isn't NULL, compiled from a different source or with the
+optimizer on when it's now off or the other way round. A file run by name is taken as it is.
+
+The file is mapped rather than read, and everything is decoded straight out of the mapping: the
+code and line arrays are copied once into their chunks, and strings go directly into the intern
+table. A chunk has to own its code, since loading rewrites the global slots in place. */
+ObjFunction* readBytecode(const char* path, const uint64_t* sourceHash) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)info.st_size;
+    void*  map  = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    Reader reader;
+    reader.current     = map;
+    reader.end         = (const uint8_t*)map + size;
+    reader.failed      = false;
+    reader.globals     = NULL;
+    reader.globalCount = 0;
+
+    ObjFunction*   function  = NULL;
+    const uint8_t* magic     = readBytes(&reader, 4);
+    uint32_t       version   = readU32(&reader);
+    uint32_t       opcodes   = readU32(&reader);
+    uint32_t       optimized = readU32(&reader);
+    uint64_t       hash      = 0;
+    uint64_t       checksum  = 0;
+    const uint8_t* hashData  = readBytes(&reader, sizeof(hash) + sizeof(checksum));
+    if (hashData != NULL) {
+        memcpy(&hash, hashData, sizeof(hash));
+        memcpy(&checksum, hashData + sizeof(hash), sizeof(checksum));
+    }
+
+    if (reader.failed || memcmp(magic, "LOXC", 4) != 0 || version != BYTECODE_VERSION ||
+        opcodes != OPCODE_COUNT ||
+        (sourceHash != NULL && (hash != *sourceHash || optimized != (vm.optimize ? 1u : 0u)))) {
+        goto done;
+    }
+    if (hashSource((const char*)reader.current, (size_t)(reader.end - reader.current)) !=
+        checksum) {
+        goto done;
+    }
+
+    // The writer hands out global slots in order and never takes one back, so every slot in the
+    // file is below the count, and anything the code names outside the map is an error.
+    uint32_t globalCount = readU32(&reader);
+    if (reader.failed || globalCount > UINT24_COUNT) goto done;
+    reader.globals     = malloc(sizeof(int) * (globalCount > 0 ? globalCount : 1));
+    reader.globalCount = globalCount;
+    if (reader.globals == NULL) goto done;
+    for (uint32_t i = 0; i < globalCount; i++) reader.globals[i] = -1;
+
+    for (uint32_t i = 0; i < globalCount && !reader.failed; i++) {
+        uint32_t   slot = readU32(&reader);
+        ObjString* name = readName(&reader);
+        if (name == NULL || slot >= globalCount) {
+            reader.failed = true;
+            break;
+        }
+        reader.globals[slot] = globalSlot(name);
+        if (reader.globals[slot] > UINT24_MAX) reader.failed = true;
+    }
+
+    if (!reader.failed) function = readFunction(&reader);
+    // interpretFunction() calls the script with no arguments and nothing to close over.
+    if (function != NULL && (function->arity != 0 || function->upvalueCount != 0)) function = NULL;
+    if (reader.current != reader.end) function = NULL;
+
+done:
+    free(reader.globals);
+    munmap(map, size);
+    return function;
+}
@@ -0,0 +1,24 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "common.h"
+#include "object.h"
+
+/* A compiled script can be saved to a bytecode file and loaded back later without going anywhere
+near the scanner or compiler. The file records a hash of the source it was compiled from and
+whether the optimizer ran, so a cache next to a script can be checked against both and thrown away
+once the script or --no-optimize changes.
+
+The format is meant for caching on the machine that wrote it, not for distribution: numbers and
+lengths are stored in native byte order, and the file is only accepted by a clox with the same
+format version and instruction set. */
+
+// Bump whenever the layout of the file, or the meaning of any instruction, changes.
+#define BYTECODE_VERSION 11
+
+uint64_t     hashSource(const char* source, size_t length);
+bool         hashFile(int fd, uint64_t* hash);
+bool         writeBytecode(const char* path, ObjFunction* function, uint64_t sourceHash);
+ObjFunction* readBytecode(const char* path, const uint64_t* sourceHash);
+
+#endif
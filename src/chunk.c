@@ -3,20 +3,27 @@
 #include <stdlib.h>
 
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void initChunk(Chunk* chunk) {
-    chunk->count    = 0;
-    chunk->capacity = 0;
-    chunk->code     = NULL;
-    chunk->lines    = NULL;
+    chunk->count        = 0;
+    chunk->capacity     = 0;
+    chunk->code         = NULL;
+    chunk->lineCount    = 0;
+    chunk->lineCapacity = 0;
+    chunk->lines        = NULL;
     initValueArray(&chunk->constants);
+    chunk->cacheCount    = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches        = NULL;
 }
 
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
     initChunk(chunk);
 }
 
@@ -25,17 +32,240 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code     = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines    = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
-    chunk->code[chunk->count]  = byte;
-    chunk->lines[chunk->count] = line;
+    chunk->code[chunk->count] = byte;
+    addLine(chunk, chunk->count, line);
     chunk->count++;
 }
 
+// Records that the byte at offset came from line. Offsets have to be added in increasing order,
+// and nothing is stored unless the line differs from the one before.
+void addLine(Chunk* chunk, int offset, int line) {
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity     = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart* start = &chunk->lines[chunk->lineCount++];
+    start->offset    = offset;
+    start->line      = line;
+}
+
+// Returns the line the byte at offset was compiled from, by a binary search for the last run that
+// starts at or before it.
+int getLine(Chunk* chunk, int offset) {
+    int low  = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if (chunk->lines[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return chunk->lines[low].line;
+}
+
 int addConstant(Chunk* chunk, Value value) {
     push(value);
     writeValueArray(&chunk->constants, value);
     pop();
     return chunk->constants.count - 1;
 }
+
+int addInlineCache(Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity      = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        cache->entries[i].shapeId      = 0;
+        cache->entries[i].classVersion = 0;
+        cache->entries[i].slot         = -1;
+        cache->entries[i].method       = NULL;
+        cache->entries[i].transition   = NULL;
+    }
+    return chunk->cacheCount++;
+}
+
+// Reads the three-byte operand of a long instruction, stored big-endian like every other operand.
+uint32_t readLongOperand(Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    return ((uint32_t)code[0] << 16) | ((uint32_t)code[1] << 8) | code[2];
+}
+
+// Maps a quickened instruction back to the generic one it was rewritten from, and anything else
+// to itself.
+OpCode genericOpcode(uint8_t instruction) {
+    switch (instruction) {
+        case OP_EQUAL_NUM: return OP_EQUAL;
+        case OP_GREATER_NUM: return OP_GREATER;
+        case OP_LESS_NUM: return OP_LESS;
+        case OP_ADD_NUM:
+        case OP_ADD_STR: return OP_ADD;
+        case OP_SUBTRACT_NUM: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM: return OP_MULTIPLY;
+        case OP_DIVIDE_NUM: return OP_DIVIDE;
+        default: return (OpCode)instruction;
+    }
+}
+
+// Returns the size in bytes of the instruction at offset, opcode and operands together.
+int instructionLength(Chunk* chunk, int offset) {
+    static const uint8_t operandBytes[] = {
+#define OPCODE(name, operands) operands,
+        FOR_EACH_OPCODE(OPCODE)
+#undef OPCODE
+    };
+
+    uint8_t instruction = chunk->code[offset];
+    int     length      = 1 + operandBytes[instruction];
+    if (instruction == OP_CLOSURE) {
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        length += 2 * function->upvalueCount;
+    } else if (instruction == OP_CLOSURE_LONG) {
+        uint32_t     constant = readLongOperand(chunk, offset + 1);
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+        length += 4 * function->upvalueCount;
+    }
+    return length;
+}
+
+// Returns the offset a jump instruction lands on, or -1 if the instruction isn't a jump.
+int jumpTarget(Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    switch (code[0]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE: return offset + 3 + ((code[1] << 8) | code[2]);
+        case OP_LOOP: return offset + 3 - ((code[1] << 8) | code[2]);
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG: return offset + 4 + (int)readLongOperand(chunk, offset + 1);
+        case OP_LOOP_LONG: return offset + 4 - (int)readLongOperand(chunk, offset + 1);
+        default: return -1;
+    }
+}
+
+// How many more values are on the stack after the instruction at offset than before it. Nothing
+// runs after an OP_RETURN in the same frame, so its effect doesn't matter.
+static int stackEffect(Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    switch (genericOpcode(code[0])) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_GET_LOCAL_0:
+        case OP_GET_LOCAL_1:
+        case OP_GET_LOCAL_2:
+        case OP_GET_LOCAL_3:
+        case OP_ADD_LOCAL_CONST:
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_ENCLOSING:
+        case OP_GET_ENCLOSING_LONG:
+        case OP_CLOSURE_LONG:
+        case OP_CLASS_LONG: return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_GET_INDEX:
+        case OP_SET_LOCAL_POP:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_METHOD_LONG: return -1;
+        case OP_SET_INDEX:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE: return -2;
+        // A call leaves its result where the callee was, in place of the callee and arguments.
+        case OP_CALL: return -code[1];
+        case OP_INVOKE: return -code[2];
+        case OP_INVOKE_LONG: return -code[4];
+        // These pop the superclass as well.
+        case OP_SUPER_INVOKE: return -code[2] - 1;
+        case OP_SUPER_INVOKE_LONG: return -code[4] - 1;
+        case OP_POP_N: return -code[1];
+        // The items are replaced by the list made from them.
+        case OP_BUILD_LIST: return 1 - code[1];
+        case OP_EXTEND_LIST: return -code[1];
+        default: return 0;
+    }
+}
+
+/* Works out the most values the code can have on the stack at once in a single call, starting
+from the initialDepth already there for the callee and its arguments. The VM makes sure there's
+that much room before it starts running a function, so nothing has to be checked as values are
+pushed.
+
+The compiler only emits code where every path to an instruction arrives with the same number of
+values on the stack, so each instruction is visited just once, following jumps as well as falling
+through. */
+int maxStackDepth(Chunk* chunk, int initialDepth) {
+    int* depths   = malloc(sizeof(int) * (chunk->count + 1));
+    int* worklist = malloc(sizeof(int) * (chunk->count + 1));
+    if (depths == NULL || worklist == NULL) exit(1);
+    for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+
+    int maxDepth = initialDepth;
+    int pending  = 0;
+    if (chunk->count > 0) {
+        depths[0]           = initialDepth;
+        worklist[pending++] = 0;
+    }
+
+    while (pending > 0) {
+        int     offset      = worklist[--pending];
+        uint8_t instruction = chunk->code[offset];
+        int     depth       = depths[offset] + stackEffect(chunk, offset);
+        if (depth > maxDepth) maxDepth = depth;
+
+        int  target       = jumpTarget(chunk, offset);
+        bool fallsThrough = instruction != OP_RETURN && instruction != OP_JUMP &&
+                            instruction != OP_LOOP && instruction != OP_JUMP_LONG &&
+                            instruction != OP_LOOP_LONG;
+        int  next         = offset + instructionLength(chunk, offset);
+
+        if (target >= 0 && target < chunk->count && depths[target] == -1) {
+            depths[target]      = depth;
+            worklist[pending++] = target;
+        }
+        if (fallsThrough && next < chunk->count && depths[next] == -1) {
+            depths[next]        = depth;
+            worklist[pending++] = next;
+        }
+    }
+
+    free(worklist);
+    free(depths);
+    return maxDepth;
+}
@@ -4,57 +4,190 @@
 #include "common.h"
 #include "value.h"
 
+// Every opcode is listed exactly once, here, along with how many bytes of operands follow it. The
+// OpCode enum below, the threaded dispatch table in run() and anything else that needs one entry
+// per instruction are all expanded from this list, so they can never disagree about the numbering.
+// OP_CLOSURE is the one instruction whose length varies: its constant operand is followed by an
+// (isLocal, index) byte pair for each upvalue the function captures. An isLocal of 2 marks a local
+// the function borrows instead, which captures nothing.
+//
+// A list literal's items are gathered on the stack at most 255 at a time. OP_BUILD_LIST makes the
+// list from the first of them, and OP_EXTEND_LIST appends each later batch to the list under it.
+//
+// OP_GET_ENCLOSING and OP_SET_ENCLOSING are what a borrowing function uses in place of
+// OP_GET_UPVALUE and OP_SET_UPVALUE. The compiler only lets a local function borrow when nothing
+// but direct calls in the function that declares it ever refer to it, so whenever it runs, the
+// frame under its own is the one the local lives in, and the operand is a slot in that frame.
+//
+// The instructions from OP_GET_LOCAL_0 to OP_GREATER_JUMP_IF_FALSE are superinstructions. The
+// compiler never emits them itself; the optimizer fuses them out of common sequences of the ones
+// above.
+//
+// The _LONG instructions at the end are the same as their namesakes, except that the constant,
+// local slot, upvalue, global slot or jump operand takes three bytes instead of one or two, and so
+// does the inline cache index of the property and invoke forms. The compiler only uses one when an
+// index or distance doesn't fit the short form, so ordinary code never pays for the wider
+// operands. OP_CLOSURE_LONG's upvalue pairs are an isLocal byte and a three-byte index.
+//
+// Last come the quickened instructions, which nothing but run() writes. The first time a generic
+// arithmetic or comparison instruction runs, it rewrites itself in place into the form specialized
+// for the operand types it found, and that form turns itself back into the generic one the first
+// time its guard fails. They never appear in a chunk that hasn't run, so neither the optimizer nor
+// a bytecode file has to know about them.
+#define FOR_EACH_OPCODE(OPCODE)         \
+    OPCODE(OP_CONSTANT, 1)              \
+    OPCODE(OP_NIL, 0)                   \
+    OPCODE(OP_TRUE, 0)                  \
+    OPCODE(OP_FALSE, 0)                 \
+    OPCODE(OP_POP, 0)                   \
+    OPCODE(OP_GET_LOCAL, 1)             \
+    OPCODE(OP_SET_LOCAL, 1)             \
+    OPCODE(OP_GET_GLOBAL, 2)            \
+    OPCODE(OP_DEFINE_GLOBAL, 2)         \
+    OPCODE(OP_SET_GLOBAL, 2)            \
+    OPCODE(OP_GET_UPVALUE, 1)           \
+    OPCODE(OP_SET_UPVALUE, 1)           \
+    OPCODE(OP_GET_PROPERTY, 3)          \
+    OPCODE(OP_SET_PROPERTY, 3)          \
+    OPCODE(OP_GET_SUPER, 1)             \
+    OPCODE(OP_EQUAL, 0)                 \
+    OPCODE(OP_GREATER, 0)               \
+    OPCODE(OP_LESS, 0)                  \
+    OPCODE(OP_ADD, 0)                   \
+    OPCODE(OP_SUBTRACT, 0)              \
+    OPCODE(OP_MULTIPLY, 0)              \
+    OPCODE(OP_DIVIDE, 0)                \
+    OPCODE(OP_NOT, 0)                   \
+    OPCODE(OP_NEGATE, 0)                \
+    OPCODE(OP_PRINT, 0)                 \
+    OPCODE(OP_JUMP, 2)                  \
+    OPCODE(OP_JUMP_IF_FALSE, 2)         \
+    OPCODE(OP_JUMP_IF_TRUE, 2)          \
+    OPCODE(OP_LOOP, 2)                  \
+    OPCODE(OP_CALL, 1)                  \
+    OPCODE(OP_INVOKE, 4)                \
+    OPCODE(OP_SUPER_INVOKE, 2)          \
+    OPCODE(OP_CLOSURE, 1)               \
+    OPCODE(OP_CLOSE_UPVALUE, 0)         \
+    OPCODE(OP_RETURN, 0)                \
+    OPCODE(OP_CLASS, 1)                 \
+    OPCODE(OP_INHERIT, 0)               \
+    OPCODE(OP_METHOD, 1)                \
+    OPCODE(OP_BUILD_LIST, 1)            \
+    OPCODE(OP_EXTEND_LIST, 1)           \
+    OPCODE(OP_GET_INDEX, 0)             \
+    OPCODE(OP_SET_INDEX, 0)             \
+    OPCODE(OP_GET_ENCLOSING, 1)         \
+    OPCODE(OP_SET_ENCLOSING, 1)         \
+    OPCODE(OP_GET_LOCAL_0, 0)           \
+    OPCODE(OP_GET_LOCAL_1, 0)           \
+    OPCODE(OP_GET_LOCAL_2, 0)           \
+    OPCODE(OP_GET_LOCAL_3, 0)           \
+    OPCODE(OP_SET_LOCAL_POP, 1)         \
+    OPCODE(OP_POP_N, 1)                 \
+    OPCODE(OP_ADD_LOCAL_CONST, 2)       \
+    OPCODE(OP_INCREMENT_LOCAL, 2)       \
+    OPCODE(OP_LESS_JUMP_IF_FALSE, 2)    \
+    OPCODE(OP_GREATER_JUMP_IF_FALSE, 2) \
+    OPCODE(OP_CONSTANT_LONG, 3)         \
+    OPCODE(OP_GET_LOCAL_LONG, 3)        \
+    OPCODE(OP_SET_LOCAL_LONG, 3)        \
+    OPCODE(OP_GET_UPVALUE_LONG, 3)      \
+    OPCODE(OP_SET_UPVALUE_LONG, 3)      \
+    OPCODE(OP_GET_GLOBAL_LONG, 3)       \
+    OPCODE(OP_DEFINE_GLOBAL_LONG, 3)    \
+    OPCODE(OP_SET_GLOBAL_LONG, 3)       \
+    OPCODE(OP_GET_PROPERTY_LONG, 6)     \
+    OPCODE(OP_SET_PROPERTY_LONG, 6)     \
+    OPCODE(OP_GET_SUPER_LONG, 3)        \
+    OPCODE(OP_JUMP_LONG, 3)             \
+    OPCODE(OP_JUMP_IF_FALSE_LONG, 3)    \
+    OPCODE(OP_LOOP_LONG, 3)             \
+    OPCODE(OP_INVOKE_LONG, 7)           \
+    OPCODE(OP_SUPER_INVOKE_LONG, 4)     \
+    OPCODE(OP_CLOSURE_LONG, 3)          \
+    OPCODE(OP_CLASS_LONG, 3)            \
+    OPCODE(OP_METHOD_LONG, 3)           \
+    OPCODE(OP_GET_ENCLOSING_LONG, 3)    \
+    OPCODE(OP_SET_ENCLOSING_LONG, 3)    \
+    OPCODE(OP_EQUAL_NUM, 0)             \
+    OPCODE(OP_GREATER_NUM, 0)           \
+    OPCODE(OP_LESS_NUM, 0)              \
+    OPCODE(OP_ADD_NUM, 0)               \
+    OPCODE(OP_ADD_STR, 0)               \
+    OPCODE(OP_SUBTRACT_NUM, 0)          \
+    OPCODE(OP_MULTIPLY_NUM, 0)          \
+    OPCODE(OP_DIVIDE_NUM, 0)
+
 typedef enum OpCode {
-    OP_CONSTANT,
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
-    OP_POP,
-    OP_GET_LOCAL,
-    OP_SET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_DEFINE_GLOBAL,
-    OP_SET_GLOBAL,
-    OP_GET_UPVALUE,
-    OP_SET_UPVALUE,
-    OP_GET_PROPERTY,
-    OP_SET_PROPERTY,
-    OP_GET_SUPER,
-    OP_EQUAL,
-    OP_GREATER,
-    OP_LESS,
-    OP_ADD,
-    OP_SUBTRACT,
-    OP_MULTIPLY,
-    OP_DIVIDE,
-    OP_NOT,
-    OP_NEGATE,
-    OP_PRINT,
-    OP_JUMP,
-    OP_JUMP_IF_FALSE,
-    OP_LOOP,
-    OP_CALL,
-    OP_INVOKE,
-    OP_SUPER_INVOKE,
-    OP_CLOSURE,
-    OP_CLOSE_UPVALUE,
-    OP_RETURN,
-    OP_CLASS,
-    OP_INHERIT,
-    OP_METHOD
+#define OPCODE(name, operands) name,
+    FOR_EACH_OPCODE(OPCODE)
+#undef OPCODE
+    OPCODE_COUNT  // Not an instruction, just the number of them.
 } OpCode;
 
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjShape   ObjShape;
+
+// How many receiver shapes a single property access or invoke site remembers before it starts
+// evicting. Most sites only ever see one shape, a few see a handful, and sites that see more than
+// this are rare enough that falling back to the slow lookups is fine.
+#define INLINE_CACHE_WAYS 4
+
+typedef struct InlineCacheEntry {
+    uint32_t shapeId;       // ObjShape.id of the receiver the entry was filled for. 0 means empty.
+    uint32_t classVersion;  // ObjClass.version of the receiver's class at the time.
+    int      slot;          // Field slot the name lives in, or -1 if it resolved to a method.
+    // OP_GET_PROPERTY and OP_INVOKE: the method, when slot is -1.
+    ObjClosure* method;
+    // OP_SET_PROPERTY: the shape the receiver moves to when the store adds a new field in slot, or
+    // NULL when the field already exists.
+    ObjShape* transition;
+} InlineCacheEntry;
+
+/* Every OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE carries a 16-bit index into its chunk's
+array of these, and their _LONG forms a 24-bit one. An entry remembers how the name resolved for
+one receiver shape: either a field slot or the method closure found on the class. Entries record
+the shape's id and the class's version number rather than pointers; both are unique across the VM
+and never reused, and a class gets a new version whenever its method table changes, so a stale
+entry simply stops matching and nothing in here has to be traced or cleared by the GC. */
+typedef struct InlineCache {
+    InlineCacheEntry entries[INLINE_CACHE_WAYS];
+} InlineCache;
+
+/* Source lines are stored run-length encoded: an entry for each point in the code where the line
+changes, giving the offset of the first byte compiled from the new line. Consecutive instructions
+almost always share a line, so this takes a fraction of the space one line per byte of code would,
+and it's only ever read to report an error or disassemble. */
+typedef struct LineStart {
+    int offset;
+    int line;
+} LineStart;
+
 typedef struct Chunk {
-    int        count;
-    int        capacity;
-    uint8_t*   code;
-    int*       lines;
-    ValueArray constants;
+    int          count;
+    int          capacity;
+    uint8_t*     code;
+    int          lineCount;
+    int          lineCapacity;
+    LineStart*   lines;
+    ValueArray   constants;
+    int          cacheCount;
+    int          cacheCapacity;
+    InlineCache* caches;
 } Chunk;
 
-void initChunk(Chunk* chunk);
-void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-int  addConstant(Chunk* chunk, Value value);
+void     initChunk(Chunk* chunk);
+void     freeChunk(Chunk* chunk);
+void     writeChunk(Chunk* chunk, uint8_t byte, int line);
+void     addLine(Chunk* chunk, int offset, int line);
+int      getLine(Chunk* chunk, int offset);
+int      addConstant(Chunk* chunk, Value value);
+int      addInlineCache(Chunk* chunk);
+int      instructionLength(Chunk* chunk, int offset);
+uint32_t readLongOperand(Chunk* chunk, int offset);
+OpCode   genericOpcode(uint8_t instruction);
+int      jumpTarget(Chunk* chunk, int offset);
+int      maxStackDepth(Chunk* chunk, int initialDepth);
 
 #endif
\ No newline at end of file
@@ -6,12 +6,34 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+// Pack every Value into a single 64-bit word using the spare bits of quiet NaNs. Commenting this
+// out falls back to the portable 16-byte tagged union in value.h.
+#define NAN_BOXING
+
+// The debug and instrumented build profiles in the Makefile turn these on from the command line.
 //#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+//#define DEBUG_TRACE_EXECUTION
+//#define DEBUG_COUNT_INSTRUCTIONS
 
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 
+// COMPUTED_GOTO is set by the Makefile. Labels-as-values is a GNU extension, so fall back to the
+// switch dispatch when building with a compiler that doesn't have it.
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO
+#endif
+
+// CLOX_JIT is set by the Makefile too. The JIT writes x86-64 code that knows the NaN-boxed value
+// layout, and maps it executable the POSIX way.
+#if defined(CLOX_JIT) && !(defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING))
+#undef CLOX_JIT
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// The range of a long instruction's three-byte operand.
+#define UINT24_MAX   0xffffff
+#define UINT24_COUNT (UINT24_MAX + 1)
+
 #endif
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "common.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "vm.h"
 
@@ -19,6 +20,9 @@ typedef struct Parser {
     Token previous;
     bool  hadError;
     bool  panicMode;
+    bool  wideJumps;     // Emit every forward jump in its long form. See compile().
+    bool  jumpOverflow;  // A short forward jump turned out to be too far to patch.
+    Table names;         // Identifiers interned while compiling from a file. See advance().
 } Parser;
 
 typedef enum Precedence {
@@ -47,11 +51,14 @@ typedef struct Local {
     Token name;
     int   depth;
     bool  isCaptured;
+    // For a local function that so far has only been called directly, the offset of the
+    // OP_CLOSURE that created it. See borrowUpvalues(). Otherwise -1.
+    int   closure;
 } Local;
 
 typedef struct Upvalue {
-    uint8_t index;
-    bool    isLocal;
+    int  index;
+    bool isLocal;
 } Upvalue;
 
 typedef enum FunctionType {
@@ -66,10 +73,14 @@ typedef struct Compiler {
     ObjFunction*     function;
     FunctionType     type;
 
-    Local   locals[UINT8_COUNT];
-    int     localCount;
-    Upvalue upvalues[UINT8_COUNT];
-    int     scopeDepth;
+    // Long instructions can address far more locals and upvalues than it would be sensible to
+    // reserve room for up front, so both arrays grow as the function needs them.
+    Local*   locals;
+    int      localCount;
+    int      localCapacity;
+    Upvalue* upvalues;
+    int      upvalueCapacity;
+    int      scopeDepth;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -78,13 +89,14 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
+// Like the VM, the compiler's state is per thread, so separate threads can compile at once.
+_Thread_local Parser parser;
 
-Compiler* current = NULL;
+_Thread_local Compiler* current = NULL;
 
-ClassCompiler* currentClass = NULL;
+_Thread_local ClassCompiler* currentClass = NULL;
 
-Chunk* compilingChunk;
+_Thread_local Chunk* compilingChunk;
 
 static Chunk* currentChunk() { return &current->function->chunk; }
 
@@ -104,26 +116,33 @@ static bool match(TokenType type);
 static void emitByte(uint8_t byte);
 static void emitBytes(uint8_t byte1, uint8_t byte2);
 static void emitReturn();
+static void emitLong(int value);
+static void emitIndexed(uint8_t instruction, uint8_t longInstruction, int index);
 static void emitConstant(Value value);
 static int  emitJump(uint8_t instruction);
 static void patchJump(int offset);
 static void emitLoop(int loopStart);
+static void emitCached(uint8_t instruction, uint8_t longInstruction, int name, int argCount);
+static void emitGlobal(uint8_t instruction, uint8_t longInstruction, int slot);
 
 // Variable/constant/scope helpers
-static uint8_t makeConstant(Value value);
-static uint8_t identifierConstant(Token* name);
+static int     makeConstant(Value value);
+static int     identifierConstant(Token* name);
 static Token syntheticToken(const char* name);
 static void    declareVariable();
 static bool    identifiersEqual(Token* a, Token* b);
 static int     resolveLocal(Compiler* compiler, Token* name);
 static int     resolveUpvalue(Compiler* compiler, Token* name);
+static Local*  pushLocal();
 static void    addLocal(Token name);
-static int     addUpvalue(Compiler* compiler, uint8_t index, bool isLocal);
+static void    borrowUpvalues(Local* local);
+static int     addUpvalue(Compiler* compiler, int index, bool isLocal);
 static void    namedVariable(Token name, bool canAssign);
-static void    defineVariable(uint8_t global);
+static int     globalVariable(Token* name);
+static void    defineVariable(int global);
 static uint8_t argumentList();
 static void    markInitialized();
-static uint8_t parseVariable(const char* errorMessage);
+static int     parseVariable(const char* errorMessage);
 static void    beginScope();
 static void    endScope();
 
@@ -131,6 +150,7 @@ static void    endScope();
 static void         initCompiler(Compiler* compiler, FunctionType type);
 ObjFunction*        compile(const char* source);
 static ObjFunction* endCompiler();
+static void         freeCompiler(Compiler* compiler);
 
 // Recursive descent
 static void expression();
@@ -158,10 +178,12 @@ static void       binary(bool canAssign);
 static void       unary(bool canAssign);
 static void       call(bool canAssign);
 static void       dot(bool canAssign);
+static void       subscript(bool canAssign);
 static void       grouping(bool canAssign);
 static void       number(bool canAssign);
 static void       string(bool canAssign);
 static void       literal(bool canAssign);
+static void       list(bool canAssign);
 static void       variable(bool canAssign);
 static void       this_(bool canAssign);
 static void       and_(bool canAssign);
@@ -173,17 +195,17 @@ static void errorAt(Token* token, const char* message) {
     if (parser.panicMode) return;
     parser.panicMode = true;
 
-    fprintf(stderr, "[line %d] Error", token->line);
+    fprintf(vm.err, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(vm.err, " at end");
     } else if (token->type == TOKEN_ERROR) {
         // Nothing.
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(vm.err, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message);
+    fprintf(vm.err, ": %s\n", message);
     parser.hadError = true;
 }
 
@@ -191,11 +213,24 @@ static void error(const char* message) { errorAt(&parser.previous, message); }
 
 static void errorAtCurrent(const char* message) { errorAt(&parser.current, message); }
 
+// Points an identifier at an interned copy of its name, which stays put once the file scanner's
+// window has moved on. The copies are kept in parser.names so they live until the compiler's done.
+static void internName(Token* token) {
+    ObjString* name = copyString(token->start, token->length);
+    push(OBJ_VAL(name));
+    tableSet(&parser.names, name, NIL_VAL);
+    pop();
+    token->start = name->chars;
+}
+
 static void advance() {
     parser.previous = parser.current;
 
     for (;;) {
         parser.current = scanToken();
+        if (parser.current.type == TOKEN_IDENTIFIER && isScanningFile()) {
+            internName(&parser.current);
+        }
         if (parser.current.type != TOKEN_ERROR) break;
 
         errorAtCurrent(parser.current.start);
@@ -240,20 +275,48 @@ static void emitReturn() {
     emitByte(OP_RETURN);
 }
 
+// Emits the three-byte operand of a long instruction, big-endian like the rest.
+static void emitLong(int value) {
+    emitByte((value >> 16) & 0xff);
+    emitBytes((value >> 8) & 0xff, value & 0xff);
+}
+
+// Emits an instruction whose first operand is a constant, local slot or upvalue index. Almost
+// every index fits in a byte, and only one that doesn't pays for the longer instruction.
+static void emitIndexed(uint8_t instruction, uint8_t longInstruction, int index) {
+    if (index <= UINT8_MAX) {
+        emitBytes(instruction, (uint8_t)index);
+    } else {
+        emitByte(longInstruction);
+        emitLong(index);
+    }
+}
+
 // Adds a constant to the chunk's dynamic value array, and returns the index to constant
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    // The function being compiled is reachable, so it may have been promoted by an earlier
+    // collection while its constant table is still filling up.
+    writeBarrier((Obj*)current->function, value);
+    if (constant > UINT24_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
-static void emitConstant(Value value) { emitBytes(OP_CONSTANT, makeConstant(value)); }
+static void emitConstant(Value value) {
+    emitIndexed(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
+}
 
 static int emitJump(uint8_t instruction) {
+    if (parser.wideJumps) {
+        emitByte(instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG);
+        emitLong(0xffffff);
+        return currentChunk()->count - 3;
+    }
+
     emitByte(instruction);
     emitBytes(0xff, 0xff);
     return currentChunk()->count - 2;
@@ -261,45 +324,108 @@ static int emitJump(uint8_t instruction) {
 
 static void patchJump(int offset) {
     // Offset is the index where the jump instruction itself is written.
+    Chunk*  chunk       = currentChunk();
+    uint8_t instruction = chunk->code[offset - 1];
+    bool    isLong      = instruction == OP_JUMP_LONG || instruction == OP_JUMP_IF_FALSE_LONG;
 
-    // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = currentChunk()->count - offset - 2;
-
-    if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
-    }
+    // Adjust for the bytecode for the jump offset itself.
+    int jump = chunk->count - offset - (isLong ? 3 : 2);
 
     // Jump offset stored big-endian.
-    currentChunk()->code[offset]     = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    if (isLong) {
+        if (jump > UINT24_MAX) error("Too much code to jump over.");
+        chunk->code[offset]     = (jump >> 16) & 0xff;
+        chunk->code[offset + 1] = (jump >> 8) & 0xff;
+        chunk->code[offset + 2] = jump & 0xff;
+    } else if (jump > UINT16_MAX) {
+        // Too far for this pass, so compile() will have to start over with long jumps.
+        parser.jumpOverflow = true;
+    } else {
+        chunk->code[offset]     = (jump >> 8) & 0xff;
+        chunk->code[offset + 1] = jump & 0xff;
+    }
 }
 
 // Emit a new loop instruction which unconditionally jumps backwards to a given offset.
 static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+    // The loop body is already compiled, so unlike a forward jump it's known up front whether the
+    // short form reaches. The +3 is to take into account the size of the OP_LOOP instruction
+    // itself, since the offset is measured from the end of it.
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset <= UINT16_MAX) {
+        emitByte(OP_LOOP);
+        emitBytes((offset >> 8) & 0xff, offset & 0xff);
+        return;
+    }
+
+    // One more for the long form's wider operand.
+    offset++;
+    if (offset > UINT24_MAX) error("Loop body too large.");
+    emitByte(OP_LOOP_LONG);
+    emitLong(offset);
+}
+
+// Emits a property or invoke instruction for the name constant, then its argument count unless
+// argCount is -1, then the index of a fresh inline cache reserved for it in the chunk. The short
+// form takes the name in a byte and the cache index in two, and the long form both in three, so
+// it's used when either one doesn't fit.
+static void emitCached(uint8_t instruction, uint8_t longInstruction, int name, int argCount) {
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT24_MAX) {
+        error("Too many property accesses in one chunk.");
+        return;
+    }
+
+    bool isLong = name > UINT8_MAX || cache > UINT16_MAX;
+    if (isLong) {
+        emitByte(longInstruction);
+        emitLong(name);
+    } else {
+        emitBytes(instruction, (uint8_t)name);
+    }
+    if (argCount != -1) emitByte((uint8_t)argCount);
 
-    // The +2 is to take into account the size of the OP_LOOP instructions's operands.
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    if (isLong) {
+        emitLong(cache);
+    } else {
+        emitBytes((cache >> 8) & 0xff, cache & 0xff);
+    }
+}
 
-    emitBytes((offset >> 8) & 0xff, offset & 0xff);
+// Emits an instruction on the global in slot. Globals live in one VM-wide array, so the short form
+// already takes a 16-bit slot, and the long form a 24-bit one.
+static void emitGlobal(uint8_t instruction, uint8_t longInstruction, int slot) {
+    if (slot <= UINT16_MAX) {
+        emitByte(instruction);
+        emitBytes((slot >> 8) & 0xff, slot & 0xff);
+    } else {
+        emitByte(longInstruction);
+        emitLong(slot);
+    }
 }
 
 static void initCompiler(Compiler* compiler, FunctionType type) {
-    compiler->enclosing  = current;
-    compiler->function   = newFunction();
-    compiler->type       = type;
-    compiler->localCount = 0;
-    compiler->scopeDepth = 0;
-    current              = compiler;
+    compiler->enclosing       = current;
+    compiler->function        = NULL;
+    compiler->type            = type;
+    compiler->locals          = NULL;
+    compiler->localCount      = 0;
+    compiler->localCapacity   = 0;
+    compiler->upvalues        = NULL;
+    compiler->upvalueCapacity = 0;
+    compiler->scopeDepth      = 0;
+    compiler->function        = newFunction();
+    current                   = compiler;
 
     if (type != TYPE_SCRIPT) {
         compiler->function->name = copyString(parser.previous.start, parser.previous.length);
+        writeBarrier((Obj*)compiler->function, OBJ_VAL(compiler->function->name));
     }
 
-    Local* local      = &current->locals[current->localCount++];
+    Local* local      = pushLocal();
     local->depth      = 0;
     local->isCaptured = false;
+    local->closure    = -1;
     if (type != TYPE_FUNCTION) {
         local->name.start  = "this";
         local->name.length = 4;
@@ -312,9 +438,20 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    // The locals of the function's outermost scope are never popped by endScope().
+    for (int i = 0; i < current->localCount; i++) borrowUpvalues(&current->locals[i]);
+
+    // Nothing will run a chunk with errors in it, or one compile() is about to throw away and
+    // start over on, so there's no point optimizing one.
+    bool finished = !parser.hadError && !parser.jumpOverflow;
+    if (vm.optimize && finished) optimizeChunk(currentChunk());
+
+    // Measured on the final code, so the VM can make room for the whole frame up front. Slot zero
+    // and the arguments are already on the stack when the function starts.
+    if (finished) function->maxSlots = maxStackDepth(currentChunk(), function->arity + 1);
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
+    if (finished) {
         disassembleChunk(currentChunk(),
                          function->name != NULL ? function->name->chars : "<script>");
     }
@@ -324,6 +461,13 @@ static ObjFunction* endCompiler() {
     return function;
 }
 
+// Frees the compiler's arrays. Separate from endCompiler(), since function() still needs the
+// upvalues after that to emit the closure.
+static void freeCompiler(Compiler* compiler) {
+    FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+    FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+}
+
 static void beginScope() { current->scopeDepth++; }
 
 static void endScope() {
@@ -331,6 +475,7 @@ static void endScope() {
 
     while (current->localCount >= 0 &&
            current->locals[current->localCount - 1].depth > current->scopeDepth) {
+        borrowUpvalues(&current->locals[current->localCount - 1]);
         if (current->locals[current->localCount - 1].isCaptured) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
@@ -386,7 +531,7 @@ static void call(bool canAssign) {
 
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     // The parser may call dot() in a context that is too high
     // precedence to permit a setter to appear. To avoid incorrectly allowing that, we
@@ -397,13 +542,24 @@ static void dot(bool canAssign) {
     // error.
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
-    }else if (match(TOKEN_LEFT_PAREN)) {
+        emitCached(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name, -1);
+    } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
-        emitByte(argCount);
+        emitCached(OP_INVOKE, OP_INVOKE_LONG, name, argCount);
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitCached(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name, -1);
+    }
+}
+
+// Like dot(), this only compiles an assignment when the precedence allows one.
+static void subscript(bool canAssign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitByte(OP_SET_INDEX);
+    } else {
+        emitByte(OP_GET_INDEX);
     }
 }
 
@@ -430,6 +586,27 @@ static void literal(bool canAssign) {
     }
 }
 
+// The items are gathered in batches of up to 255, so a literal of any length only ever has one
+// batch of them on the stack at a time. The first becomes the list, and the rest are appended to
+// it as each fills up.
+static void list(bool canAssign) {
+    int  itemCount = 0;
+    bool built     = false;
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            if (itemCount == UINT8_MAX) {
+                emitBytes(built ? OP_EXTEND_LIST : OP_BUILD_LIST, (uint8_t)itemCount);
+                built     = true;
+                itemCount = 0;
+            }
+            expression();
+            itemCount++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list items.");
+    emitBytes(built ? OP_EXTEND_LIST : OP_BUILD_LIST, (uint8_t)itemCount);
+}
+
 static void parsePrecedence(Precedence precedence) {
     advance();
     ParseFn prefixRule = getRule(parser.previous.type)->prefix;
@@ -482,7 +659,7 @@ static void parsePrecedence(Precedence precedence) {
 
 // Take the given token and add it's lexeme to the chunk's constant table as a string,
 // return the index.
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
@@ -549,8 +726,10 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
     // Try to resolve the identifier as a local variable in the enclosing compiler.
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
+        // A function referred to from inside another one could be called from anywhere.
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        compiler->enclosing->locals[local].closure    = -1;
+        return addUpvalue(compiler, local, true);
     }
 
     /* Otherwise, we look for a local variable beyond the immediately enclosing
@@ -561,26 +740,38 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
      * compilers. */
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, upvalue, false);
     }
 
     return -1;
 }
 
+// Makes room for one more local in the current compiler and returns it.
+static Local* pushLocal() {
+    if (current->localCount == current->localCapacity) {
+        int oldCapacity        = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(oldCapacity);
+        current->locals = GROW_ARRAY(Local, current->locals, oldCapacity, current->localCapacity);
+    }
+
+    return &current->locals[current->localCount++];
+}
+
 /* This creates a new Local and appends it to the compiler’s array of variables. It
 stores the variable’s name and the depth of the scope that owns the variable. */
 static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount == UINT24_COUNT) {
         error("Too many local variables in function.");
         return;
     }
-    Local* local      = &current->locals[current->localCount++];
+    Local* local      = pushLocal();
     local->name       = name;
     local->depth      = -1;
     local->isCaptured = false;
+    local->closure    = -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, int index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     // If we find an upvalue in the array whose slot index matches the one we’re
@@ -593,39 +784,160 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
         }
     }
 
-    if (upvalueCount == UINT8_COUNT) {
+    if (upvalueCount == UINT24_COUNT) {
         error("Too many closure variables in function.");
         return 0;
     }
 
+    if (upvalueCount == compiler->upvalueCapacity) {
+        int oldCapacity           = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues =
+            GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+    }
+
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index   = index;
     return compiler->function->upvalueCount++;
 }
 
+// Finds the function the OP_CLOSURE or OP_CLOSURE_LONG at offset creates, and where its upvalue
+// pairs start.
+static ObjFunction* closureFunction(Chunk* chunk, int offset, bool* isLong, int* pairs) {
+    *isLong      = chunk->code[offset] == OP_CLOSURE_LONG;
+    int constant = *isLong ? (int)readLongOperand(chunk, offset + 1) : chunk->code[offset + 1];
+    *pairs       = offset + (*isLong ? 4 : 2);
+    return AS_FUNCTION(chunk->constants.values[constant]);
+}
+
+/* A local function that nothing refers to but direct calls in the function declaring it can't
+outlive that function's frame, and every call to it comes straight from that frame. So rather than
+capture the locals it closes over, it can borrow them: read and write them in the frame below its
+own, with no ObjUpvalue to allocate, keep on the open list and close. Whether the function escapes
+is only known once its variable goes out of scope, long after its code was compiled, so this
+rewrites that code in place. Every instruction it changes keeps its length. */
+static void borrowUpvalues(Local* local) {
+    if (local->closure == -1 || !vm.optimize || parser.hadError || parser.jumpOverflow) return;
+
+    Chunk*       chunk = currentChunk();
+    bool         isLong;
+    int          pairs;
+    ObjFunction* function = closureFunction(chunk, local->closure, &isLong, &pairs);
+    if (function->upvalueCount == 0) return;
+
+    // The slot in this frame that each upvalue borrows, or -1 if it has to stay an upvalue: one
+    // of an enclosing function's, or one read with a one-byte index that the slot doesn't fit.
+    int* slots = ALLOCATE(int, function->upvalueCount);
+    for (int i = 0; i < function->upvalueCount; i++) {
+        int  at   = pairs + i * (isLong ? 4 : 2);
+        int  slot = isLong ? (int)readLongOperand(chunk, at + 1) : chunk->code[at + 1];
+        bool fits = i > UINT8_MAX || slot <= UINT8_MAX;
+        slots[i]  = chunk->code[at] == 1 && fits ? slot : -1;
+    }
+
+    // A function nested inside captures an upvalue by sharing its ObjUpvalue, so that one has to
+    // stay.
+    Chunk* body = &function->chunk;
+    for (int offset = 0; offset < body->count; offset += instructionLength(body, offset)) {
+        uint8_t instruction = body->code[offset];
+        if (instruction != OP_CLOSURE && instruction != OP_CLOSURE_LONG) continue;
+
+        bool         isNestedLong;
+        int          nestedPairs;
+        ObjFunction* nested = closureFunction(body, offset, &isNestedLong, &nestedPairs);
+        for (int i = 0; i < nested->upvalueCount; i++) {
+            int at    = nestedPairs + i * (isNestedLong ? 4 : 2);
+            int index = isNestedLong ? (int)readLongOperand(body, at + 1) : body->code[at + 1];
+            if (body->code[at] == 0) slots[index] = -1;
+        }
+    }
+
+    for (int offset = 0; offset < body->count; offset += instructionLength(body, offset)) {
+        uint8_t* code = &body->code[offset];
+        switch (code[0]) {
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE: {
+                int slot = slots[code[1]];
+                if (slot == -1) break;
+                code[0] = code[0] == OP_GET_UPVALUE ? OP_GET_ENCLOSING : OP_SET_ENCLOSING;
+                code[1] = (uint8_t)slot;
+                break;
+            }
+            case OP_GET_UPVALUE_LONG:
+            case OP_SET_UPVALUE_LONG: {
+                int slot = slots[readLongOperand(body, offset + 1)];
+                if (slot == -1) break;
+                code[0] = code[0] == OP_GET_UPVALUE_LONG ? OP_GET_ENCLOSING_LONG
+                                                        : OP_SET_ENCLOSING_LONG;
+                code[1] = (slot >> 16) & 0xff;
+                code[2] = (slot >> 8) & 0xff;
+                code[3] = slot & 0xff;
+                break;
+            }
+            default: break;
+        }
+    }
+
+    // And the closure no longer captures what it borrows.
+    for (int i = 0; i < function->upvalueCount; i++) {
+        if (slots[i] == -1) continue;
+        chunk->code[pairs + i * (isLong ? 4 : 2)] = 2;
+        vm.optimizerStats.upvaluesBorrowed++;
+    }
+    FREE_ARRAY(int, slots, function->upvalueCount);
+}
+
 static void namedVariable(Token name, bool canAssign) {
-    uint8_t getOp, setOp;
+    uint8_t getOp, setOp, getLongOp, setLongOp;
     int     arg = resolveLocal(current, &name);
     if (arg != -1) {
-        getOp = OP_GET_LOCAL;
-        setOp = OP_SET_LOCAL;
+        getOp     = OP_GET_LOCAL;
+        setOp     = OP_SET_LOCAL;
+        getLongOp = OP_GET_LOCAL_LONG;
+        setLongOp = OP_SET_LOCAL_LONG;
     } else if ((arg = resolveUpvalue(current, &name)) != -1) {
-        getOp = OP_GET_UPVALUE;
-        setOp = OP_SET_UPVALUE;
+        getOp     = OP_GET_UPVALUE;
+        setOp     = OP_SET_UPVALUE;
+        getLongOp = OP_GET_UPVALUE_LONG;
+        setLongOp = OP_SET_UPVALUE_LONG;
     } else {
-        arg   = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        arg       = globalVariable(&name);
+        getOp     = OP_GET_GLOBAL;
+        setOp     = OP_SET_GLOBAL;
+        getLongOp = OP_GET_GLOBAL_LONG;
+        setLongOp = OP_SET_GLOBAL_LONG;
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(setOp, (uint8_t)arg);
+    bool isAssignment = canAssign && match(TOKEN_EQUAL);
+    if (isAssignment) expression();
+
+    // Anything but calling a local function lets it escape. Assigning to the variable doesn't,
+    // since it only replaces the function.
+    if (getOp == OP_GET_LOCAL && !isAssignment && !check(TOKEN_LEFT_PAREN)) {
+        current->locals[arg].closure = -1;
+    }
+
+    if (getOp == OP_GET_GLOBAL) {
+        emitGlobal(isAssignment ? setOp : getOp, isAssignment ? setLongOp : getLongOp, arg);
+    } else if (isAssignment) {
+        emitIndexed(setOp, setLongOp, arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitIndexed(getOp, getLongOp, arg);
     }
 }
 
+// Resolves a global variable name to its slot in the VM's global array. The variable doesn't have
+// to be defined yet, since globals are late bound; referring to it just reserves the slot.
+static int globalVariable(Token* name) {
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT24_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
+}
+
 static void variable(bool canAssign) { namedVariable(parser.previous, canAssign); }
 
 static void this_(bool canAssign) {
@@ -674,43 +986,39 @@ static void super_(bool canAssign) {
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     namedVariable(syntheticToken("this"), false);
 
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitIndexed(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
         emitByte(argCount);
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitIndexed(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
-
-
-    namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     /* At runtime, locals aren’t looked up
-    by name. There’s no need to stuff the variable’s name into the constant table so
-    if the declaration is inside a local scope we return a dummy table index instead. */
+    by name. There’s no need to reserve a global slot for the variable's name so
+    if the declaration is inside a local scope we return a dummy slot index instead. */
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 static uint8_t argumentList() {
@@ -736,7 +1044,7 @@ static void markInitialized() {
 static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
 
 static void varDeclaration() {
-    uint8_t slot = parseVariable("Expect variable name.");
+    int slot = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -749,8 +1057,13 @@ static void varDeclaration() {
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
+    // The body goes into a chunk of its own, so this is where the OP_CLOSURE will be. It's set
+    // first so that a call to the function from inside itself counts as escaping.
+    if (current->scopeDepth > 0) {
+        current->locals[current->localCount - 1].closure = currentChunk()->count;
+    }
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
@@ -843,7 +1156,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t paramConstant = parseVariable("Expect parameter name.");
+            int paramConstant = parseVariable("Expect parameter name.");
             defineVariable(paramConstant);
         } while (match(TOKEN_COMMA));
     }
@@ -854,17 +1167,36 @@ static void function(FunctionType type) {
     block();
 
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    int          constant = makeConstant(OBJ_VAL(function));
+
+    // If the constant or any one upvalue index needs more than a byte, they all get three.
+    bool isLong = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        if (compiler.upvalues[i].index > UINT8_MAX) isLong = true;
+    }
+
+    if (isLong) {
+        emitByte(OP_CLOSURE_LONG);
+        emitLong(constant);
+    } else {
+        emitBytes(OP_CLOSURE, (uint8_t)constant);
+    }
 
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        if (isLong) {
+            emitLong(compiler.upvalues[i].index);
+        } else {
+            emitByte((uint8_t)compiler.upvalues[i].index);
+        }
     }
+
+    freeCompiler(&compiler);
 }
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
 
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
@@ -872,17 +1204,17 @@ static void method() {
     }
 
     function(type);
-    emitBytes(OP_METHOD, constant);
+    emitIndexed(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
-    Token   className    = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    Token className    = parser.previous;
+    int   nameConstant = identifierConstant(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitIndexed(OP_CLASS, OP_CLASS_LONG, nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : globalVariable(&className));
 
     ClassCompiler classCompiler;
 
@@ -1043,70 +1375,101 @@ static void statement() {
 }
 
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL      },
-    [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL      },
-    [TOKEN_MINUS]         = {unary,    binary, PREC_TERM      },
-    [TOKEN_PLUS]          = {NULL,     binary, PREC_TERM      },
-    [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR    },
-    [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR    },
-    [TOKEN_BANG]          = {unary,    NULL,   PREC_NONE      },
-    [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY  },
-    [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_EQUAL_EQUAL]   = {NULL,     binary, PREC_EQUALITY  },
-    [TOKEN_GREATER]       = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_LESS_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE      },
-    [TOKEN_STRING]        = {string,   NULL,   PREC_NONE      },
-    [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE      },
-    [TOKEN_AND]           = {NULL,     and_,   PREC_AND       },
-    [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE      },
-    [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE      },
-    [TOKEN_OR]            = {NULL,     or_,    PREC_OR        },
-    [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_SUPER]         = {super_,     NULL,   PREC_NONE      },
-    [TOKEN_THIS]          = {this_,    NULL,   PREC_NONE      },
-    [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE      },
-    [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE      },
+    [TOKEN_LEFT_PAREN]    = {grouping, call,      PREC_CALL      },
+    [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_LEFT_BRACE]    = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_LEFT_BRACKET]  = {list,     subscript, PREC_CALL      },
+    [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_COMMA]         = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_DOT]           = {NULL,     dot,       PREC_CALL      },
+    [TOKEN_MINUS]         = {unary,    binary,    PREC_TERM      },
+    [TOKEN_PLUS]          = {NULL,     binary,    PREC_TERM      },
+    [TOKEN_SEMICOLON]     = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_SLASH]         = {NULL,     binary,    PREC_FACTOR    },
+    [TOKEN_STAR]          = {NULL,     binary,    PREC_FACTOR    },
+    [TOKEN_BANG]          = {unary,    NULL,      PREC_NONE      },
+    [TOKEN_BANG_EQUAL]    = {NULL,     binary,    PREC_EQUALITY  },
+    [TOKEN_EQUAL]         = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_EQUAL_EQUAL]   = {NULL,     binary,    PREC_EQUALITY  },
+    [TOKEN_GREATER]       = {NULL,     binary,    PREC_COMPARISON},
+    [TOKEN_GREATER_EQUAL] = {NULL,     binary,    PREC_COMPARISON},
+    [TOKEN_LESS]          = {NULL,     binary,    PREC_COMPARISON},
+    [TOKEN_LESS_EQUAL]    = {NULL,     binary,    PREC_COMPARISON},
+    [TOKEN_IDENTIFIER]    = {variable, NULL,      PREC_NONE      },
+    [TOKEN_STRING]        = {string,   NULL,      PREC_NONE      },
+    [TOKEN_NUMBER]        = {number,   NULL,      PREC_NONE      },
+    [TOKEN_AND]           = {NULL,     and_,      PREC_AND       },
+    [TOKEN_CLASS]         = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_ELSE]          = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_FALSE]         = {literal,  NULL,      PREC_NONE      },
+    [TOKEN_FOR]           = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_FUN]           = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_IF]            = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_NIL]           = {literal,  NULL,      PREC_NONE      },
+    [TOKEN_OR]            = {NULL,     or_,       PREC_OR        },
+    [TOKEN_PRINT]         = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_RETURN]        = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_SUPER]         = {super_,   NULL,      PREC_NONE      },
+    [TOKEN_THIS]          = {this_,    NULL,      PREC_NONE      },
+    [TOKEN_TRUE]          = {literal,  NULL,      PREC_NONE      },
+    [TOKEN_VAR]           = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_WHILE]         = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_ERROR]         = {NULL,     NULL,      PREC_NONE      },
+    [TOKEN_EOF]           = {NULL,     NULL,      PREC_NONE      },
 };
 
 static ParseRule* getRule(TokenType operatorType) { return &rules[operatorType]; }
 
-ObjFunction* compile(const char* source) {
-    initScanner(source);
+/* A forward jump is emitted before the code it jumps over, so there's no telling yet whether its
+distance will fit in the short form. Nearly all of them do, so every forward jump starts out
+short. In the rare script where one turns out not to fit, the whole thing is compiled again from
+the start with every forward jump in the long form instead, and the optimizer narrows back the
+ones that didn't need it. */
+static ObjFunction* compileScanned() {
+    parser.wideJumps = false;
 
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    for (;;) {
+        Compiler compiler;
+        initCompiler(&compiler, TYPE_SCRIPT);
 
-    parser.hadError  = false;
-    parser.panicMode = false;
+        parser.hadError     = false;
+        parser.panicMode    = false;
+        parser.jumpOverflow = false;
 
-    advance();
+        advance();
 
-    while (!match(TOKEN_EOF)) {
-        declaration();
+        while (!match(TOKEN_EOF)) {
+            declaration();
+        }
+
+        ObjFunction* function = endCompiler();
+        freeCompiler(&compiler);
+        if (parser.hadError) return NULL;
+        if (!parser.jumpOverflow) return function;
+        parser.wideJumps = true;
+        rewindScanner();
     }
+}
 
-    ObjFunction* function = endCompiler();
-    return parser.hadError ? NULL : function;
+ObjFunction* compile(const char* source) {
+    initScanner(source);
+    return compileScanned();
+}
+
+// Compiles the rest of the file open on fd, reading it a window at a time.
+ObjFunction* compileFile(int fd) {
+    initFileScanner(fd);
+    initTable(&parser.names);
+    ObjFunction* function = compileScanned();
+    freeTable(&parser.names);
+    freeScanner();
+    return function;
 }
 
 void markCompilerRoots() {
+    if (isScanningFile()) markTable(&parser.names);
+
     Compiler* compiler = current;
     while (compiler != NULL) {
         markObject((Obj*)compiler->function);
@@ -6,6 +6,7 @@
 #include "vm.h"
 
 ObjFunction* compile(const char* source);
+ObjFunction* compileFile(int fd);
 void         markCompilerRoots();
 
 #endif
\ No newline at end of file
@@ -5,12 +5,23 @@
 #include "chunk.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static int simpleInstruction(const char* name, int offset);
 static int constantInstruction(const char* name, Chunk* chunk, int offset);
 static int invokeInstruction(const char* name, Chunk* chunk, int offset);
+static int propertyInstruction(const char* name, Chunk* chunk, int offset);
 static int byteInstruction(const char* name, Chunk* chunk, int offset);
+static int globalInstruction(const char* name, Chunk* chunk, int offset);
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset);
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset);
+static int closureInstruction(const char* name, bool isLong, Chunk* chunk, int offset);
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset);
+static int invokeLongInstruction(const char* name, Chunk* chunk, int offset);
+static int propertyLongInstruction(const char* name, Chunk* chunk, int offset);
+static int globalLongInstruction(const char* name, Chunk* chunk, int offset);
+static int longInstruction(const char* name, Chunk* chunk, int offset);
+static int jumpLongInstruction(const char* name, int sign, Chunk* chunk, int offset);
 
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
@@ -23,10 +34,11 @@ void disassembleChunk(Chunk* chunk, const char* name) {
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
 
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
@@ -38,13 +50,13 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_POP: return simpleInstruction("OP_POP", offset);
         case OP_GET_LOCAL: return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL: return byteInstruction("OP_SET_LOCAL", chunk, offset);
-        case OP_GET_GLOBAL: return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-        case OP_DEFINE_GLOBAL: return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-        case OP_SET_GLOBAL: return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL: return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL: return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL: return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE: return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE: return byteInstruction("OP_SET_UPVALUE", chunk, offset);
-        case OP_GET_PROPERTY: return constantInstruction("OP_GET_PROPERTY", chunk, offset);
-        case OP_SET_PROPERTY: return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_GET_PROPERTY: return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY: return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER: return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL: return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER: return simpleInstruction("OP_GREATER", offset);
@@ -58,32 +70,84 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_PRINT: return simpleInstruction("OP_PRINT", offset);
         case OP_JUMP: return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE: return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_TRUE: return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
         case OP_LOOP: return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL: return byteInstruction("OP_CALL", chunk, offset);
-        case OP_INVOKE: return invokeInstruction("OP_INVOKE", chunk, offset);
-        case OP_SUPER_INVOKE: return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-        case OP_CLOSURE: {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            printValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
-                int index   = chunk->code[offset++];
-                printf("%04d    |                       %s %d\n", offset - 2,
-                       isLocal ? "local" : "upvalue", index);
-            }
-
-            return offset;
+        case OP_INVOKE: {
+            // The 16-bit inline cache index trails the usual invoke operands.
+            uint16_t cache = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+            invokeInstruction("OP_INVOKE", chunk, offset);
+            printf("%04d    |                       cache %d\n", offset + 3, cache);
+            return offset + 5;
         }
+        case OP_SUPER_INVOKE: return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_CLOSURE: return closureInstruction("OP_CLOSURE", false, chunk, offset);
         case OP_CLOSE_UPVALUE: return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN: return simpleInstruction("OP_RETURN", offset);
         case OP_CLASS: return constantInstruction("OP_CLASS", chunk, offset);
         case OP_INHERIT: return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD: return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_BUILD_LIST: return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_EXTEND_LIST: return byteInstruction("OP_EXTEND_LIST", chunk, offset);
+        case OP_GET_INDEX: return simpleInstruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX: return simpleInstruction("OP_SET_INDEX", offset);
+        case OP_GET_ENCLOSING: return byteInstruction("OP_GET_ENCLOSING", chunk, offset);
+        case OP_SET_ENCLOSING: return byteInstruction("OP_SET_ENCLOSING", chunk, offset);
+        case OP_GET_LOCAL_0: return simpleInstruction("OP_GET_LOCAL_0", offset);
+        case OP_GET_LOCAL_1: return simpleInstruction("OP_GET_LOCAL_1", offset);
+        case OP_GET_LOCAL_2: return simpleInstruction("OP_GET_LOCAL_2", offset);
+        case OP_GET_LOCAL_3: return simpleInstruction("OP_GET_LOCAL_3", offset);
+        case OP_SET_LOCAL_POP: return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_POP_N: return byteInstruction("OP_POP_N", chunk, offset);
+        case OP_ADD_LOCAL_CONST:
+            return localConstantInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+        case OP_INCREMENT_LOCAL:
+            return localConstantInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+        case OP_LESS_JUMP_IF_FALSE:
+            return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_GREATER_JUMP_IF_FALSE:
+            return jumpInstruction("OP_GREATER_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_CONSTANT_LONG: return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+        case OP_GET_LOCAL_LONG: return longInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG: return longInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_GET_UPVALUE_LONG: return longInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
+        case OP_SET_UPVALUE_LONG: return longInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+        case OP_GET_GLOBAL_LONG: return globalLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return globalLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+        case OP_SET_GLOBAL_LONG: return globalLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_GET_PROPERTY_LONG:
+            return propertyLongInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
+        case OP_SET_PROPERTY_LONG:
+            return propertyLongInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
+        case OP_GET_SUPER_LONG: return constantLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
+        case OP_JUMP_LONG: return jumpLongInstruction("OP_JUMP_LONG", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE_LONG:
+            return jumpLongInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+        case OP_LOOP_LONG: return jumpLongInstruction("OP_LOOP_LONG", -1, chunk, offset);
+        case OP_INVOKE_LONG: {
+            uint32_t cache = readLongOperand(chunk, offset + 5);
+            invokeLongInstruction("OP_INVOKE_LONG", chunk, offset);
+            printf("%04d    |                       cache %u\n", offset + 5, cache);
+            return offset + 8;
+        }
+        case OP_SUPER_INVOKE_LONG:
+            return invokeLongInstruction("OP_SUPER_INVOKE_LONG", chunk, offset);
+        case OP_CLOSURE_LONG: return closureInstruction("OP_CLOSURE_LONG", true, chunk, offset);
+        case OP_CLASS_LONG: return constantLongInstruction("OP_CLASS_LONG", chunk, offset);
+        case OP_METHOD_LONG: return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
+        case OP_GET_ENCLOSING_LONG:
+            return longInstruction("OP_GET_ENCLOSING_LONG", chunk, offset);
+        case OP_SET_ENCLOSING_LONG:
+            return longInstruction("OP_SET_ENCLOSING_LONG", chunk, offset);
+        case OP_EQUAL_NUM: return simpleInstruction("OP_EQUAL_NUM", offset);
+        case OP_GREATER_NUM: return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM: return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_ADD_NUM: return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR: return simpleInstruction("OP_ADD_STR", offset);
+        case OP_SUBTRACT_NUM: return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM: return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM: return simpleInstruction("OP_DIVIDE_NUM", offset);
         default: printf("Unknown opcode %d\n", instruction); return offset + 1;
     }
 }
@@ -110,14 +174,150 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 3;
 }
 
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t  constant = chunk->code[offset + 1];
+    uint16_t cache    = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 4;
+}
+
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t slot = chunk->code[offset + 1];
     printf("%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t   slot   = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    ObjString* global = globalName(slot);
+    printf("%-16s %4d '%s'\n", name, slot, global != NULL ? global->chars : "?");
+    return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
     printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
-}
\ No newline at end of file
+}
+
+// A local slot followed by a constant, as in OP_INCREMENT_LOCAL.
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot     = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+// Lists each captured variable on a line of its own after the function. The long form's indexes
+// take three bytes instead of one.
+static int closureInstruction(const char* name, bool isLong, Chunk* chunk, int offset) {
+    int constant = isLong ? (int)readLongOperand(chunk, offset + 1) : chunk->code[offset + 1];
+    offset += isLong ? 4 : 2;
+    printf("%-16s %4d ", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+        int start   = offset;
+        int isLocal = chunk->code[offset++];
+        int index   = isLong ? (int)readLongOperand(chunk, offset) : chunk->code[offset];
+        offset += isLong ? 3 : 1;
+        const char* kind = isLocal == 2 ? "borrowed" : isLocal ? "local" : "upvalue";
+        printf("%04d    |                       %s %d\n", start, kind, index);
+    }
+
+    return offset;
+}
+
+// The long forms mirror the short ones above, with a three-byte first operand.
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t constant = readLongOperand(chunk, offset + 1);
+    printf("%-16s %4u '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int invokeLongInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t constant = readLongOperand(chunk, offset + 1);
+    uint8_t  argCount = chunk->code[offset + 4];
+    printf("%-16s (%d args) %4u '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+    return offset + 5;
+}
+
+static int propertyLongInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t constant = readLongOperand(chunk, offset + 1);
+    uint32_t cache    = readLongOperand(chunk, offset + 4);
+    printf("%-16s %4u '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %u\n", cache);
+    return offset + 7;
+}
+
+static int globalLongInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t   slot   = readLongOperand(chunk, offset + 1);
+    ObjString* global = globalName((int)slot);
+    printf("%-16s %4u '%s'\n", name, slot, global != NULL ? global->chars : "?");
+    return offset + 4;
+}
+
+static int longInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("%-16s %4u\n", name, readLongOperand(chunk, offset + 1));
+    return offset + 4;
+}
+
+static int jumpLongInstruction(const char* name, int sign, Chunk* chunk, int offset) {
+    int jump = (int)readLongOperand(chunk, offset + 1);
+    printf("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
+static const char* opcodeNames[] = {
+#define OPCODE(name, operands) #name,
+    FOR_EACH_OPCODE(OPCODE)
+#undef OPCODE
+};
+
+// Prints how many times each instruction has been executed, most frequent first, with the ticks
+// spent on it in all and on average. Counting is only done when asked for, or in the instrumented
+// build.
+void printInstructionCounts() {
+    int      order[OPCODE_COUNT];
+    uint64_t total      = 0;
+    uint64_t totalTicks = 0;
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        order[i] = i;
+        total += vm.opcodeCounts[i];
+        totalTicks += vm.opcodeTicks[i];
+    }
+
+    // A simple insertion sort. There are only a few dozen opcodes.
+    for (int i = 1; i < OPCODE_COUNT; i++) {
+        int op = order[i];
+        int j  = i - 1;
+        for (; j >= 0 && vm.opcodeCounts[order[j]] < vm.opcodeCounts[op]; j--) {
+            order[j + 1] = order[j];
+        }
+        order[j + 1] = op;
+    }
+
+    fprintf(vm.err, "%-26s %14s %7s %16s %7s %9s\n", "instruction", "count", "share", TICKS_UNIT,
+            "share", "average");
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        uint64_t count = vm.opcodeCounts[order[i]];
+        uint64_t ticks = vm.opcodeTicks[order[i]];
+        if (count == 0) break;
+        fprintf(vm.err, "%-26s %14llu %6.2f%% %16llu %6.2f%% %9.1f\n", opcodeNames[order[i]],
+                (unsigned long long)count, 100.0 * count / total, (unsigned long long)ticks,
+                totalTicks == 0 ? 0.0 : 100.0 * ticks / totalTicks, (double)ticks / count);
+    }
+    fprintf(vm.err, "%-26s %14llu %7s %16llu\n", "total", (unsigned long long)total, "",
+            (unsigned long long)totalTicks);
+}
@@ -5,5 +5,6 @@
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int  disassembleInstruction(Chunk* chunk, int offset);
+void printInstructionCounts();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,860 @@
+#include "jit.h"
+
+#ifdef CLOX_JIT
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "value.h"
+#include "vm.h"
+
+// The stub at the start of every function's code. It sets up the registers below and jumps to
+// target, the code for the instruction frame->ip points at.
+typedef JitStatus (*JitEntry)(VM* vm, CallFrame* frame, uint8_t* target);
+
+typedef enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Reg;
+
+// What compiled code keeps where, from entry to exit. These are all callee-saved, so the helpers
+// leave them alone; everything else is scratch.
+#define VM_REG    RBX
+#define TOP_REG   R12  // A copy of vm.stackTop, written back before any helper reads it.
+#define SLOTS_REG R13  // frame->slots.
+#define FRAME_REG R14
+#define QNAN_REG  R15  // The QNAN mask, for telling numbers from everything else.
+
+// The caller's frame sits just below the innermost one in vm.frames, so this is where its slots
+// are, relative to FRAME_REG.
+#define CALLER_SLOTS ((int32_t)offsetof(CallFrame, slots) - (int32_t)sizeof(CallFrame))
+
+// The condition codes Jcc and SETcc take in their low nibble.
+#define CC_NP 0x0b
+#define CC_E  0x04
+#define CC_NE 0x05
+#define CC_BE 0x06
+#define CC_A  0x07
+
+// Opcodes of the two-operand ALU instructions, in their "op r/m64, r64" form.
+#define ALU_ADD 0x01
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+
+// A rel32 field at offset at, to be pointed at the code for an instruction, or in the case of a
+// deopt, at a stub that hands the instruction to the interpreter.
+typedef struct Fixup {
+    int at;
+    int target;  // An offset in the chunk.
+} Fixup;
+
+typedef struct Assembler {
+    uint8_t* code;
+    int      count;
+    int      capacity;
+    Fixup*   jumps;
+    int      jumpCount;
+    int      jumpCapacity;
+    Fixup*   deopts;
+    int      deoptCount;
+    int      deoptCapacity;
+    int      exitLabel;   // Returns eax from the entry stub.
+    int      deoptLabel;  // Stores rax in frame->ip and returns JIT_INTERPRET.
+    int      frameLabel;  // Goes on with the innermost frame, after a call or return.
+    Chunk*   chunk;
+} Assembler;
+
+static void emitByte(Assembler* as, uint8_t byte) {
+    if (as->count == as->capacity) {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code     = realloc(as->code, as->capacity);
+        if (as->code == NULL) exit(1);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emitBytes(Assembler* as, int count, const uint8_t* bytes) {
+    for (int i = 0; i < count; i++) emitByte(as, bytes[i]);
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void addFixup(Fixup** fixups, int* count, int* capacity, int at, int target) {
+    if (*count == *capacity) {
+        *capacity = *capacity < 8 ? 8 : *capacity * 2;
+        *fixups   = realloc(*fixups, sizeof(Fixup) * *capacity);
+        if (*fixups == NULL) exit(1);
+    }
+    (*fixups)[*count].at     = at;
+    (*fixups)[*count].target = target;
+    (*count)++;
+}
+
+// Points the rel32 field at offset at to the code at offset target.
+static void patch(Assembler* as, int at, int target) {
+    int32_t relative = target - (at + 4);
+    memcpy(&as->code[at], &relative, sizeof(relative));
+}
+
+// A REX prefix, left out when it would have no bits set.
+static void emitRex(Assembler* as, bool wide, int reg, int rm) {
+    uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40) emitByte(as, rex);
+}
+
+static void emitModRM(Assembler* as, int reg, int rm) {
+    emitByte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// The ModRM byte, SIB byte and displacement for [base + disp].
+static void emitMemory(Assembler* as, int reg, Reg base, int32_t disp) {
+    int mod;
+    if (disp == 0 && (base & 7) != RBP) {
+        mod = 0;
+    } else if (disp >= -128 && disp <= 127) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+    emitByte(as, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    // rsp and r12 as a base can only be encoded with a SIB byte.
+    if ((base & 7) == RSP) emitByte(as, 0x24);
+    if (mod == 1) emitByte(as, (uint8_t)disp);
+    if (mod == 2) emit32(as, (uint32_t)disp);
+}
+
+// mov dst, [base + disp]
+static void emitLoad(Assembler* as, Reg dst, Reg base, int32_t disp) {
+    emitRex(as, true, dst, base);
+    emitByte(as, 0x8b);
+    emitMemory(as, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void emitStore(Assembler* as, Reg base, int32_t disp, Reg src) {
+    emitRex(as, true, src, base);
+    emitByte(as, 0x89);
+    emitMemory(as, src, base, disp);
+}
+
+// mov dst, imm, in the shortest form that holds it.
+static void emitMoveImm(Assembler* as, Reg dst, uint64_t imm) {
+    if (imm <= UINT32_MAX) {
+        emitRex(as, false, 0, dst);
+        emitByte(as, 0xb8 + (dst & 7));
+        emit32(as, (uint32_t)imm);
+    } else {
+        emitRex(as, true, 0, dst);
+        emitByte(as, 0xb8 + (dst & 7));
+        emit64(as, imm);
+    }
+}
+
+// op dst, src for one of the ALU_ opcodes.
+static void emitAlu(Assembler* as, uint8_t op, Reg dst, Reg src) {
+    emitRex(as, true, src, dst);
+    emitByte(as, op);
+    emitModRM(as, src, dst);
+}
+
+// lea dst, [base + disp]
+static void emitLea(Assembler* as, Reg dst, Reg base, int32_t disp) {
+    emitRex(as, true, dst, base);
+    emitByte(as, 0x8d);
+    emitMemory(as, dst, base, disp);
+}
+
+static void emitMove(Assembler* as, Reg dst, Reg src) {
+    emitAlu(as, 0x89, dst, src);
+}
+
+// add or sub reg, imm32. Extension 0 is add and 5 is sub.
+static void emitAluImm(Assembler* as, int extension, Reg reg, int32_t imm) {
+    emitRex(as, true, 0, reg);
+    emitByte(as, 0x81);
+    emitModRM(as, extension, reg);
+    emit32(as, (uint32_t)imm);
+}
+
+static void emitAddImm(Assembler* as, Reg reg, int32_t imm) { emitAluImm(as, 0, reg, imm); }
+
+static void emitSubImm(Assembler* as, Reg reg, int32_t imm) { emitAluImm(as, 5, reg, imm); }
+
+// setcc on the low byte of rax, rcx or rdx.
+static void emitSet(Assembler* as, int cc, Reg reg) {
+    emitBytes(as, 2, (uint8_t[]){0x0f, 0x90 + cc});
+    emitModRM(as, 0, reg);
+}
+
+// movq xmm, src
+static void emitToXmm(Assembler* as, int xmm, Reg src) {
+    emitByte(as, 0x66);
+    emitRex(as, true, xmm, src);
+    emitBytes(as, 2, (uint8_t[]){0x0f, 0x6e});
+    emitModRM(as, xmm, src);
+}
+
+// movq dst, xmm
+static void emitFromXmm(Assembler* as, Reg dst, int xmm) {
+    emitByte(as, 0x66);
+    emitRex(as, true, xmm, dst);
+    emitBytes(as, 2, (uint8_t[]){0x0f, 0x7e});
+    emitModRM(as, xmm, dst);
+}
+
+// A scalar double instruction on xmm registers: prefix 0xf2 with 0x58 add, 0x59 mul, 0x5c sub or
+// 0x5e div, or prefix 0x66 with 0x2e for ucomisd.
+static void emitSse(Assembler* as, uint8_t prefix, uint8_t op, int dst, int src) {
+    emitBytes(as, 3, (uint8_t[]){prefix, 0x0f, op});
+    emitModRM(as, dst, src);
+}
+
+// A jump with a rel32 still to be filled in, unconditional for a cc of -1. Returns where the
+// rel32 is.
+static int emitJump(Assembler* as, int cc) {
+    if (cc < 0) {
+        emitByte(as, 0xe9);
+    } else {
+        emitBytes(as, 2, (uint8_t[]){0x0f, 0x80 + cc});
+    }
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static void emitJumpTo(Assembler* as, int cc, int label) {
+    patch(as, emitJump(as, cc), label);
+}
+
+// A jump to the code for the instruction at target in the chunk.
+static void emitBranch(Assembler* as, int cc, int target) {
+    int at = emitJump(as, cc);
+    addFixup(&as->jumps, &as->jumpCount, &as->jumpCapacity, at, target);
+}
+
+// A jump that hands the instruction at offset to the interpreter, before it has changed anything.
+static void emitDeopt(Assembler* as, int cc, int offset) {
+    int at = emitJump(as, cc);
+    addFixup(&as->deopts, &as->deoptCount, &as->deoptCapacity, at, offset);
+}
+
+static void emitPush(Assembler* as, Reg src) {
+    emitStore(as, TOP_REG, 0, src);
+    emitAddImm(as, TOP_REG, sizeof(Value));
+}
+
+// Loads peek(distance) into dst.
+static void emitPeek(Assembler* as, Reg dst, int distance) {
+    emitLoad(as, dst, TOP_REG, -(int32_t)sizeof(Value) * (distance + 1));
+}
+
+// Jumps to the deopt for offset unless the value in reg is a number. Clobbers rcx.
+static void emitCheckNumber(Assembler* as, Reg reg, int offset) {
+    emitMove(as, RCX, reg);
+    emitAlu(as, ALU_AND, RCX, QNAN_REG);
+    emitAlu(as, ALU_CMP, RCX, QNAN_REG);
+    emitDeopt(as, CC_E, offset);
+}
+
+// Loads the two operands of a binary instruction into xmm0 and xmm1, deopting if they aren't
+// both numbers. The stack is left as it was.
+static void emitNumberOperands(Assembler* as, int offset) {
+    emitPeek(as, RAX, 1);
+    emitPeek(as, RDX, 0);
+    emitCheckNumber(as, RAX, offset);
+    emitCheckNumber(as, RDX, offset);
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RDX);
+}
+
+// Branches to the instruction at target if the value in reg is nil or false. Clobbers rcx.
+static void emitBranchIfFalsey(Assembler* as, Reg reg, int target) {
+    emitMoveImm(as, RCX, NIL_VAL);
+    emitAlu(as, ALU_CMP, reg, RCX);
+    emitBranch(as, CC_E, target);
+    emitMoveImm(as, RCX, FALSE_VAL);
+    emitAlu(as, ALU_CMP, reg, RCX);
+    emitBranch(as, CC_E, target);
+}
+
+// Turns the 0 or 1 in al into FALSE_VAL or TRUE_VAL in rax.
+static void emitBoolFromAl(Assembler* as) {
+    emitBytes(as, 3, (uint8_t[]){0x0f, 0xb6, 0xc0});  // movzx eax, al
+    emitMoveImm(as, RCX, FALSE_VAL);
+    emitAlu(as, ALU_ADD, RAX, RCX);
+}
+
+/* Calls a helper with up to three arguments. Before it does, stackTop is written back and
+frame->ip set to ip, the next instruction in the chunk, as if the interpreter had just read
+this one. Neither the frame nor the stack can move while a helper runs: only call() grows them,
+and after a helper that pushes a frame the compiled code switches to it straight away. Only
+stackTop needs loading again afterwards. */
+static void emitCallHelper(Assembler* as, void* helper, uint8_t* ip, int argCount,
+                           uint64_t a, uint64_t b, uint64_t c) {
+    emitStore(as, VM_REG, offsetof(VM, stackTop), TOP_REG);
+    emitMoveImm(as, RAX, (uintptr_t)ip);
+    emitStore(as, FRAME_REG, offsetof(CallFrame, ip), RAX);
+    if (argCount > 0) emitMoveImm(as, RDI, a);
+    if (argCount > 1) emitMoveImm(as, RSI, b);
+    if (argCount > 2) emitMoveImm(as, RDX, c);
+    emitMoveImm(as, RAX, (uintptr_t)helper);
+    emitBytes(as, 2, (uint8_t[]){0xff, 0xd0});  // call rax
+    emitLoad(as, TOP_REG, VM_REG, offsetof(VM, stackTop));
+}
+
+// Leaves the compiled code with whatever status the helper just returned, unless it's
+// JIT_CONTINUE. JIT_FRAME goes on with the new innermost frame instead.
+static void emitCheckStatus(Assembler* as) {
+    emitBytes(as, 3, (uint8_t[]){0x83, 0xf8, JIT_FRAME});  // cmp eax, JIT_FRAME
+    emitJumpTo(as, CC_E, as->frameLabel);
+    emitBytes(as, 2, (uint8_t[]){0x85, 0xc0});  // test eax, eax
+    emitJumpTo(as, CC_NE, as->exitLabel);
+}
+
+/* The entry stub, and the code shared by the whole function for leaving it. After a call or a
+return, the new innermost frame's code is jumped to directly if it has some, just as runJit()
+would have done but without going back out to C to do it. All the code keeps the stack and
+registers the same way, so any of it can leave through any function's exit. */
+static void emitStubs(Assembler* as) {
+    static const uint8_t saves[] = {
+        0x53,        // push rbx
+        0x41, 0x54,  // push r12
+        0x41, 0x55,  // push r13
+        0x41, 0x56,  // push r14
+        0x41, 0x57,  // push r15
+    };
+    // The return address and five registers leave the stack 16-byte aligned for calls.
+    emitBytes(as, sizeof(saves), saves);
+    emitMove(as, VM_REG, RDI);
+    emitMove(as, FRAME_REG, RSI);
+    emitLoad(as, SLOTS_REG, FRAME_REG, offsetof(CallFrame, slots));
+    emitLoad(as, TOP_REG, VM_REG, offsetof(VM, stackTop));
+    emitMoveImm(as, QNAN_REG, QNAN);
+    emitBytes(as, 2, (uint8_t[]){0xff, 0xe2});  // jmp rdx
+
+    as->frameLabel = as->count;
+    emitLoad(as, RAX, VM_REG, offsetof(VM, frames));
+    emitRex(as, true, RCX, VM_REG);
+    emitByte(as, 0x63);  // movsxd rcx, [rbx + frameCount]
+    emitMemory(as, RCX, VM_REG, offsetof(VM, frameCount));
+    emitBytes(as, 4, (uint8_t[]){0x48, 0x6b, 0xc9, sizeof(CallFrame)});  // imul rcx, rcx, imm8
+    emitAlu(as, ALU_ADD, RAX, RCX);
+    emitLea(as, FRAME_REG, RAX, -(int32_t)sizeof(CallFrame));
+    emitLoad(as, RAX, FRAME_REG, offsetof(CallFrame, closure));
+    emitLoad(as, RAX, RAX, offsetof(ObjClosure, function));
+    emitLoad(as, RDX, RAX, offsetof(ObjFunction, jit));
+    emitAlu(as, 0x85, RDX, RDX);  // test rdx, rdx
+    int interpreted = emitJump(as, CC_E);
+    emitLoad(as, RCX, FRAME_REG, offsetof(CallFrame, ip));
+    emitLoad(as, RSI, RAX, offsetof(ObjFunction, chunk) + offsetof(Chunk, code));
+    emitAlu(as, ALU_SUB, RCX, RSI);
+    emitLoad(as, RSI, RDX, offsetof(JitCode, offsets));
+    emitBytes(as, 3, (uint8_t[]){0x8b, 0x0c, 0x8e});  // mov ecx, [rsi + rcx * 4]
+    emitBytes(as, 3, (uint8_t[]){0x83, 0xf9, 0xff});  // cmp ecx, UINT32_MAX
+    int notEntry = emitJump(as, CC_E);
+    emitLoad(as, RDX, RDX, offsetof(JitCode, code));
+    emitAlu(as, ALU_ADD, RCX, RDX);
+    emitLoad(as, SLOTS_REG, FRAME_REG, offsetof(CallFrame, slots));
+    emitLoad(as, TOP_REG, VM_REG, offsetof(VM, stackTop));
+    emitBytes(as, 2, (uint8_t[]){0xff, 0xe1});  // jmp rcx
+    // Left for runJit() to sort out.
+    patch(as, interpreted, as->count);
+    patch(as, notEntry, as->count);
+    emitMoveImm(as, RAX, JIT_FRAME);
+    int leave = emitJump(as, -1);
+
+    as->deoptLabel = as->count;
+    emitStore(as, FRAME_REG, offsetof(CallFrame, ip), RAX);
+    emitStore(as, VM_REG, offsetof(VM, stackTop), TOP_REG);
+    emitMoveImm(as, RAX, JIT_INTERPRET);
+
+    static const uint8_t restores[] = {
+        0x41, 0x5f,  // pop r15
+        0x41, 0x5e,  // pop r14
+        0x41, 0x5d,  // pop r13
+        0x41, 0x5c,  // pop r12
+        0x5b,        // pop rbx
+        0xc3,        // ret
+    };
+    as->exitLabel = as->count;
+    patch(as, leave, as->count);
+    emitBytes(as, sizeof(restores), restores);
+}
+
+static uint64_t constantAt(Chunk* chunk, int index) {
+    return (uint64_t)chunk->constants.values[index];
+}
+
+// Translates the instruction at offset, which is length bytes long.
+static void emitInstruction(Assembler* as, int offset, int length) {
+    Chunk*   chunk = as->chunk;
+    uint8_t* code  = &chunk->code[offset];
+    uint8_t* next  = code + length;
+    uint32_t shortOperand = length >= 3 ? (uint32_t)((code[1] << 8) | code[2]) : 0;
+    uint32_t longOperand  = length >= 4 ? readLongOperand(chunk, offset + 1) : 0;
+    // A quickened instruction compiles just like the generic one, since the inline code checks the
+    // types of its operands anyway.
+    OpCode instruction = genericOpcode(code[0]);
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            emitMoveImm(as, RAX, constantAt(chunk, code[1]));
+            emitPush(as, RAX);
+            break;
+        case OP_CONSTANT_LONG:
+            emitMoveImm(as, RAX, constantAt(chunk, longOperand));
+            emitPush(as, RAX);
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            Value value = code[0] == OP_NIL ? NIL_VAL : BOOL_VAL(code[0] == OP_TRUE);
+            emitMoveImm(as, RAX, value);
+            emitPush(as, RAX);
+            break;
+        }
+        case OP_POP: emitSubImm(as, TOP_REG, sizeof(Value)); break;
+        case OP_POP_N: emitSubImm(as, TOP_REG, sizeof(Value) * code[1]); break;
+
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_LOCAL_0:
+        case OP_GET_LOCAL_1:
+        case OP_GET_LOCAL_2:
+        case OP_GET_LOCAL_3: {
+            uint32_t slot = code[0] == OP_GET_LOCAL        ? code[1]
+                            : code[0] == OP_GET_LOCAL_LONG ? longOperand
+                                                           : (uint32_t)(code[0] - OP_GET_LOCAL_0);
+            emitLoad(as, RAX, SLOTS_REG, sizeof(Value) * slot);
+            emitPush(as, RAX);
+            break;
+        }
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG: {
+            uint32_t slot = code[0] == OP_SET_LOCAL ? code[1] : longOperand;
+            emitPeek(as, RAX, 0);
+            emitStore(as, SLOTS_REG, sizeof(Value) * slot, RAX);
+            break;
+        }
+        case OP_SET_LOCAL_POP:
+            emitSubImm(as, TOP_REG, sizeof(Value));
+            emitLoad(as, RAX, TOP_REG, 0);
+            emitStore(as, SLOTS_REG, sizeof(Value) * code[1], RAX);
+            break;
+
+        // An undefined global is an error, and the interpreter reports it.
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG: {
+            uint32_t slot = code[0] == OP_GET_GLOBAL ? shortOperand : longOperand;
+            emitLoad(as, RAX, VM_REG, offsetof(VM, globalValues) + offsetof(ValueArray, values));
+            emitLoad(as, RAX, RAX, sizeof(Value) * slot);
+            emitMoveImm(as, RCX, UNDEFINED_VAL);
+            emitAlu(as, ALU_CMP, RAX, RCX);
+            emitDeopt(as, CC_E, offset);
+            emitPush(as, RAX);
+            break;
+        }
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG: {
+            uint32_t slot = code[0] == OP_DEFINE_GLOBAL ? shortOperand : longOperand;
+            emitCallHelper(as, jitDefineGlobal, next, 1, slot, 0, 0);
+            break;
+        }
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG: {
+            uint32_t slot = code[0] == OP_SET_GLOBAL ? shortOperand : longOperand;
+            emitCallHelper(as, jitSetGlobal, next, 1, slot, 0, 0);
+            emitCheckStatus(as);
+            break;
+        }
+
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG: {
+            uint32_t slot = code[0] == OP_GET_UPVALUE ? code[1] : longOperand;
+            emitLoad(as, RAX, FRAME_REG, offsetof(CallFrame, closure));
+            emitLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+            emitLoad(as, RAX, RAX, sizeof(ObjUpvalue*) * slot);
+            emitLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+            emitLoad(as, RAX, RAX, 0);
+            emitPush(as, RAX);
+            break;
+        }
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG: {
+            uint32_t slot = code[0] == OP_SET_UPVALUE ? code[1] : longOperand;
+            emitCallHelper(as, jitSetUpvalue, next, 1, slot, 0, 0);
+            break;
+        }
+
+        // A borrowed local is in the caller's frame, on the stack, so needs no write barrier.
+        case OP_GET_ENCLOSING:
+        case OP_GET_ENCLOSING_LONG: {
+            uint32_t slot = code[0] == OP_GET_ENCLOSING ? code[1] : longOperand;
+            emitLoad(as, RAX, FRAME_REG, CALLER_SLOTS);
+            emitLoad(as, RAX, RAX, sizeof(Value) * slot);
+            emitPush(as, RAX);
+            break;
+        }
+        case OP_SET_ENCLOSING:
+        case OP_SET_ENCLOSING_LONG: {
+            uint32_t slot = code[0] == OP_SET_ENCLOSING ? code[1] : longOperand;
+            emitLoad(as, RCX, FRAME_REG, CALLER_SLOTS);
+            emitPeek(as, RAX, 0);
+            emitStore(as, RCX, sizeof(Value) * slot, RAX);
+            break;
+        }
+
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG: {
+            bool     isLong = code[0] == OP_GET_PROPERTY_LONG || code[0] == OP_SET_PROPERTY_LONG;
+            uint64_t name   = (uintptr_t)AS_STRING(
+                chunk->constants.values[isLong ? longOperand : code[1]]);
+            int      cache  = isLong ? (int)readLongOperand(chunk, offset + 4)
+                                     : (code[2] << 8) | code[3];
+            bool     isGet  = code[0] == OP_GET_PROPERTY || code[0] == OP_GET_PROPERTY_LONG;
+            emitCallHelper(as, isGet ? (void*)jitGetProperty : (void*)jitSetProperty, next, 2,
+                           name, (uintptr_t)&chunk->caches[cache], 0);
+            emitCheckStatus(as);
+            break;
+        }
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG: {
+            int index = code[0] == OP_GET_SUPER ? code[1] : (int)longOperand;
+            emitCallHelper(as, jitGetSuper, next, 1,
+                           (uintptr_t)AS_STRING(chunk->constants.values[index]), 0, 0);
+            emitCheckStatus(as);
+            break;
+        }
+
+        // Two numbers are compared as doubles, so that NaN is unequal to itself. Anything else
+        // may involve a rope that has to be flattened first.
+        case OP_EQUAL: {
+            emitPeek(as, RAX, 1);
+            emitPeek(as, RDX, 0);
+            emitMove(as, RCX, RAX);
+            emitAlu(as, ALU_AND, RCX, QNAN_REG);
+            emitAlu(as, ALU_CMP, RCX, QNAN_REG);
+            int notNumbers = emitJump(as, CC_E);
+            emitMove(as, RCX, RDX);
+            emitAlu(as, ALU_AND, RCX, QNAN_REG);
+            emitAlu(as, ALU_CMP, RCX, QNAN_REG);
+            int secondNotNumber = emitJump(as, CC_E);
+            emitToXmm(as, 0, RAX);
+            emitToXmm(as, 1, RDX);
+            emitSse(as, 0x66, 0x2e, 0, 1);  // ucomisd xmm0, xmm1
+            emitSet(as, CC_E, RAX);
+            emitSet(as, CC_NP, RCX);
+            emitBytes(as, 2, (uint8_t[]){0x20, 0xc8});  // and al, cl
+            emitBoolFromAl(as);
+            emitStore(as, TOP_REG, -2 * (int32_t)sizeof(Value), RAX);
+            emitSubImm(as, TOP_REG, sizeof(Value));
+            int done = emitJump(as, -1);
+            patch(as, notNumbers, as->count);
+            patch(as, secondNotNumber, as->count);
+            emitCallHelper(as, jitEqual, next, 0, 0, 0, 0);
+            patch(as, done, as->count);
+            break;
+        }
+
+        case OP_GREATER:
+        case OP_LESS:
+            emitNumberOperands(as, offset);
+            // a < b is b > a, and "above" is false when either is NaN.
+            if (instruction == OP_GREATER) {
+                emitSse(as, 0x66, 0x2e, 0, 1);
+            } else {
+                emitSse(as, 0x66, 0x2e, 1, 0);
+            }
+            emitSet(as, CC_A, RAX);
+            emitBoolFromAl(as);
+            emitStore(as, TOP_REG, -2 * (int32_t)sizeof(Value), RAX);
+            emitSubImm(as, TOP_REG, sizeof(Value));
+            break;
+
+        // Strings, and errors, are left to a helper. The other arithmetic only works on numbers,
+        // so anything else is an error the interpreter can report.
+        case OP_ADD: {
+            emitPeek(as, RAX, 1);
+            emitPeek(as, RDX, 0);
+            emitMove(as, RCX, RAX);
+            emitAlu(as, ALU_AND, RCX, QNAN_REG);
+            emitAlu(as, ALU_CMP, RCX, QNAN_REG);
+            int notNumbers = emitJump(as, CC_E);
+            emitMove(as, RCX, RDX);
+            emitAlu(as, ALU_AND, RCX, QNAN_REG);
+            emitAlu(as, ALU_CMP, RCX, QNAN_REG);
+            int secondNotNumber = emitJump(as, CC_E);
+            emitToXmm(as, 0, RAX);
+            emitToXmm(as, 1, RDX);
+            emitSse(as, 0xf2, 0x58, 0, 1);
+            emitFromXmm(as, RAX, 0);
+            emitStore(as, TOP_REG, -2 * (int32_t)sizeof(Value), RAX);
+            emitSubImm(as, TOP_REG, sizeof(Value));
+            int done = emitJump(as, -1);
+            patch(as, notNumbers, as->count);
+            patch(as, secondNotNumber, as->count);
+            emitCallHelper(as, jitAdd, next, 0, 0, 0, 0);
+            emitCheckStatus(as);
+            patch(as, done, as->count);
+            break;
+        }
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            uint8_t op = instruction == OP_SUBTRACT   ? 0x5c
+                         : instruction == OP_MULTIPLY ? 0x59
+                                                      : 0x5e;
+            emitNumberOperands(as, offset);
+            emitSse(as, 0xf2, op, 0, 1);
+            emitFromXmm(as, RAX, 0);
+            emitStore(as, TOP_REG, -2 * (int32_t)sizeof(Value), RAX);
+            emitSubImm(as, TOP_REG, sizeof(Value));
+            break;
+        }
+
+        case OP_NOT:
+            emitPeek(as, RDX, 0);
+            emitMoveImm(as, RCX, NIL_VAL);
+            emitAlu(as, ALU_CMP, RDX, RCX);
+            emitSet(as, CC_E, RAX);
+            emitMoveImm(as, RCX, FALSE_VAL);
+            emitAlu(as, ALU_CMP, RDX, RCX);
+            emitSet(as, CC_E, RDX);
+            emitBytes(as, 2, (uint8_t[]){0x08, 0xd0});  // or al, dl
+            emitBoolFromAl(as);
+            emitStore(as, TOP_REG, -(int32_t)sizeof(Value), RAX);
+            break;
+        case OP_NEGATE:
+            emitPeek(as, RAX, 0);
+            emitCheckNumber(as, RAX, offset);
+            emitMoveImm(as, RCX, SIGN_BIT);
+            emitAlu(as, ALU_XOR, RAX, RCX);
+            emitStore(as, TOP_REG, -(int32_t)sizeof(Value), RAX);
+            break;
+
+        case OP_PRINT: emitCallHelper(as, jitPrint, next, 0, 0, 0, 0); break;
+
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG: emitBranch(as, -1, jumpTarget(chunk, offset)); break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+            emitPeek(as, RAX, 0);
+            emitBranchIfFalsey(as, RAX, jumpTarget(chunk, offset));
+            break;
+        case OP_JUMP_IF_TRUE: {
+            // Falls through to the next instruction when the value is falsey.
+            emitPeek(as, RAX, 0);
+            emitMoveImm(as, RCX, NIL_VAL);
+            emitAlu(as, ALU_CMP, RAX, RCX);
+            int isNil = emitJump(as, CC_E);
+            emitMoveImm(as, RCX, FALSE_VAL);
+            emitAlu(as, ALU_CMP, RAX, RCX);
+            emitBranch(as, CC_NE, jumpTarget(chunk, offset));
+            patch(as, isNil, as->count);
+            break;
+        }
+
+        case OP_CALL:
+            emitCallHelper(as, jitCall, next, 1, code[1], 0, 0);
+            emitCheckStatus(as);
+            break;
+        case OP_INVOKE:
+        case OP_INVOKE_LONG: {
+            bool isLong = code[0] == OP_INVOKE_LONG;
+            int  index  = isLong ? (int)longOperand : code[1];
+            int  args   = isLong ? code[4] : code[2];
+            int  cache  = isLong ? (int)readLongOperand(chunk, offset + 5)
+                                 : (code[3] << 8) | code[4];
+            emitCallHelper(as, jitInvoke, next, 3,
+                           (uintptr_t)AS_STRING(chunk->constants.values[index]), args,
+                           (uintptr_t)&chunk->caches[cache]);
+            emitCheckStatus(as);
+            break;
+        }
+        case OP_SUPER_INVOKE:
+        case OP_SUPER_INVOKE_LONG: {
+            bool isLong = code[0] == OP_SUPER_INVOKE_LONG;
+            int  index  = isLong ? (int)longOperand : code[1];
+            int  args   = isLong ? code[4] : code[2];
+            emitCallHelper(as, jitSuperInvoke, next, 2,
+                           (uintptr_t)AS_STRING(chunk->constants.values[index]), args, 0);
+            emitCheckStatus(as);
+            break;
+        }
+        // The helper reads the upvalue pairs from frame->ip, so that's left pointing at them.
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: {
+            bool isLong = code[0] == OP_CLOSURE_LONG;
+            int  index  = isLong ? (int)longOperand : code[1];
+            emitCallHelper(as, jitClosure, code + (isLong ? 4 : 2), 2,
+                           (uintptr_t)AS_FUNCTION(chunk->constants.values[index]), isLong, 0);
+            break;
+        }
+        case OP_CLOSE_UPVALUE: emitCallHelper(as, jitCloseUpvalue, next, 0, 0, 0, 0); break;
+        // Never falls through: it goes on with the caller, or leaves with JIT_DONE.
+        case OP_RETURN:
+            emitCallHelper(as, jitReturn, next, 0, 0, 0, 0);
+            emitCheckStatus(as);
+            break;
+
+        case OP_CLASS:
+        case OP_CLASS_LONG: {
+            int index = code[0] == OP_CLASS ? code[1] : (int)longOperand;
+            emitCallHelper(as, jitClass, next, 1,
+                           (uintptr_t)AS_STRING(chunk->constants.values[index]), 0, 0);
+            break;
+        }
+        case OP_INHERIT:
+            emitCallHelper(as, jitInherit, next, 0, 0, 0, 0);
+            emitCheckStatus(as);
+            break;
+        case OP_METHOD:
+        case OP_METHOD_LONG: {
+            int index = code[0] == OP_METHOD ? code[1] : (int)longOperand;
+            emitCallHelper(as, jitMethod, next, 1,
+                           (uintptr_t)AS_STRING(chunk->constants.values[index]), 0, 0);
+            break;
+        }
+
+        case OP_BUILD_LIST: emitCallHelper(as, jitBuildList, next, 1, code[1], 0, 0); break;
+        case OP_EXTEND_LIST: emitCallHelper(as, jitExtendList, next, 1, code[1], 0, 0); break;
+        case OP_GET_INDEX:
+        case OP_SET_INDEX:
+            emitCallHelper(as, code[0] == OP_GET_INDEX ? (void*)jitGetIndex : (void*)jitSetIndex,
+                           next, 0, 0, 0, 0);
+            emitCheckStatus(as);
+            break;
+
+        // The optimizer only fuses these when the constant is a number.
+        case OP_ADD_LOCAL_CONST:
+        case OP_INCREMENT_LOCAL: {
+            int32_t slot = sizeof(Value) * code[1];
+            emitLoad(as, RAX, SLOTS_REG, slot);
+            emitCheckNumber(as, RAX, offset);
+            emitToXmm(as, 0, RAX);
+            emitMoveImm(as, RCX, constantAt(chunk, code[2]));
+            emitToXmm(as, 1, RCX);
+            emitSse(as, 0xf2, 0x58, 0, 1);
+            emitFromXmm(as, RAX, 0);
+            if (code[0] == OP_ADD_LOCAL_CONST) {
+                emitPush(as, RAX);
+            } else {
+                emitStore(as, SLOTS_REG, slot, RAX);
+            }
+            break;
+        }
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+            emitNumberOperands(as, offset);
+            emitSubImm(as, TOP_REG, 2 * sizeof(Value));
+            if (code[0] == OP_GREATER_JUMP_IF_FALSE) {
+                emitSse(as, 0x66, 0x2e, 0, 1);
+            } else {
+                emitSse(as, 0x66, 0x2e, 1, 0);
+            }
+            emitBranch(as, CC_BE, jumpTarget(chunk, offset));
+            break;
+
+        // Anything this doesn't know how to translate is left to the interpreter.
+        default: emitDeopt(as, -1, offset); break;
+    }
+}
+
+/* Translates the function's chunk into machine code and attaches it to the function. Code goes
+into a buffer first and is copied into pages of its own once it's finished, which are then made
+executable and never written again. Fails, leaving the function to the interpreter, only if that
+memory can't be had. */
+bool compileFunction(ObjFunction* function) {
+    Chunk*    chunk = &function->chunk;
+    Assembler as;
+    memset(&as, 0, sizeof(as));
+    as.chunk = chunk;
+
+    uint32_t* offsets = malloc(sizeof(uint32_t) * (chunk->count + 1));
+    if (offsets == NULL) exit(1);
+    for (int i = 0; i <= chunk->count; i++) offsets[i] = UINT32_MAX;
+
+    emitStubs(&as);
+    for (int offset = 0; offset < chunk->count;) {
+        int length      = instructionLength(chunk, offset);
+        offsets[offset] = (uint32_t)as.count;
+        emitInstruction(&as, offset, length);
+        offset += length;
+    }
+
+    for (int i = 0; i < as.jumpCount; i++) {
+        patch(&as, as.jumps[i].at, (int)offsets[as.jumps[i].target]);
+    }
+    for (int i = 0; i < as.deoptCount; i++) {
+        patch(&as, as.deopts[i].at, as.count);
+        emitMoveImm(&as, RAX, (uintptr_t)&chunk->code[as.deopts[i].target]);
+        emitJumpTo(&as, -1, as.deoptLabel);
+    }
+
+    long     page = sysconf(_SC_PAGESIZE);
+    size_t   size = ((size_t)as.count + page - 1) / page * page;
+    uint8_t* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool     done = code != MAP_FAILED;
+    if (done) {
+        memcpy(code, as.code, as.count);
+        if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(code, size);
+            done = false;
+        }
+    }
+
+    free(as.code);
+    free(as.jumps);
+    free(as.deopts);
+    if (!done) {
+        free(offsets);
+        return false;
+    }
+
+    JitCode* jit = malloc(sizeof(JitCode));
+    if (jit == NULL) exit(1);
+    jit->code     = code;
+    jit->size     = size;
+    jit->offsets  = offsets;
+    function->jit = jit;
+    return true;
+}
+
+void freeJitCode(JitCode* jit) {
+    munmap(jit->code, jit->size);
+    free(jit->offsets);
+    free(jit);
+}
+
+// Runs compiled code for as long as the innermost frame has some, following calls and returns
+// from one compiled function into the next. Returns JIT_INTERPRET once the interpreter has to take
+// over, or JIT_ERROR or JIT_DONE if the program got that far.
+JitStatus runJit() {
+    for (;;) {
+        CallFrame*   frame    = &vm.frames[vm.frameCount - 1];
+        ObjFunction* function = frame->closure->function;
+        JitCode*     jit      = function->jit;
+        if (jit == NULL) return JIT_INTERPRET;
+
+        uint32_t offset = jit->offsets[frame->ip - function->chunk.code];
+        if (offset == UINT32_MAX) return JIT_INTERPRET;  // Not an instruction boundary.
+
+        JitStatus status = ((JitEntry)jit->code)(&vm, frame, jit->code + offset);
+        if (status != JIT_FRAME) return status;
+    }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,69 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+
+/* A baseline compiler from bytecode to x86-64 machine code, for the functions that run the most.
+With --jit, every call of a function and every loop back-edge in it adds to its hotness, and once
+that reaches JIT_THRESHOLD the whole chunk is translated in one pass. Locals, constants, jumps and
+arithmetic and comparisons on numbers become inline machine code; anything to do with objects is a
+call to the same runtime functions the interpreter uses.
+
+The compiled code works on vm.stack just like run() does, keeping only a copy of stackTop in a
+register and writing it back, along with frame->ip, before it calls anything that can allocate or
+report an error. So the collector still finds every root on the stack, and stack traces still show
+the right lines. Every instruction is an entry point: a frame can move from run() to compiled code
+at a call, a return or a loop back-edge, whatever instruction it was at. It can always move back
+too. Calls and returns never nest on the C stack: compiled code jumps straight to the code for the
+new innermost frame, or returns to runJit() if it has none. Any instruction the compiled code
+can't finish itself, such as arithmetic on something that isn't a number, hands the frame to the
+interpreter at that instruction to run it there. */
+
+// The hotness at which a function gets compiled.
+#define JIT_THRESHOLD 1000
+
+typedef enum JitStatus {
+    JIT_CONTINUE,   // Go on to the next instruction. Only the runtime helpers return this.
+    JIT_ERROR,      // A runtime error was reported.
+    JIT_FRAME,      // A call or return changed the innermost frame.
+    JIT_DONE,       // The script returned.
+    JIT_INTERPRET,  // The interpreter has to run the innermost frame from its ip.
+} JitStatus;
+
+typedef struct JitCode {
+    uint8_t*  code;     // Mapped executable, starting with the entry stub.
+    size_t    size;     // A whole number of pages.
+    uint32_t* offsets;  // Where in code each instruction starts, by its offset in the chunk.
+} JitCode;
+
+bool      compileFunction(ObjFunction* function);
+void      freeJitCode(JitCode* jit);
+JitStatus runJit();
+
+// What compiled code calls for the instructions it doesn't do inline. They're in vm.c, next to
+// the interpreter's handlers for the same instructions, and work on the innermost frame.
+JitStatus jitSetGlobal(int slot);
+void      jitDefineGlobal(int slot);
+void      jitSetUpvalue(int slot);
+JitStatus jitGetProperty(ObjString* name, InlineCache* cache);
+JitStatus jitSetProperty(ObjString* name, InlineCache* cache);
+JitStatus jitGetSuper(ObjString* name);
+void      jitEqual();
+JitStatus jitAdd();
+void      jitPrint();
+JitStatus jitCall(int argCount);
+JitStatus jitInvoke(ObjString* name, int argCount, InlineCache* cache);
+JitStatus jitSuperInvoke(ObjString* name, int argCount);
+void      jitClosure(ObjFunction* function, bool isLong);
+void      jitCloseUpvalue();
+JitStatus jitReturn();
+void      jitClass(ObjString* name);
+JitStatus jitInherit();
+void      jitMethod(ObjString* name);
+void      jitBuildList(int itemCount);
+void      jitExtendList(int itemCount);
+JitStatus jitGetIndex();
+JitStatus jitSetIndex();
+
+#endif
\ No newline at end of file
@@ -1,9 +1,19 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "bytecode.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "profiler.h"
+#include "server.h"
 #include "vm.h"
 
 static void repl() {
@@ -21,11 +31,13 @@ static void repl() {
     }
 }
 
+// Returns NULL if the file can't be read. The error goes to the VM's error stream, so in a batch it
+// ends up with the rest of that script's output.
 static char* readFile(const char* path) {
     FILE* file = fopen(path, "r");
     if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        fprintf(vm.err, "Could not open file \"%s\".\n", path);
+        return NULL;
     }
 
     fseek(file, 0L, SEEK_END);
@@ -34,14 +46,17 @@ static char* readFile(const char* path) {
 
     char* buffer = (char*)malloc(fileSize + 1);
     if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+        fprintf(vm.err, "Not enough memory to read \"%s\".\n", path);
+        fclose(file);
+        return NULL;
     }
 
     size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
     if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+        fprintf(vm.err, "Could not read file \"%s\".\n", path);
+        free(buffer);
+        fclose(file);
+        return NULL;
     }
 
     buffer[bytesRead] = '\0';
@@ -50,27 +65,339 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
-    char*           source = readFile(path);
-    InterpretResult result = interpret(source);
+static int exitCode(InterpretResult result) {
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+static bool hasSuffix(const char* string, const char* suffix) {
+    size_t length       = strlen(string);
+    size_t suffixLength = strlen(suffix);
+    return length >= suffixLength && strcmp(string + length - suffixLength, suffix) == 0;
+}
+
+// Where the compiled script for the source at path is cached: the same path with a "c" after it.
+static char* cachePathFor(const char* path) {
+    size_t length    = strlen(path);
+    char*  cachePath = malloc(length + 2);
+    if (cachePath == NULL) {
+        fprintf(vm.err, "Not enough memory to read \"%s\".\n", path);
+        return NULL;
+    }
+    memcpy(cachePath, path, length);
+    memcpy(cachePath + length, "c", 2);
+    return cachePath;
+}
+
+// Like runFile(), but compiles a window at a time straight from the file instead of reading it
+// all in first, for a source too big to want in memory twice over.
+static int runStreamed(const char* path, bool useCache) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(vm.err, "Could not open file \"%s\".\n", path);
+        return 74;
+    }
+
+    char*        cachePath = NULL;
+    uint64_t     hash      = 0;
+    ObjFunction* function  = NULL;
+    if (useCache) {
+        cachePath = cachePathFor(path);
+        if (cachePath == NULL) {
+            close(fd);
+            return 74;
+        }
+        if (!hashFile(fd, &hash) || lseek(fd, 0, SEEK_SET) != 0) {
+            fprintf(vm.err, "Could not read file \"%s\".\n", path);
+            free(cachePath);
+            close(fd);
+            return 74;
+        }
+        function = readBytecode(cachePath, &hash);
+    }
+    if (function == NULL) {
+        function = compileFile(fd);
+        if (function != NULL && useCache) writeBytecode(cachePath, function, hash);
+    }
+    free(cachePath);
+    close(fd);
+
+    if (function == NULL) return 65;
+    return exitCode(interpretFunction(function));
+}
+
+// A ".loxc" file is run as it is. Anything else is compiled from source, and with useCache the
+// compiled script is kept next to it as "<path>c" and reused until the source changes.
+static int runFile(const char* path, bool useCache) {
+    if (hasSuffix(path, ".loxc")) {
+        ObjFunction* function = readBytecode(path, NULL);
+        if (function == NULL) {
+            fprintf(vm.err, "Could not load bytecode file \"%s\".\n", path);
+            return 74;
+        }
+        return exitCode(interpretFunction(function));
+    }
+
+    struct stat info;
+    if (stat(path, &info) == 0 && S_ISREG(info.st_mode) &&
+        info.st_size >= SCANNER_STREAM_THRESHOLD) {
+        return runStreamed(path, useCache);
+    }
+
+    char* source = readFile(path);
+    if (source == NULL) return 74;
+
+    // Nothing compiled points back into the source, so it can go before the script runs.
+    char*        cachePath = NULL;
+    uint64_t     hash      = 0;
+    ObjFunction* function  = NULL;
+    if (useCache) {
+        cachePath = cachePathFor(path);
+        if (cachePath == NULL) {
+            free(source);
+            return 74;
+        }
+        hash     = hashSource(source, strlen(source));
+        function = readBytecode(cachePath, &hash);
+    }
+    if (function == NULL) {
+        function = compile(source);
+        // A cache that can't be written just means compiling again next time.
+        if (function != NULL && useCache) writeBytecode(cachePath, function, hash);
+    }
+    free(cachePath);
     free(source);
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (function == NULL) return 65;
+    return exitCode(interpretFunction(function));
 }
 
-int main(int argc, const char* argv[]) {
+typedef struct Options {
+    bool        gcStats;
+    bool        useCache;
+    bool        optStats;
+    bool        optimize;
+    int         sliceUnits;
+    int         gcThreads;
+    bool        countOpcodes;
+    const char* profilePath;  // Where to write the sampling profiler's folded stacks, if anywhere.
+    size_t      initialHeap;
+    double      growthFactor;
+    size_t      maxHeap;  // 0 for no limit.
+    bool        jit;
+} Options;
+
+// Sets up a VM for the calling thread.
+static void startVM(const Options* options) {
     initVM();
+    vm.gcSliceBudget  = options->sliceUnits;
+    vm.optimize       = options->optimize;
+    vm.gcThreads      = options->gcThreads;
+    vm.gcGrowthFactor = options->growthFactor;
+    vm.gcMaxHeap      = options->maxHeap;
+    vm.nextGC         = options->initialHeap;
+    if (vm.gcMaxHeap != 0 && vm.nextGC > vm.gcMaxHeap) vm.nextGC = vm.gcMaxHeap;
+    if (options->countOpcodes) vm.countOpcodes = true;
+    if (options->profilePath != NULL) startProfiler();
+    // Counting and sampling both happen as run() dispatches, so compiled code would go unseen.
+    vm.jit = options->jit && !vm.countOpcodes && options->profilePath == NULL;
+}
+
+// Reports whatever statistics were asked for and tears the calling thread's VM down again.
+static void stopVM(const Options* options) {
+    if (options->profilePath != NULL) {
+        stopProfiler();
+        if (!writeProfile(options->profilePath)) {
+            fprintf(vm.err, "Could not write profile \"%s\".\n", options->profilePath);
+        }
+    }
+    if (options->gcStats) printGCStats();
+    if (options->optStats) printOptimizerStats();
+    if (vm.countOpcodes) printInstructionCounts();
+    freeVM();
+}
 
-    if (argc == 1) {
+/* With --jobs, every script named gets a VM of its own, and a pool of worker threads runs them
+in parallel, each worker taking whichever script is next in line once it's done with the last.
+What a script prints is collected in memory and written out only when the whole batch is done, in
+the order the scripts were given, so the output reads as if they'd been run one after another. */
+typedef struct Job {
+    const char* path;
+    int         status;
+    char*       out;
+    size_t      outLength;
+    char*       err;
+    size_t      errLength;
+} Job;
+
+typedef struct Batch {
+    const Options* options;
+    Job*           jobs;
+    int            count;
+    atomic_int     next;
+} Batch;
+
+static void* runJobs(void* arg) {
+    Batch* batch = (Batch*)arg;
+    for (;;) {
+        int index = atomic_fetch_add(&batch->next, 1);
+        if (index >= batch->count) return NULL;
+
+        Job*  job = &batch->jobs[index];
+        FILE* out = open_memstream(&job->out, &job->outLength);
+        FILE* err = open_memstream(&job->err, &job->errLength);
+        if (out == NULL || err == NULL) exit(1);
+
+        startVM(batch->options);
+        vm.out      = out;
+        vm.err      = err;
+        job->status = runFile(job->path, batch->options->useCache);
+        stopVM(batch->options);
+
+        fclose(out);
+        fclose(err);
+    }
+}
+
+// Returns the exit status of the first script that failed, or 0 if they all succeeded.
+static int runBatch(const Options* options, const char** paths, int count, int threads) {
+    Batch batch;
+    batch.options = options;
+    batch.jobs    = calloc(count, sizeof(Job));
+    batch.count   = count;
+    atomic_init(&batch.next, 0);
+    if (batch.jobs == NULL) exit(1);
+    for (int i = 0; i < count; i++) batch.jobs[i].path = paths[i];
+
+    // No point starting more threads than there are scripts.
+    if (threads > count) threads = count;
+    pthread_t* workers = malloc(sizeof(pthread_t) * threads);
+    if (workers == NULL) exit(1);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, runJobs, &batch) != 0) {
+            fprintf(stderr, "Could not start a worker thread.\n");
+            exit(71);
+        }
+    }
+    for (int i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+    free(workers);
+
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        Job* job = &batch.jobs[i];
+        fwrite(job->out, 1, job->outLength, stdout);
+        fwrite(job->err, 1, job->errLength, stderr);
+        if (status == 0) status = job->status;
+        free(job->out);
+        free(job->err);
+    }
+    free(batch.jobs);
+    return status;
+}
+
+// A number of bytes, with an optional K, M or G after it. Returns 0 if it isn't one.
+static size_t parseSize(const char* text) {
+    char*  end;
+    double size = strtod(text, &end);
+    if (end == text || !(size > 0)) return 0;
+    switch (*end) {
+        case 'K': size *= 1024; end++; break;
+        case 'M': size *= 1024 * 1024; end++; break;
+        case 'G': size *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (*end != '\0' || size >= (double)SIZE_MAX) return 0;
+    return (size_t)size;
+}
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: clox [--gc-stats] [--gc-slice=units] [--gc-threads=threads]\n"
+            "            [--gc-initial-heap=size] [--gc-growth=factor] [--gc-max-heap=size]\n"
+            "            [--opt-stats] [--no-optimize] [--cache] [--count-opcodes]\n"
+            "            [--profile=folded-stacks] [--jit] [script | script.loxc]\n"
+            "       clox [options] --jobs=threads script...\n"
+            "       clox [options] --serve=socket | --serve=-\n");
+    exit(64);
+}
+
+int main(int argc, const char* argv[]) {
+    Options     options   = {false, false, false, true, GC_SLICE_BUDGET, 1, false, NULL,
+                             GC_INITIAL_HEAP, GC_HEAP_GROW_FACTOR, 0, false};
+    int         jobs      = 0;
+    const char* servePath = NULL;  // A socket to take scripts on, or "-" for standard input.
+
+    // Whatever isn't an option is a script to run, and they're gathered up in place in argv.
+    const char** paths     = argv + 1;
+    int          pathCount = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--gc-stats") == 0) {
+            options.gcStats = true;
+        } else if (strcmp(argv[i], "--opt-stats") == 0) {
+            options.optStats = true;
+        } else if (strcmp(argv[i], "--no-optimize") == 0) {
+            options.optimize = false;
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            options.useCache = true;
+        } else if (strcmp(argv[i], "--count-opcodes") == 0) {
+            options.countOpcodes = true;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            options.jit = true;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            options.profilePath = argv[i] + 10;
+            if (options.profilePath[0] == '\0') usage();
+        } else if (strncmp(argv[i], "--gc-slice=", 11) == 0) {
+            options.sliceUnits = atoi(argv[i] + 11);
+            if (options.sliceUnits <= 0) usage();
+        } else if (strncmp(argv[i], "--gc-threads=", 13) == 0) {
+            options.gcThreads = atoi(argv[i] + 13);
+            if (options.gcThreads <= 0) usage();
+        } else if (strncmp(argv[i], "--gc-initial-heap=", 18) == 0) {
+            options.initialHeap = parseSize(argv[i] + 18);
+            if (options.initialHeap == 0) usage();
+        } else if (strncmp(argv[i], "--gc-growth=", 12) == 0) {
+            // A factor of 1 or less would have a major collection start as soon as one finished.
+            char* end;
+            options.growthFactor = strtod(argv[i] + 12, &end);
+            if (*end != '\0' || !(options.growthFactor > 1)) usage();
+        } else if (strncmp(argv[i], "--gc-max-heap=", 14) == 0) {
+            options.maxHeap = parseSize(argv[i] + 14);
+            if (options.maxHeap == 0) usage();
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[i] + 7);
+            if (jobs <= 0) usage();
+        } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+            servePath = argv[i] + 8;
+            if (servePath[0] == '\0') usage();
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            paths[pathCount++] = argv[i];
+        }
+    }
+
+    if (servePath != NULL) {
+        if (pathCount > 0 || jobs > 0) usage();
+        startVM(&options);
+        int status = serve(servePath);
+        stopVM(&options);
+        return status;
+    }
+    if (jobs > 0) {
+        // The profiler's timer is shared by the whole process, so it can only follow one VM.
+        if (pathCount == 0 || options.profilePath != NULL) usage();
+        return runBatch(&options, paths, pathCount, jobs);
+    }
+    if (pathCount > 1) usage();
+
+    startVM(&options);
+    int status = 0;
+    if (pathCount == 0) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [script]\n");
-        exit(64);
+        status = runFile(paths[0], options.useCache);
     }
-
-    freeVM();
-    return 0;
+    stopVM(&options);
+    return status;
 }
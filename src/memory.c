@@ -1,27 +1,70 @@
 #include "memory.h"
 
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
 #include "chunk.h"
 #include "compiler.h"
+#include "jit.h"
 #include "object.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
-
 #include "debug.h"
 #endif
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
+static void beginMajor();
+static void finishMark();
+static void collectSlice(int budget);
+
+// Called for every allocation, after it has been added to bytesAllocated but before the memory
+// is handed out, so that a collection can't see it half initialized.
+static void collectIfNeeded(size_t size) {
+    vm.youngBytes += size;
 
-    if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+    // Mostly minor collections, since those are the ones that fall over when a write barrier is
+    // missing. Every so often a major one starts, and then it advances by the smallest possible
+    // slice on every allocation, giving the program as many chances as it can to break the
+    // collector's invariants in between.
+    static _Thread_local int stressCount = 0;
+    if (vm.gcPhase != GC_IDLE) {
+        collectSlice(1);
+    } else if (++stressCount % 16 == 0) {
+        beginMajor();
+    } else {
+        collectYoungGarbage();
+    }
+    return;
 #endif
 
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+    if (vm.gcPhase != GC_IDLE) {
+        // The nursery isn't collected while a major collection is under way. It just keeps
+        // growing, and the major collection takes care of it at the end of marking. Once it has
+        // outgrown its usual size, every allocation gets a slice, to catch up before the end of
+        // marking has a pile of young objects to deal with all at once.
+        vm.gcDebt += size;
+        if (vm.gcDebt >= GC_SLICE_BYTES || vm.youngBytes > GC_NURSERY_SIZE) {
+            vm.gcDebt = 0;
+            collectSlice(vm.gcSliceBudget);
         }
+    } else if (vm.bytesAllocated > vm.nextGC) {
+        beginMajor();
+    } else if (vm.youngBytes > GC_NURSERY_SIZE) {
+        collectYoungGarbage();
+    }
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    vm.bytesAllocated += newSize - oldSize;
+
+    if (newSize > oldSize) {
+        collectIfNeeded(newSize - oldSize);
     }
     if (newSize == 0) {
         free(pointer);
@@ -33,6 +76,100 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+Obj* allocateObjectMemory(size_t size) {
+    int sizeClass = slabSizeClass(size);
+    if (sizeClass == 0) {
+        Obj* object       = (Obj*)reallocate(NULL, 0, size);
+        object->sizeClass = 0;
+        object->next      = vm.youngObjects;
+        vm.youngObjects   = object;
+        return object;
+    }
+
+    // A slab object is charged for its whole slot, so bytesAllocated still matches what sweeping
+    // it will give back. The pages themselves, and any slots not yet handed out, aren't counted.
+    size_t slotSize = slabClassSize(sizeClass);
+    vm.bytesAllocated += slotSize;
+    collectIfNeeded(slotSize);
+
+    Obj* object       = slabAllocate(sizeClass);
+    object->sizeClass = (uint8_t)sizeClass;
+    return object;
+}
+
+// What the object itself was allocated, not counting anything it owns.
+static size_t objectSize(Obj* object) {
+    if (object->sizeClass != 0) return slabClassSize(object->sizeClass);
+
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE: return sizeof(ObjClosure);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_INSTANCE:
+            return sizeof(ObjInstance) + sizeof(Value) * ((ObjInstance*)object)->inlineCapacity;
+        case OBJ_LIST: return sizeof(ObjList);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_ROPE: return sizeof(ObjRope);
+        case OBJ_SHAPE: return sizeof(ObjShape);
+        case OBJ_STRING: return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+    }
+    return 0;
+}
+
+// Gives back an object's own memory, after freeObject() has released whatever it owns.
+static void releaseObject(Obj* object) {
+    if (object->sizeClass == 0) {
+        reallocate(object, objectSize(object), 0);
+        return;
+    }
+
+    vm.bytesAllocated -= slabClassSize(object->sizeClass);
+    slabFree(object);
+}
+
+// Sets the object's mark, returning false if it was already set.
+static inline bool setMarked(Obj* object) {
+    if (object->sizeClass == 0) {
+        if (object->isMarked) return false;
+        object->isMarked = true;
+        return true;
+    }
+
+    SlabPage* page    = slabPageOf(object);
+    int       granule = slabGranule(page, object);
+    uint64_t  bit     = 1ull << (granule & 63);
+    if (page->marks[granule >> 6] & bit) return false;
+    page->marks[granule >> 6] |= bit;
+    return true;
+}
+
+bool isObjectMarked(Obj* object) {
+    if (object->sizeClass == 0) return object->isMarked;
+
+    SlabPage* page    = slabPageOf(object);
+    int       granule = slabGranule(page, object);
+    return (page->marks[granule >> 6] >> (granule & 63)) & 1;
+}
+
+// setMarked() for when other threads are marking too. Neighbouring slab objects share a word of
+// the bitmap, so the bit has to be set with an atomic operation or another thread's could be lost.
+static inline bool setMarkedAtomic(Obj* object) {
+    if (object->sizeClass == 0) {
+        return !__atomic_exchange_n(&object->isMarked, true, __ATOMIC_RELAXED);
+    }
+
+    SlabPage* page    = slabPageOf(object);
+    int       granule = slabGranule(page, object);
+    uint64_t  bit     = 1ull << (granule & 63);
+    if (__atomic_load_n(&page->marks[granule >> 6], __ATOMIC_RELAXED) & bit) return false;
+    return !(__atomic_fetch_or(&page->marks[granule >> 6], bit, __ATOMIC_RELAXED) & bit);
+}
+
+static void grayArray(Marker* marker, ValueArray* array);
+static void grayTable(Marker* marker, Table* table);
+
 static void markRoots() {
     // Most roots are local variables or temporaries sitting right in the VM's stack
     // So start by walking that.
@@ -53,8 +190,17 @@ static void markRoots() {
     }
 
     // The other main sources of roots are the global variables.
-    // Those live in a hash table owned by the VM.
-    markTable(&vm.globals);
+    // Those live in an array of slots owned by the VM, plus the table naming them. A minor
+    // collection can skip both unless something young has been stored there since the last
+    // collection; the whole global area acts as a single remembered card.
+    if (!vm.collectingYoung || vm.youngGlobals) {
+        grayArray(&vm.marker, &vm.globalValues);
+        markTable(&vm.globalNames);
+    }
+    vm.youngGlobals = false;
+
+    // Whatever the host has pinned is scanned every time, young or not. There's never much of it.
+    grayArray(&vm.marker, &vm.pinned);
 
     // The compiler itself periodically grabs memory from the heap for literals and the constant
     // table. If the GC runs while we’re in the middle of compiling, then any values the
@@ -64,40 +210,126 @@ static void markRoots() {
     markObject((Obj*)vm.initString);
 }
 
-static void blackenObject(Obj* object);
+static void blackenObject(Marker* marker, Obj* object);
 static void traceReferences() {
-    while (vm.grayCount > 0) {
-        Obj* object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
+    while (vm.marker.grayCount > 0) {
+        Obj* object = vm.marker.grayStack[--vm.marker.grayCount];
+        blackenObject(&vm.marker, object);
     }
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object   = vm.objects;
+static void markRemembered() {
+    // Blackening a remembered object marks whatever young objects it points to. Its old children
+    // are skipped like any other old object.
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        Obj* object          = vm.rememberedSet[i];
+        object->isRemembered = false;
+        blackenObject(&vm.marker, object);
+    }
+    vm.rememberedCount = 0;
+}
+
+static void forgetRemembered() {
+    // Once everything in the nursery has been promoted there are no old-to-young pointers left to
+    // remember.
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.rememberedSet[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
+    vm.youngGlobals    = false;
+}
+
+static void sweepYoung() {
+    // Every object in the nursery either dies or is promoted, so the young list is simply taken
+    // apart. Survivors go to the front of the old list.
+    Obj* object = vm.youngObjects;
     while (object != NULL) {
+        Obj* next = object->next;
         if (object->isMarked) {
             object->isMarked = false;
-            previous         = object;
-            object           = object->next;
+            object->isOld    = true;
+            object->next     = vm.objects;
+            vm.objects       = object;
+            vm.gcStats.promotedObjects++;
         } else {
-            Obj* unreached = object;
+            // Rather than scanning the whole string table for white entries, dead young strings
+            // are pulled out of it one by one.
+            if (object->type == OBJ_STRING) tableDelete(&vm.strings, (ObjString*)object);
+            freeObject(object);
+        }
+        object = next;
+    }
+    vm.youngObjects = NULL;
+}
 
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
-            }
+static void sweepYoungPage(SlabPage* page) {
+    // Only the slots that haven't been promoted yet are looked at. Old slots are never marked by a
+    // minor collection, so they would all look dead.
+    for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        uint64_t dead     = page->young[i] & ~page->marks[i];
+        uint64_t promoted = page->young[i] & page->marks[i];
+
+        for (; promoted != 0; promoted &= promoted - 1) {
+            slabObjectAt(page, i * 64 + __builtin_ctzll(promoted))->isOld = true;
+            vm.gcStats.promotedObjects++;
+        }
+        page->marks[i] &= ~page->young[i];
+        page->young[i] = 0;
+
+        for (; dead != 0; dead &= dead - 1) {
+            Obj* object = slabObjectAt(page, i * 64 + __builtin_ctzll(dead));
+            if (object->type == OBJ_STRING) tableDelete(&vm.strings, (ObjString*)object);
+            freeObject(object);
+        }
+    }
+    page->hasYoung = false;
+}
 
-            freeObject(unreached);
+static void sweepYoungPages() {
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        SlabClass* slabClass = &vm.slabClasses[i];
+        for (SlabPage* page = slabClass->pages; page != NULL; page = page->next) {
+            // Nothing on a page that hasn't been allocated from can be young.
+            if (page->hasYoung) sweepYoungPage(page);
         }
+        slabClass->current = slabClass->pages;
     }
 }
 
-void markObject(Obj* object) {
+// Frees the dead old objects on a page, returning how much work that was.
+static int sweepOldPage(SlabPage* page) {
+    int work = 0;
+    for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        // Anything young was allocated after marking finished, so it's unmarked but not dead.
+        uint64_t old = page->used[i] & ~page->young[i];
+        if (old == 0) continue;
+
+        uint64_t dead  = old & ~page->marks[i];
+        page->marks[i] = 0;
+        work++;
+
+        for (; dead != 0; dead &= dead - 1) {
+            freeObject(slabObjectAt(page, i * 64 + __builtin_ctzll(dead)));
+            work++;
+        }
+    }
+    return work;
+}
+
+/* Marking an object turns it gray: its mark is set and it goes on the marker's gray stack, to have
+its own references traced later. A helper thread of a parallel mark must not touch vm, which is
+the helper's own, empty VM rather than the one being collected. Parallel marking only happens in
+major collections, so it has no need for the generational check either. */
+static inline void grayObject(Marker* marker, Obj* object) {
     if (object == NULL) return;
-    if (object->isMarked) return;
+    if (marker->pool != NULL) {
+        if (!setMarkedAtomic(object)) return;
+    } else {
+        // A minor collection assumes every old object is live. Anything young an old object points
+        // to is found through the remembered set instead.
+        if (object->isOld && vm.collectingYoung) return;
+        if (!setMarked(object)) return;
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -105,159 +337,675 @@ void markObject(Obj* object) {
     printf("\n");
 #endif
 
-    object->isMarked = true;
-
-    // We’ll create a separate worklist to keep track of all of the gray objects.
-    // When an object turns gray, in addition to setting the mark field,
-    // we’ll also add it to the worklist.
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack    = realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
-        // If we can’t create or grow the gray stack, then we can’t finish the garbage collection.
-        if (vm.grayStack == NULL) exit(1);
+    // The gray stack is grown with the system allocator. If it can't be grown, the collection
+    // can't finish.
+    if (marker->grayCapacity < marker->grayCount + 1) {
+        marker->grayCapacity = GROW_CAPACITY(marker->grayCapacity);
+        marker->grayStack    = realloc(marker->grayStack, sizeof(Obj*) * marker->grayCapacity);
+        if (marker->grayStack == NULL) exit(1);
     }
 
-    vm.grayStack[vm.grayCount++] = object;
+    marker->grayStack[marker->grayCount++] = object;
 }
 
-void markValue(Value value) {
+static inline void grayValue(Marker* marker, Value value) {
     if (!IS_OBJ(value)) return;
-    markObject(AS_OBJ(value));
+    grayObject(marker, AS_OBJ(value));
 }
 
-static void markArray(ValueArray* array) {
+static void grayArray(Marker* marker, ValueArray* array) {
     for (int i = 0; i < array->count; i++) {
-        markValue(array->values[i]);
+        grayValue(marker, array->values[i]);
+    }
+}
+
+// Like markTable(), but for whichever marker is doing the tracing.
+static void grayTable(Marker* marker, Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        grayObject(marker, (Obj*)entry->key);
+        grayValue(marker, entry->value);
     }
 }
 
-static void blackenObject(Obj* object) {
+void markObject(Obj* object) { grayObject(&vm.marker, object); }
+
+void markValue(Value value) { grayValue(&vm.marker, value); }
+
+static void blackenObject(Marker* marker, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
     switch (object->type) {
-        case OBJ_NATIVE: break;
+        case OBJ_NATIVE: grayObject(marker, (Obj*)((ObjNative*)object)->name); break;
+        case OBJ_ROPE: grayObject(marker, (Obj*)((ObjRope*)object)->flat); break;
         case OBJ_STRING: break;
         case OBJ_UPVALUE: {
             // Since the value is no longer on the stack,
             // we need to make sure we trace the reference to it from the upvalue.
-            markValue(((ObjUpvalue*)object)->closed);
+            grayValue(marker, ((ObjUpvalue*)object)->closed);
             break;
         }
         case OBJ_FUNCTION: {
             // Each function has a reference to an ObjString containing the function’s name.
             // The function has a constant table packed full of references to other objects.
             ObjFunction* function = (ObjFunction*)object;
-            markObject((Obj*)function->name);
-            markArray(&function->chunk.constants);
+            grayObject(marker, (Obj*)function->name);
+            grayArray(marker, &function->chunk.constants);
             break;
         }
         case OBJ_INSTANCE: {
+            // Only the slots the shape says are in use hold live values.
             ObjInstance* instance = (ObjInstance*)object;
-            markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            grayObject(marker, (Obj*)instance->klass);
+            grayObject(marker, (Obj*)instance->shape);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                grayValue(marker, instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            for (int i = 0; i < list->count; i++) grayValue(marker, list->items[i]);
+            break;
+        }
+        case OBJ_SHAPE: {
+            // Transitions are strong references, so a class's whole shape tree lives as long as
+            // the class does.
+            ObjShape* shape = (ObjShape*)object;
+            grayObject(marker, (Obj*)shape->parent);
+            grayObject(marker, (Obj*)shape->name);
+            grayTable(marker, &shape->transitions);
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            markObject((Obj*)klass->name);
-            markTable(&klass->methods);
+            grayObject(marker, (Obj*)klass->name);
+            grayObject(marker, (Obj*)klass->rootShape);
+            grayTable(marker, &klass->methods);
             break;
         }
         case OBJ_CLOSURE: {
             // Each closure has a reference to the bare function it wraps,
             // as well as an array of pointers to the upvalues it captures.
             ObjClosure* closure = (ObjClosure*)object;
-            markObject((Obj*)closure->function);
+            grayObject(marker, (Obj*)closure->function);
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj*)closure->upvalues[i]);
+                grayObject(marker, (Obj*)closure->upvalues[i]);
             }
             break;
         }
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
-            markValue(bound->receiver);
-            markObject((Obj*)bound->method);
+            grayValue(marker, bound->receiver);
+            grayObject(marker, (Obj*)bound->method);
             break;
         }
     }
 }
 
-void collectGarbage() {
+/* With vm.gcThreads above one, a major collection doesn't mark a slice at a time. The VM's thread
+and that many helpers (less one) trace the whole heap together in a single pause, which on a big
+heap and an otherwise idle machine finishes far sooner than incremental marking would. Each thread
+works off its own gray stack. A thread that runs dry waits on the pool, and whenever one is
+waiting, a thread with plenty of work left moves a batch of it into the pool for the waiting
+thread to take. Marking is done when every thread is waiting at once and the pool is empty. */
+typedef struct MarkPool {
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    Marker          shared;   // Gray objects given up by one thread for any other to take.
+    int             threads;  // Marking threads started so far, counting the VM's own.
+    int             waiting;
+    atomic_int      hungry;   // Waiting threads no batch has been shared for yet. Only changed
+                              // under the lock, but read without it to decide whether to share.
+    bool            done;
+} MarkPool;
+
+// Moves objects from the top of one gray stack to the top of another. The caller holds the lock.
+static void moveGray(Marker* from, Marker* to, int count) {
+    if (to->grayCapacity < to->grayCount + count) {
+        while (to->grayCapacity < to->grayCount + count) {
+            to->grayCapacity = GROW_CAPACITY(to->grayCapacity);
+        }
+        to->grayStack = realloc(to->grayStack, sizeof(Obj*) * to->grayCapacity);
+        if (to->grayStack == NULL) exit(1);
+    }
+
+    from->grayCount -= count;
+    memcpy(to->grayStack + to->grayCount, from->grayStack + from->grayCount, sizeof(Obj*) * count);
+    to->grayCount += count;
+}
+
+// Gives up half of the marker's gray objects, or a batch if that's less.
+static void shareGray(Marker* marker) {
+    MarkPool* pool  = marker->pool;
+    int       count = marker->grayCount / 2 < GC_MARK_BATCH ? marker->grayCount / 2 : GC_MARK_BATCH;
+    pthread_mutex_lock(&pool->lock);
+    if (atomic_load(&pool->hungry) > 0) {
+        moveGray(marker, &pool->shared, count);
+        atomic_fetch_sub(&pool->hungry, 1);
+        pthread_cond_signal(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Waits for a batch of shared work, returning false once there's none left anywhere.
+static bool takeGray(Marker* marker) {
+    MarkPool* pool = marker->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->shared.grayCount == 0 && !pool->done) {
+        pool->waiting++;
+        while (pool->shared.grayCount == 0 && !pool->done) {
+            if (pool->waiting == pool->threads) {
+                pool->done = true;
+                pthread_cond_broadcast(&pool->changed);
+                break;
+            }
+            // Another thread can take a batch shared for this one, so rather than counting on
+            // every wakeup being for it, start over from everyone who's waiting on an empty pool.
+            atomic_store(&pool->hungry, pool->waiting);
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        pool->waiting--;
+    }
+
+    bool found = !pool->done;
+    if (found) {
+        int count = pool->shared.grayCount < GC_MARK_BATCH ? pool->shared.grayCount
+                                                           : GC_MARK_BATCH;
+        moveGray(&pool->shared, marker, count);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return found;
+}
+
+static void traceShared(Marker* marker) {
+    do {
+        while (marker->grayCount > 0) {
+            blackenObject(marker, marker->grayStack[--marker->grayCount]);
+            // Tracing depth first keeps gray stacks shallow, so anything more than a single object
+            // is worth splitting with a thread that has nothing.
+            if (marker->grayCount > 1 &&
+                atomic_load_explicit(&marker->pool->hungry, memory_order_relaxed) > 0) {
+                shareGray(marker);
+            }
+        }
+    } while (takeGray(marker));
+}
+
+static void* markHelper(void* arg) {
+    traceShared((Marker*)arg);
+    return NULL;
+}
+
+// Traces everything reachable from the VM's gray stack, using up to vm.gcThreads threads.
+static void traceParallel() {
+    MarkPool pool;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+    pool.shared  = (Marker){0, 0, NULL, &pool};
+    pool.threads = 1;
+    pool.waiting = 0;
+    pool.done    = false;
+    atomic_init(&pool.hungry, 0);
+
+    int        helperCount = vm.gcThreads - 1;
+    Marker*    helpers     = malloc(sizeof(Marker) * helperCount);
+    pthread_t* threads     = malloc(sizeof(pthread_t) * helperCount);
+    if (helpers == NULL || threads == NULL) exit(1);
+
+    // Helpers that can't be started are simply done without. The count only changes under the
+    // lock, so no thread can see every thread waiting before they've all been counted.
+    vm.marker.pool = &pool;
+    int started    = 0;
+    for (int i = 0; i < helperCount; i++) {
+        helpers[started] = (Marker){0, 0, NULL, &pool};
+        pthread_mutex_lock(&pool.lock);
+        pool.threads++;
+        if (pthread_create(&threads[started], NULL, markHelper, &helpers[started]) == 0) {
+            started++;
+        } else {
+            pool.threads--;
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    traceShared(&vm.marker);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        free(helpers[i].grayStack);
+    }
+    vm.marker.pool = NULL;
+
+    free(helpers);
+    free(threads);
+    free(pool.shared.grayStack);
+    pthread_cond_destroy(&pool.changed);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+void rememberObject(Obj* object) {
+    // Like the gray stack, the remembered set is grown with the system allocator so that filling
+    // it in can never set off a collection from inside a write barrier.
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.rememberedSet      = realloc(vm.rememberedSet, sizeof(Obj*) * vm.rememberedCapacity);
+        if (vm.rememberedSet == NULL) exit(1);
+    }
+
+    object->isRemembered                   = true;
+    vm.rememberedSet[vm.rememberedCount++] = object;
+}
+
+static double gcClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Called at the end of every pause, with the time and heap size it started with.
+static void recordPause(double start, size_t before, int* count, double* total, double* max) {
+    double pause = gcClock() - start;
+    (*count)++;
+    *total += pause;
+    if (pause > *max) *max = pause;
+
+    int    bucket       = 0;
+    double microseconds = pause * 1e6;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && microseconds >= (double)(1 << bucket)) bucket++;
+    vm.gcStats.pauseHistogram[bucket]++;
+
+    if (before > vm.gcStats.peakBytes) vm.gcStats.peakBytes = before;
+    if (before > vm.bytesAllocated) vm.gcStats.bytesFreed += before - vm.bytesAllocated;
+}
+
+void markBarrier(Obj* object, Obj* child) {
+    // Shading the child gray rather than graying the marked parent again keeps the amount of
+    // marking left to do from growing behind the collector's back.
+    if (isObjectMarked(object)) markObject(child);
+}
+
+void reviveString(ObjString* string) {
+    // Interning can find a dead string that the sweep hasn't deleted from the table yet. Marking
+    // it brings it back: strings have no references of their own that would need tracing.
+    if (vm.gcPhase == GC_SWEEP_STRINGS) setMarked((Obj*)string);
+}
+
+void collectYoungGarbage() {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    printf("-- minor gc begin\n");
+#endif
+    double start  = gcClock();
     size_t before = vm.bytesAllocated;
+
+    vm.collectingYoung = true;
+    markRoots();
+    markRemembered();
+    traceReferences();
+    sweepYoung();
+    sweepYoungPages();
+    vm.collectingYoung = false;
+    vm.youngBytes      = 0;
+
+    recordPause(start, before, &vm.gcStats.minorCount, &vm.gcStats.minorPauseTotal,
+                &vm.gcStats.minorPauseMax);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %ld bytes from (%ld to %ld)\n", before - vm.bytesAllocated, before,
+           vm.bytesAllocated);
+#endif
+}
+
+static void beginMajor() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
 #endif
+    double start  = gcClock();
+    size_t before = vm.bytesAllocated;
 
+    vm.gcPhase = GC_MARK;
+    vm.gcDebt  = 0;
+    markRoots();
+    if (vm.gcThreads > 1) {
+        traceParallel();
+        finishMark();
+    }
+
+    recordPause(start, before, &vm.gcStats.majorSlices, &vm.gcStats.majorPauseTotal,
+                &vm.gcStats.majorPauseMax);
+}
+
+// The one part of a major collection that can't be split up. The program has been changing its
+// roots without any barrier the whole time marking was going on, so they are scanned once more and
+// whatever that turns up is traced to the end.
+static void finishMark() {
     markRoots();
     traceReferences();
+
+    // Everything live is marked now, including the nursery. Rather than sweeping the nursery
+    // separately, promote it wholesale, marks and all, and let the old sweep sort it out.
+    for (Obj* object = vm.youngObjects; object != NULL;) {
+        Obj* next     = object->next;
+        object->isOld = true;
+        object->next  = vm.objects;
+        vm.objects    = object;
+        object        = next;
+    }
+    vm.youngObjects = NULL;
+
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        for (SlabPage* page = vm.slabClasses[i].pages; page != NULL; page = page->next) {
+            if (!page->hasYoung) continue;
+            for (int word = 0; word < SLAB_BITMAP_WORDS; word++) {
+                for (uint64_t young = page->young[word]; young != 0; young &= young - 1) {
+                    slabObjectAt(page, word * 64 + __builtin_ctzll(young))->isOld = true;
+                }
+                page->young[word] = 0;
+            }
+            page->hasYoung = false;
+        }
+    }
+
+    forgetRemembered();
+    vm.youngBytes = 0;
+
     /* To remove references to unreachable strings, we need to know which strings are
     unreachable. We don’t know that until after the mark phase has completed. But
     we can’t wait until after the sweep phase is done because by then the
     objects—and their mark bits—are no longer around to check. So the right time
     is exactly between the marking and sweeping phases */
-    tableRemoveWhite(&vm.strings);
-    sweep();
+    vm.gcPhase       = GC_SWEEP_STRINGS;
+    vm.sweepIndex    = 0;
+    vm.sweepCapacity = vm.strings.capacity;
+}
+
+// Where the next major collection should start, given how much the last one left live. The
+// maximum heap is a soft limit: a program that keeps more than that live gets to run anyway, with
+// a major collection every time it allocates another nursery's worth, rather than one starting
+// over and over without it ever getting anything done in between.
+static size_t heapTarget(size_t live) {
+    size_t target = (size_t)((double)live * vm.gcGrowthFactor);
+    if (vm.gcMaxHeap != 0 && target > vm.gcMaxHeap) {
+        target = vm.gcMaxHeap > live + GC_NURSERY_SIZE ? vm.gcMaxHeap : live + GC_NURSERY_SIZE;
+    }
+    return target;
+}
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+static void finishMajor() {
+    slabReleaseEmptyPages();
+    vm.nextGC  = heapTarget(vm.bytesAllocated);
+    vm.gcPhase = GC_IDLE;
+    vm.gcStats.majorCount++;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %ld bytes from (%ld to %ld) next at %ld\n", before - vm.bytesAllocated,
-           before, vm.bytesAllocated, vm.nextGC);
+    printf("   %ld bytes live, next at %ld\n", vm.bytesAllocated, vm.nextGC);
 #endif
 }
 
+// Does up to budget units of work on the current phase, returning how many it used. Finishing a
+// phase counts as one, so a slice always makes progress.
+static int collectStep(int budget) {
+    int work = 0;
+    switch (vm.gcPhase) {
+        case GC_IDLE: return budget;
+
+        case GC_MARK: {
+            while (vm.marker.grayCount > 0 && work < budget) {
+                blackenObject(&vm.marker, vm.marker.grayStack[--vm.marker.grayCount]);
+                work++;
+            }
+            if (vm.marker.grayCount == 0) {
+                finishMark();
+                work++;
+            }
+            return work;
+        }
+
+        case GC_SWEEP_STRINGS: {
+            // Interning a new string can grow the table, which moves every entry. Tables only
+            // ever grow, so a change in capacity is enough to notice, and starting over is safe
+            // since only dead old strings get deleted.
+            if (vm.strings.capacity != vm.sweepCapacity) {
+                vm.sweepIndex    = 0;
+                vm.sweepCapacity = vm.strings.capacity;
+            }
+            int start     = vm.sweepIndex;
+            vm.sweepIndex = tableRemoveWhite(&vm.strings, start, budget);
+            work          = vm.sweepIndex - start;
+
+            if (vm.sweepIndex == vm.strings.capacity) {
+                vm.gcPhase   = GC_SWEEP_OBJECTS;
+                vm.sweepLink = &vm.objects;
+                work++;
+            }
+            return work;
+        }
+
+        case GC_SWEEP_OBJECTS: {
+            // Nothing gets added to the old list while a major collection is running, so the link
+            // the last slice stopped at is still good.
+            while (*vm.sweepLink != NULL && work < budget) {
+                Obj* object = *vm.sweepLink;
+                if (object->isMarked) {
+                    object->isMarked = false;
+                    vm.sweepLink     = &object->next;
+                } else {
+                    *vm.sweepLink = object->next;
+                    freeObject(object);
+                }
+                work++;
+            }
+            if (*vm.sweepLink == NULL) {
+                vm.gcPhase    = GC_SWEEP_PAGES;
+                vm.sweepClass = 0;
+                vm.sweepPage  = vm.slabClasses[0].pages;
+                work++;
+            }
+            return work;
+        }
+
+        case GC_SWEEP_PAGES: {
+            // Pages added since the sweep started go on the front of their class's list, behind
+            // the cursor, and only hold young objects anyway.
+            while (work < budget) {
+                if (vm.sweepPage == NULL) {
+                    if (++vm.sweepClass == SLAB_CLASS_COUNT) {
+                        finishMajor();
+                        return work + 1;
+                    }
+                    vm.sweepPage = vm.slabClasses[vm.sweepClass].pages;
+                    continue;
+                }
+                work += 1 + sweepOldPage(vm.sweepPage);
+                vm.sweepPage = vm.sweepPage->next;
+            }
+            return work;
+        }
+    }
+    return budget;
+}
+
+static void collectSlice(int budget) {
+    double start  = gcClock();
+    size_t before = vm.bytesAllocated;
+
+    while (budget > 0 && vm.gcPhase != GC_IDLE) {
+        budget -= collectStep(budget);
+    }
+
+    recordPause(start, before, &vm.gcStats.majorSlices, &vm.gcStats.majorPauseTotal,
+                &vm.gcStats.majorPauseMax);
+}
+
+void collectGarbage() {
+    // Run whatever major collection is under way to completion, then a whole new one, so that
+    // everything unreachable right now is gone by the time this returns.
+    if (vm.gcPhase != GC_IDLE) collectSlice(INT_MAX);
+    beginMajor();
+    collectSlice(INT_MAX);
+}
+
 void freeObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
     switch (object->type) {
-        case OBJ_CLASS: {
-            ObjClass* class = (ObjClass*)object;
-            freeTable(&class->methods);
-            FREE(ObjClass, object);
-            break;
-        }
+        case OBJ_CLASS: freeTable(&((ObjClass*)object)->methods); break;
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
             break;
         }
         case OBJ_FUNCTION: {
-            ObjFunction* function = (ObjFunction*)(object);
+            ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+#ifdef CLOX_JIT
+            if (function->jit != NULL) freeJitCode(function->jit);
+#endif
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->fields != instance->inlineFields) {
+                FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+            }
             break;
         }
-        case OBJ_NATIVE: FREE(ObjNative, object); break;
-        case OBJ_STRING: {
-            ObjString* string = (ObjString*)(object);
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            FREE_ARRAY(Value, list->items, list->capacity);
             break;
         }
-        case OBJ_UPVALUE: FREE(ObjUpvalue, object); break;
+        case OBJ_ROPE: releaseRopeBuffer(((ObjRope*)object)->buffer); break;
+        case OBJ_SHAPE: freeTable(&((ObjShape*)object)->transitions); break;
+        default: break;
     }
+    releaseObject(object);
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
-    while (object->next != NULL) {
+static void freeList(Obj* object) {
+    while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
+}
+
+void freeObjects() {
+    freeList(vm.youngObjects);
+    freeList(vm.objects);
+    vm.youngObjects = NULL;
+    vm.objects      = NULL;
+
+    // Slab objects can still own memory of their own, so free them one by one before the pages.
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        for (SlabPage* page = vm.slabClasses[i].pages; page != NULL; page = page->next) {
+            for (int word = 0; word < SLAB_BITMAP_WORDS; word++) {
+                for (uint64_t used = page->used[word]; used != 0; used &= used - 1) {
+                    freeObject(slabObjectAt(page, word * 64 + __builtin_ctzll(used)));
+                }
+            }
+        }
+    }
+    freeSlabs();
 
-    free(vm.grayStack);
+    free(vm.marker.grayStack);
+    free(vm.rememberedSet);
 }
+
+// What an object owns on top of its own allocation. This has to agree with what freeObject()
+// gives back.
+static size_t ownedSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_CLASS: return sizeof(Entry) * ((ObjClass*)object)->methods.capacity;
+        case OBJ_CLOSURE: return sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+        case OBJ_FUNCTION: {
+            Chunk* chunk = &((ObjFunction*)object)->chunk;
+            return chunk->capacity + sizeof(LineStart) * chunk->lineCapacity +
+                   sizeof(Value) * chunk->constants.capacity +
+                   sizeof(InlineCache) * chunk->cacheCapacity;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            if (instance->fields == instance->inlineFields) return 0;
+            return sizeof(Value) * instance->fieldCapacity;
+        }
+        case OBJ_LIST: return sizeof(Value) * ((ObjList*)object)->capacity;
+        case OBJ_ROPE: {
+            // The buffer is shared out evenly between the ropes using it.
+            RopeBuffer* buffer = ((ObjRope*)object)->buffer;
+            return (sizeof(RopeBuffer) + buffer->capacity) / buffer->refCount;
+        }
+        case OBJ_SHAPE: return sizeof(Entry) * ((ObjShape*)object)->transitions.capacity;
+        default: return 0;
+    }
+}
+
+static void countObject(HeapCensus* census, Obj* object) {
+    census->objects[object->type]++;
+    census->bytes[object->type] += objectSize(object) + ownedSize(object);
+}
+
+void takeHeapCensus(HeapCensus* census) {
+    memset(census, 0, sizeof(HeapCensus));
+    for (Obj* object = vm.objects; object != NULL; object = object->next) {
+        countObject(census, object);
+    }
+    for (Obj* object = vm.youngObjects; object != NULL; object = object->next) {
+        countObject(census, object);
+    }
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        for (SlabPage* page = vm.slabClasses[i].pages; page != NULL; page = page->next) {
+            for (int word = 0; word < SLAB_BITMAP_WORDS; word++) {
+                for (uint64_t used = page->used[word]; used != 0; used &= used - 1) {
+                    countObject(census, slabObjectAt(page, word * 64 + __builtin_ctzll(used)));
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < vm.strings.capacity; i++) {
+        if (vm.strings.entries[i].key != NULL) census->internedStrings++;
+    }
+    census->internCapacity = vm.strings.capacity;
+}
+
+void printGCStats() {
+    GCStats* stats = &vm.gcStats;
+    fprintf(vm.err, "gc: %d minor collections, %.3f ms total, %.3f ms max\n", stats->minorCount,
+            stats->minorPauseTotal * 1000, stats->minorPauseMax * 1000);
+    fprintf(vm.err, "gc: %d major collections in %d slices, %.3f ms total, %.3f ms max slice\n",
+            stats->majorCount, stats->majorSlices, stats->majorPauseTotal * 1000,
+            stats->majorPauseMax * 1000);
+    fprintf(vm.err, "gc: %zu objects promoted, %zu bytes live\n", stats->promotedObjects,
+            vm.bytesAllocated);
+    fprintf(vm.err, "gc: %zu bytes freed, %zu bytes at the peak, next major at %zu\n",
+            stats->bytesFreed, stats->peakBytes, vm.nextGC);
+
+    fprintf(vm.err, "gc: pauses\n");
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (stats->pauseHistogram[i] == 0) continue;
+        if (i < GC_PAUSE_BUCKETS - 1) {
+            fprintf(vm.err, "gc:   < %-8d us %10" PRIu64 "\n", 1 << i, stats->pauseHistogram[i]);
+        } else {
+            fprintf(vm.err, "gc:  >= %-8d us %10" PRIu64 "\n", 1 << (i - 1),
+                    stats->pauseHistogram[i]);
+        }
+    }
+
+    HeapCensus census;
+    takeHeapCensus(&census);
+    fprintf(vm.err, "gc: heap by type\n");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        if (census.objects[i] == 0) continue;
+        fprintf(vm.err, "gc:   %-12s %10zu objects %12zu bytes\n", objTypeName((ObjType)i),
+                census.objects[i], census.bytes[i]);
+    }
+    fprintf(vm.err, "gc: %d interned strings in a table of %d\n", census.internedStrings,
+            census.internCapacity);
+}
\ No newline at end of file
@@ -2,9 +2,26 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "object.h"
 #include "value.h"
+#include "vm.h"
 
+// The first major collection starts once the heap reaches GC_INITIAL_HEAP bytes, and each one
+// after that once it has grown GC_HEAP_GROW_FACTOR times over what the last one left live. Both
+// can be changed from the command line, and the factor from Lox with gcSet() as well.
+#define GC_INITIAL_HEAP     (1024 * 1024)
 #define GC_HEAP_GROW_FACTOR 2
+// Bytes the program may allocate before the nursery is collected. Small enough that a minor
+// collection's working set stays in cache, big enough that most temporaries are dead by then.
+#define GC_NURSERY_SIZE (256 * 1024)
+// While a major collection is under way it gets a slice of at most the budget's worth of work each
+// time this many more bytes have been allocated. The budget is what bounds the pause; the slice
+// size decides how fast the collector keeps up with the program.
+#define GC_SLICE_BUDGET 1000
+#define GC_SLICE_BYTES  (16 * 1024)
+// With more than one GC thread, gray objects are handed between them in batches of at most this
+// many.
+#define GC_MARK_BATCH 256
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*2)
 
@@ -18,10 +35,44 @@
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0);
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+Obj*  allocateObjectMemory(size_t size);
+bool  isObjectMarked(Obj* object);
 void  markObject(Obj* object);
 void  markValue(Value value);
+void  rememberObject(Obj* object);
+void  markBarrier(Obj* object, Obj* child);
+void  reviveString(ObjString* string);
 void  collectGarbage();
+void  collectYoungGarbage();
 void  freeObject(Obj* object);
 void  freeObjects();
+void  printGCStats();
+
+/* A count of what's in the heap right now, by type. Nothing is collected first, so it includes
+whatever the next collection would free along with what's still reachable. Each object is charged
+what it was allocated, its whole slot for a slab object, plus the arrays and tables it owns. */
+typedef struct HeapCensus {
+    size_t objects[OBJ_TYPE_COUNT];
+    size_t bytes[OBJ_TYPE_COUNT];
+    int    internedStrings;
+    int    internCapacity;  // Slots in the intern table, counting empty ones and tombstones.
+} HeapCensus;
+
+void takeHeapCensus(HeapCensus* census);
+
+/* Any store of a value into a heap object that might already have been looked at by the collector
+goes through here. It does two jobs. A minor collection only traces the young generation, so it
+has to be told about every old object that has been made to point at a young one. And while a major
+collection is marking, an object it has already marked must not be left pointing at one it hasn't,
+or that one would never be found. The checks are cheap enough to inline everywhere: most stores are
+of numbers, or of objects that have already been promoted, and most of the time nothing is being
+marked. */
+static inline void writeBarrier(Obj* object, Value value) {
+    if (!IS_OBJ(value)) return;
+    if (object->isOld && !object->isRemembered && !AS_OBJ(value)->isOld) {
+        rememberObject(object);
+    }
+    if (vm.gcPhase == GC_MARK) markBarrier(object, AS_OBJ(value));
+}
 
 #endif
\ No newline at end of file
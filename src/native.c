@@ -0,0 +1,473 @@
+#include "native.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// Most natives take only a certain type, and fail the same way given anything else.
+static bool checkNumber(const char* name, Value value) {
+    if (IS_NUMBER(value)) return true;
+    return nativeError("Argument to %s() must be a number.", name);
+}
+
+// A rope passes as well, flattened where it lies, so the native only ever sees an ObjString. The
+// arguments are on the VM's stack, which keeps the rope reachable while that's done.
+static bool checkString(const char* name, Value* value) {
+    if (IS_ROPE(*value)) *value = OBJ_VAL(flattenRope(AS_ROPE(*value)));
+    if (IS_STRING(*value)) return true;
+    return nativeError("Argument to %s() must be a string.", name);
+}
+
+static bool checkList(const char* name, Value value) {
+    if (IS_LIST(value)) return true;
+    return nativeError("Argument to %s() must be a list.", name);
+}
+
+// An index into a string or list of the given length, which may also be one past the end.
+static bool checkIndex(const char* name, Value value, int length) {
+    if (!checkNumber(name, value)) return false;
+    double index = AS_NUMBER(value);
+    if (index != floor(index) || index < 0 || index > length) {
+        return nativeError("Index %g out of range for %s().", index, name);
+    }
+    return true;
+}
+
+// ---- Time ---- //
+
+static bool clockNative(int argCount, Value* args) {
+    args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+// ---- Numbers ---- //
+
+static bool absNative(int argCount, Value* args) {
+    if (!checkNumber("abs", args[0])) return false;
+    args[-1] = NUMBER_VAL(fabs(AS_NUMBER(args[0])));
+    return true;
+}
+
+static bool floorNative(int argCount, Value* args) {
+    if (!checkNumber("floor", args[0])) return false;
+    args[-1] = NUMBER_VAL(floor(AS_NUMBER(args[0])));
+    return true;
+}
+
+static bool ceilNative(int argCount, Value* args) {
+    if (!checkNumber("ceil", args[0])) return false;
+    args[-1] = NUMBER_VAL(ceil(AS_NUMBER(args[0])));
+    return true;
+}
+
+static bool sqrtNative(int argCount, Value* args) {
+    if (!checkNumber("sqrt", args[0])) return false;
+    args[-1] = NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+    return true;
+}
+
+static bool powNative(int argCount, Value* args) {
+    if (!checkNumber("pow", args[0]) || !checkNumber("pow", args[1])) return false;
+    args[-1] = NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+    return true;
+}
+
+static bool minNative(int argCount, Value* args) {
+    if (!checkNumber("min", args[0]) || !checkNumber("min", args[1])) return false;
+    args[-1] = AS_NUMBER(args[0]) <= AS_NUMBER(args[1]) ? args[0] : args[1];
+    return true;
+}
+
+static bool maxNative(int argCount, Value* args) {
+    if (!checkNumber("max", args[0]) || !checkNumber("max", args[1])) return false;
+    args[-1] = AS_NUMBER(args[0]) >= AS_NUMBER(args[1]) ? args[0] : args[1];
+    return true;
+}
+
+// Parses the whole string as a number, returning nil if it isn't one.
+static bool numNative(int argCount, Value* args) {
+    if (!checkString("num", &args[0])) return false;
+    ObjString* string = AS_STRING(args[0]);
+    char*      end;
+    double     number = strtod(string->chars, &end);
+    // strtod keeps the payload of a "nan(...)", which NaN boxing would read as some other type.
+    if (isnan(number)) number = NAN;
+    args[-1] = string->length > 0 && end == string->chars + string->length ? NUMBER_VAL(number)
+                                                                           : NIL_VAL;
+    return true;
+}
+
+// ---- Strings ---- //
+
+// Converts any value to the string print would show for it.
+static bool strNative(int argCount, Value* args) {
+    if (IS_ANY_STRING(args[0])) {
+        args[-1] = args[0];
+        return true;
+    }
+
+    // Numbers are by far the most common thing to turn into a string, and %g never needs more
+    // than a couple of dozen characters. Anything else goes through the printer.
+    if (IS_NUMBER(args[0])) {
+        char buffer[32];
+        int  length = snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(args[0]));
+        args[-1]    = OBJ_VAL(copyString(buffer, length));
+        return true;
+    }
+
+    char*  buffer = NULL;
+    size_t length = 0;
+    FILE*  stream = open_memstream(&buffer, &length);
+    if (stream == NULL) exit(1);
+    fprintValue(stream, args[0]);
+    fclose(stream);
+    args[-1] = OBJ_VAL(copyString(buffer, (int)length));
+    free(buffer);
+    return true;
+}
+
+// The number of characters in a string or items in a list.
+static bool lenNative(int argCount, Value* args) {
+    if (IS_LIST(args[0])) {
+        args[-1] = NUMBER_VAL(AS_LIST(args[0])->count);
+        return true;
+    }
+    // Nothing about a rope's length needs it flattened.
+    if (IS_ROPE(args[0])) {
+        args[-1] = NUMBER_VAL(AS_ROPE(args[0])->length);
+        return true;
+    }
+    if (!checkString("len", &args[0])) return false;
+    args[-1] = NUMBER_VAL(AS_STRING(args[0])->length);
+    return true;
+}
+
+// The characters from start up to, but not including, end.
+static bool substringNative(int argCount, Value* args) {
+    if (!checkString("substring", &args[0])) return false;
+    ObjString* string = AS_STRING(args[0]);
+    if (!checkIndex("substring", args[1], string->length) ||
+        !checkIndex("substring", args[2], string->length)) {
+        return false;
+    }
+
+    int start = (int)AS_NUMBER(args[1]);
+    int end   = (int)AS_NUMBER(args[2]);
+    if (end < start) return nativeError("substring() end %d is before its start %d.", end, start);
+    args[-1] = OBJ_VAL(copyString(string->chars + start, end - start));
+    return true;
+}
+
+// The index of the first place needle appears in the string, or -1 if it doesn't.
+static bool indexOfNative(int argCount, Value* args) {
+    if (!checkString("indexOf", &args[0]) || !checkString("indexOf", &args[1])) return false;
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* needle = AS_STRING(args[1]);
+
+    double index = -1;
+    if (needle->length == 0) {
+        index = 0;
+    } else {
+        for (int i = 0; i + needle->length <= string->length; i++) {
+            if (string->chars[i] == needle->chars[0] &&
+                memcmp(string->chars + i, needle->chars, needle->length) == 0) {
+                index = i;
+                break;
+            }
+        }
+    }
+    args[-1] = NUMBER_VAL(index);
+    return true;
+}
+
+// Strings are bytes, so a character here is one byte, and its code is between 0 and 255.
+static bool charAtNative(int argCount, Value* args) {
+    if (!checkString("charAt", &args[0])) return false;
+    ObjString* string = AS_STRING(args[0]);
+    if (!checkIndex("charAt", args[1], string->length - 1)) return false;
+    args[-1] = OBJ_VAL(copyString(string->chars + (int)AS_NUMBER(args[1]), 1));
+    return true;
+}
+
+static bool charCodeNative(int argCount, Value* args) {
+    if (!checkString("charCode", &args[0])) return false;
+    ObjString* string = AS_STRING(args[0]);
+    if (!checkIndex("charCode", args[1], string->length - 1)) return false;
+    args[-1] = NUMBER_VAL((uint8_t)string->chars[(int)AS_NUMBER(args[1])]);
+    return true;
+}
+
+static bool fromCharCodeNative(int argCount, Value* args) {
+    if (!checkIndex("fromCharCode", args[0], 255)) return false;
+    char c   = (char)(int)AS_NUMBER(args[0]);
+    args[-1] = OBJ_VAL(copyString(&c, 1));
+    return true;
+}
+
+// The string repeated count times over, built in a single allocation.
+static bool repeatNative(int argCount, Value* args) {
+    if (!checkString("repeat", &args[0]) || !checkNumber("repeat", args[1])) return false;
+    ObjString* string = AS_STRING(args[0]);
+    double     count  = AS_NUMBER(args[1]);
+    if (count != floor(count) || count < 0) {
+        return nativeError("repeat() count must be a whole number, not %g.", count);
+    }
+    if (string->length > 0 && count > (double)INT32_MAX / string->length) {
+        return nativeError("repeat() result is too long.");
+    }
+
+    int        times  = (int)count;
+    ObjString* result = newString(string->length * times);
+    for (int i = 0; i < times; i++) {
+        memcpy(result->chars + (size_t)i * string->length, string->chars, string->length);
+    }
+    args[-1] = OBJ_VAL(internString(result));
+    return true;
+}
+
+// ---- Lists ---- //
+
+static bool appendNative(int argCount, Value* args) {
+    if (!checkList("append", args[0])) return false;
+    listAppend(AS_LIST(args[0]), args[1]);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// A new list of the items from start up to, but not including, end.
+static bool sliceNative(int argCount, Value* args) {
+    if (!checkList("slice", args[0])) return false;
+    ObjList* list = AS_LIST(args[0]);
+    if (!checkIndex("slice", args[1], list->count) || !checkIndex("slice", args[2], list->count)) {
+        return false;
+    }
+
+    int start = (int)AS_NUMBER(args[1]);
+    int end   = (int)AS_NUMBER(args[2]);
+    if (end < start) return nativeError("slice() end %d is before its start %d.", end, start);
+    args[-1] = OBJ_VAL(newList(list->items + start, end - start));
+    return true;
+}
+
+static int compareNumbers(const void* a, const void* b) {
+    double x = AS_NUMBER(*(const Value*)a);
+    double y = AS_NUMBER(*(const Value*)b);
+    return (x > y) - (x < y);
+}
+
+static int compareStrings(const void* a, const void* b) {
+    ObjString* x      = AS_STRING(*(const Value*)a);
+    ObjString* y      = AS_STRING(*(const Value*)b);
+    int        length = x->length < y->length ? x->length : y->length;
+    int        order  = memcmp(x->chars, y->chars, length);
+    return order != 0 ? order : (x->length > y->length) - (x->length < y->length);
+}
+
+// Sorts a list of numbers, or a list of strings byte by byte, in place.
+static bool sortNative(int argCount, Value* args) {
+    if (!checkList("sort", args[0])) return false;
+    ObjList* list = AS_LIST(args[0]);
+
+    if (list->count > 0) {
+        bool numbers = IS_NUMBER(list->items[0]);
+        for (int i = 0; i < list->count; i++) {
+            if (!numbers && IS_ROPE(list->items[i])) {
+                ObjString* flat = flattenRope(AS_ROPE(list->items[i]));
+                list->items[i]  = OBJ_VAL(flat);
+                writeBarrier((Obj*)list, OBJ_VAL(flat));
+            }
+            Value item = list->items[i];
+            if (numbers ? !IS_NUMBER(item) : !IS_STRING(item)) {
+                return nativeError("sort() needs a list of only numbers or only strings.");
+            }
+        }
+        // Reordering items doesn't change what the list points to, so no barrier is needed.
+        qsort(list->items, list->count, sizeof(Value), numbers ? compareNumbers : compareStrings);
+    }
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool sumNative(int argCount, Value* args) {
+    if (!checkList("sum", args[0])) return false;
+    ObjList* list = AS_LIST(args[0]);
+
+    double sum = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (!IS_NUMBER(list->items[i])) {
+            return nativeError("sum() needs a list of numbers, but item %d isn't one.", i);
+        }
+        sum += AS_NUMBER(list->items[i]);
+    }
+    args[-1] = NUMBER_VAL(sum);
+    return true;
+}
+
+// ---- The collector ---- //
+
+// Runs a full collection, finishing any that's under way first.
+static bool gcNative(int argCount, Value* args) {
+    collectGarbage();
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+/* Looks one of the collector's statistics up by name. Pause times are in seconds and sizes in
+bytes. "<type>Objects" and "<type>Bytes", for any type objTypeName() knows, count what's in the heap
+right now, and take a walk over the whole of it to do so. */
+static bool gcStatNative(int argCount, Value* args) {
+    if (!checkString("gcStat", &args[0])) return false;
+    const char* name  = AS_CSTRING(args[0]);
+    GCStats*    stats = &vm.gcStats;
+
+    double value;
+    if (strcmp(name, "minorCollections") == 0) {
+        value = stats->minorCount;
+    } else if (strcmp(name, "majorCollections") == 0) {
+        value = stats->majorCount;
+    } else if (strcmp(name, "majorSlices") == 0) {
+        value = stats->majorSlices;
+    } else if (strcmp(name, "promotedObjects") == 0) {
+        value = (double)stats->promotedObjects;
+    } else if (strcmp(name, "bytesFreed") == 0) {
+        value = (double)stats->bytesFreed;
+    } else if (strcmp(name, "peakBytes") == 0) {
+        value = (double)stats->peakBytes;
+    } else if (strcmp(name, "bytesAllocated") == 0) {
+        value = (double)vm.bytesAllocated;
+    } else if (strcmp(name, "nextCollection") == 0) {
+        value = (double)vm.nextGC;
+    } else if (strcmp(name, "minorPauseTotal") == 0) {
+        value = stats->minorPauseTotal;
+    } else if (strcmp(name, "minorPauseMax") == 0) {
+        value = stats->minorPauseMax;
+    } else if (strcmp(name, "majorPauseTotal") == 0) {
+        value = stats->majorPauseTotal;
+    } else if (strcmp(name, "majorPauseMax") == 0) {
+        value = stats->majorPauseMax;
+    } else if (strcmp(name, "growthFactor") == 0) {
+        value = vm.gcGrowthFactor;
+    } else if (strcmp(name, "maxHeap") == 0) {
+        value = (double)vm.gcMaxHeap;
+    } else if (strcmp(name, "sliceBudget") == 0) {
+        value = vm.gcSliceBudget;
+    } else {
+        HeapCensus census;
+        takeHeapCensus(&census);
+        if (strcmp(name, "internedStrings") == 0) {
+            value = census.internedStrings;
+        } else if (strcmp(name, "internCapacity") == 0) {
+            value = census.internCapacity;
+        } else {
+            int i = 0;
+            for (; i < OBJ_TYPE_COUNT; i++) {
+                const char* type   = objTypeName((ObjType)i);
+                size_t      length = strlen(type);
+                if (strncmp(name, type, length) != 0) continue;
+                if (strcmp(name + length, "Objects") == 0) {
+                    value = (double)census.objects[i];
+                    break;
+                }
+                if (strcmp(name + length, "Bytes") == 0) {
+                    value = (double)census.bytes[i];
+                    break;
+                }
+            }
+            if (i == OBJ_TYPE_COUNT) return nativeError("Unknown GC statistic \"%s\".", name);
+        }
+    }
+    args[-1] = NUMBER_VAL(value);
+    return true;
+}
+
+// How many pauses fell in the given bucket of the histogram, or nil past the last one. Bucket 0
+// holds pauses under a microsecond and bucket i the rest of those under 2^i.
+static bool gcPausesNative(int argCount, Value* args) {
+    if (!checkNumber("gcPauses", args[0])) return false;
+    double bucket = AS_NUMBER(args[0]);
+    if (bucket != floor(bucket) || bucket < 0) {
+        return nativeError("gcPauses() bucket must be a whole number, not %g.", bucket);
+    }
+    args[-1] = bucket < GC_PAUSE_BUCKETS
+                   ? NUMBER_VAL((double)vm.gcStats.pauseHistogram[(int)bucket])
+                   : NIL_VAL;
+    return true;
+}
+
+/* Changes how the collector is paced, returning the setting's old value. "growthFactor" is how
+far past what the last major collection left live the heap may grow before the next starts,
+"maxHeap" a soft limit on that in bytes, or 0 for none, "nextCollection" where the next one starts,
+and "sliceBudget" how much work each slice of a major collection does. */
+static bool gcSetNative(int argCount, Value* args) {
+    if (!checkString("gcSet", &args[0]) || !checkNumber("gcSet", args[1])) return false;
+    const char* name  = AS_CSTRING(args[0]);
+    double      value = AS_NUMBER(args[1]);
+
+    if (strcmp(name, "growthFactor") == 0) {
+        if (!(value > 1)) {
+            return nativeError("GC growth factor must be more than 1, not %g.", value);
+        }
+        args[-1]          = NUMBER_VAL(vm.gcGrowthFactor);
+        vm.gcGrowthFactor = value;
+        return true;
+    }
+
+    if (value != floor(value) || value < 0 || value >= (double)SIZE_MAX) {
+        return nativeError("GC setting \"%s\" must be a whole number, not %g.", name, value);
+    }
+    if (strcmp(name, "maxHeap") == 0) {
+        args[-1]     = NUMBER_VAL((double)vm.gcMaxHeap);
+        vm.gcMaxHeap = (size_t)value;
+        if (vm.gcMaxHeap != 0 && vm.nextGC > vm.gcMaxHeap) vm.nextGC = vm.gcMaxHeap;
+    } else if (strcmp(name, "nextCollection") == 0) {
+        args[-1]  = NUMBER_VAL((double)vm.nextGC);
+        vm.nextGC = (size_t)value;
+    } else if (strcmp(name, "sliceBudget") == 0) {
+        if (value < 1 || value > INT32_MAX) {
+            return nativeError("GC slice budget must be between 1 and %d.", INT32_MAX);
+        }
+        args[-1]         = NUMBER_VAL(vm.gcSliceBudget);
+        vm.gcSliceBudget = (int)value;
+    } else {
+        return nativeError("Unknown GC setting \"%s\".", name);
+    }
+    return true;
+}
+
+void defineNatives() {
+    defineNative("clock", 0, clockNative);
+
+    defineNative("abs", 1, absNative);
+    defineNative("floor", 1, floorNative);
+    defineNative("ceil", 1, ceilNative);
+    defineNative("sqrt", 1, sqrtNative);
+    defineNative("pow", 2, powNative);
+    defineNative("min", 2, minNative);
+    defineNative("max", 2, maxNative);
+    defineNative("num", 1, numNative);
+
+    defineNative("str", 1, strNative);
+    defineNative("len", 1, lenNative);
+    defineNative("substring", 3, substringNative);
+    defineNative("indexOf", 2, indexOfNative);
+    defineNative("charAt", 2, charAtNative);
+    defineNative("charCode", 2, charCodeNative);
+    defineNative("fromCharCode", 1, fromCharCodeNative);
+    defineNative("repeat", 2, repeatNative);
+
+    defineNative("append", 2, appendNative);
+    defineNative("slice", 3, sliceNative);
+    defineNative("sort", 1, sortNative);
+    defineNative("sum", 1, sumNative);
+
+    defineNative("gc", 0, gcNative);
+    defineNative("gcStat", 1, gcStatNative);
+    defineNative("gcPauses", 1, gcPausesNative);
+    defineNative("gcSet", 2, gcSetNative);
+}
@@ -0,0 +1,10 @@
+#ifndef clox_native_h
+#define clox_native_h
+
+/* The functions built into every VM as globals. They're there for the operations a Lox program
+spends its inner loops on, which are far slower spelled out in bytecode, and for the ones it
+couldn't do at all: turning a number into a string, say, or taking a string apart. */
+
+void defineNatives();
+
+#endif
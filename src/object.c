@@ -11,12 +11,12 @@
 #define ALLOCATE_OBJ(type, objectType) (type*)allocateObject(sizeof(type), objectType)
 
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object      = (Obj*)reallocate(NULL, 0, size);
-    object->type     = type;
-    object->isMarked = false;
-
-    object->next = vm.objects;
-    vm.objects   = object;
+    // The memory manager picks where the object lives and fills in sizeClass and next.
+    Obj* object          = allocateObjectMemory(size);
+    object->type         = type;
+    object->isMarked     = false;
+    object->isOld        = false;
+    object->isRemembered = false;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %ld for %d\n", (void*)object, size, type);
@@ -25,32 +25,38 @@ static Obj* allocateObject(size_t size, ObjType type) {
     return object;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length    = length;
-    string->chars     = chars;
-    string->hash      = hash;
-
-    // All strings are interned in clox so whenever we create a new string we also add it to the
-    // intern table. Since the string is brand new, it isn’t reachable anywhere. Resizing the string
-    // pool can trigger a collection. We go ahead and stash the string on the stack first. This
-    // ensures the string is safe while the table is being resized.
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
-
-    return string;
+/* Strings are hashed eight bytes at a time, each word folded in with a multiply and a shift, and
+anything shorter than a word is picked up in one or two overlapping loads. Table indices come from
+the low bits of the hash, which a multiply alone leaves poorly mixed, so the result is stirred once
+more at the end. */
+static inline uint64_t mixHash(uint64_t hash) {
+    hash *= 0xff51afd7ed558ccdull;
+    return hash ^ (hash >> 32);
 }
 
 static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ (uint64_t)length;
 
-    for (int i = 0; i < length; i++) {
-        hash ^= key[i];
-        hash *= 16777619;
+    for (; length >= 8; key += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, key, sizeof(word));
+        hash = mixHash(hash ^ word);
     }
 
-    return hash;
+    // The length went into the hash up front, so the bytes that two loads both cover can't make
+    // strings of different lengths collide.
+    uint64_t tail = 0;
+    if (length >= 4) {
+        uint32_t first, last;
+        memcpy(&first, key, sizeof(first));
+        memcpy(&last, key + length - 4, sizeof(last));
+        tail = (uint64_t)first << 32 | last;
+    } else if (length > 0) {
+        tail = (uint64_t)(uint8_t)key[0] << 16 | (uint64_t)(uint8_t)key[length >> 1] << 8 |
+               (uint8_t)key[length - 1];
+    }
+    hash = mixHash(mixHash(hash ^ tail));
+    return (uint32_t)hash;
 }
 
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
@@ -60,13 +66,37 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     return bound;
 }
 
+static ObjShape* newShape(ObjShape* parent, ObjString* name) {
+    ObjShape* shape   = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent     = parent;
+    shape->name       = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    shape->id         = ++vm.shapeId;
+    initTable(&shape->transitions);
+    return shape;
+}
+
 ObjClass* newClass(ObjString* name) {
-    ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
-    klass->name     = name;
+    ObjClass* klass     = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+    klass->name         = name;
+    klass->rootShape    = NULL;
+    klass->inlineFields = 0;
     initTable(&klass->methods);
+    touchClass(klass);
+
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape(NULL, NULL);
+    writeBarrier((Obj*)klass, OBJ_VAL(klass->rootShape));
+    pop();
     return klass;
 }
 
+void touchClass(ObjClass* klass) {
+    // Versions are never reused, so a cache entry filled for a class that has since been freed
+    // can't accidentally match whatever class gets allocated at the same address.
+    klass->version = ++vm.classVersion;
+}
+
 ObjClosure* newClosure(ObjFunction* function) {
     ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
     // Ensure that the memory manager never sees uninitialized memory.
@@ -85,46 +115,248 @@ ObjFunction* newFunction() {
     ObjFunction* function  = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity        = 0;
     function->upvalueCount = 0;
+    function->maxSlots     = 0;
     function->name         = NULL;
+    function->hotness      = 0;
+    function->jit          = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
 ObjInstance* newInstance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
-    instance->klass       = klass;
-    initTable(&instance->fields);
+    int          slots    = klass->inlineFields;
+    ObjInstance* instance = (ObjInstance*)allocateObject(
+        sizeof(ObjInstance) + sizeof(Value) * slots, OBJ_INSTANCE);
+    instance->klass          = klass;
+    instance->shape          = klass->rootShape;
+    instance->fields         = instance->inlineFields;
+    instance->fieldCapacity  = slots;
+    instance->inlineCapacity = slots;
     return instance;
 }
 
-ObjNative* newNative(NativeFn function) {
+// Returns the slot holding the field called name, or -1 if instances of this shape don't have it.
+int shapeFieldSlot(ObjShape* shape, ObjString* name) {
+    // Walking back up the transition chain compares one interned string pointer per field, which
+    // for objects of a typical size beats hashing. The inline caches make this the slow path.
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name) return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+static ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+    Value child;
+    if (tableGet(&shape->transitions, name, &child)) return AS_SHAPE(child);
+
+    ObjShape* next = newShape(shape, name);
+    push(OBJ_VAL(next));
+    tableSet(&shape->transitions, name, OBJ_VAL(next));
+    writeBarrier((Obj*)shape, OBJ_VAL(next));
+    pop();
+    return next;
+}
+
+// Adds a field the instance doesn't have yet. The caller must keep both the instance and the value
+// reachable, since moving to the next shape and growing the slot array can both allocate.
+void instanceAddField(ObjInstance* instance, ObjString* name, Value value) {
+    ObjShape* shape = shapeTransition(instance->shape, name);
+    int       slot  = instance->shape->fieldCount;
+
+    if (slot >= instance->fieldCapacity) {
+        int oldCapacity = instance->fieldCapacity;
+        int capacity    = GROW_CAPACITY(oldCapacity);
+        if (instance->fields == instance->inlineFields) {
+            Value* fields = ALLOCATE(Value, capacity);
+            memcpy(fields, instance->inlineFields, sizeof(Value) * oldCapacity);
+            instance->fields = fields;
+        } else {
+            instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, capacity);
+        }
+        instance->fieldCapacity = capacity;
+    }
+
+    // Either allocation above may have promoted the instance, leaving it old while the new shape
+    // and the value are still young.
+    instance->fields[slot] = value;
+    instance->shape        = shape;
+    writeBarrier((Obj*)instance, value);
+    writeBarrier((Obj*)instance, OBJ_VAL(shape));
+
+    ObjClass* klass = instance->klass;
+    if (shape->fieldCount > klass->inlineFields && shape->fieldCount <= INSTANCE_INLINE_FIELDS_MAX) {
+        klass->inlineFields = shape->fieldCount;
+    }
+}
+
+// A list holding a copy of the count values at items, which the caller keeps reachable. The array
+// is allocated before the list, so a collection in between never sees a list without one.
+ObjList* newList(Value* items, int count) {
+    Value* array = count == 0 ? NULL : ALLOCATE(Value, count);
+    if (count > 0) memcpy(array, items, sizeof(Value) * count);
+
+    ObjList* list  = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    list->count    = count;
+    list->capacity = count;
+    list->items    = array;
+    return list;
+}
+
+// The list and the value both have to be reachable from somewhere the collector looks, since
+// growing the array can set one off.
+void listAppend(ObjList* list, Value value) {
+    if (list->capacity < list->count + 1) {
+        int oldCapacity = list->capacity;
+        list->items     = GROW_ARRAY(Value, list->items, oldCapacity, GROW_CAPACITY(oldCapacity));
+        list->capacity  = GROW_CAPACITY(oldCapacity);
+    }
+    writeBarrier((Obj*)list, value);
+    list->items[list->count++] = value;
+}
+
+ObjNative* newNative(NativeFn function, int arity, ObjString* name) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function  = function;
+    native->arity     = arity;
+    native->name      = name;
     return native;
 }
 
-ObjString* takeString(char* chars, int length) {
-    uint32_t   hash     = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+// Allocates a string with room for length characters, for the caller to fill in before handing
+// it to internString(). Until then it has no hash and isn't in the intern table, so nothing else
+// may be allowed to see it.
+ObjString* newString(int length) {
+    ObjString* string = (ObjString*)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->length        = length;
+    string->hash          = 0;
+    string->chars[length] = '\0';
+    return string;
+}
 
+// Returns the interned string with the same characters as string, adding string to the intern
+// table if there isn't one yet.
+ObjString* internString(ObjString* string) {
+    string->hash        = hashString(string->chars, string->length);
+    ObjString* interned = tableFindString(&vm.strings, string->chars, string->length, string->hash);
+    // The string we built is left for the collector. It's young, so the next minor collection
+    // gets it back without ever looking at it.
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length);
+        reviveString(interned);
         return interned;
     }
 
-    return allocateString(chars, length, hash);
+    // All strings are interned in clox so whenever we create a new string we also add it to the
+    // intern table. Since the string is brand new, it isn’t reachable anywhere. Resizing the string
+    // pool can trigger a collection. We go ahead and stash the string on the stack first. This
+    // ensures the string is safe while the table is being resized.
+    push(OBJ_VAL(string));
+    tableSet(&vm.strings, string, NIL_VAL);
+    pop();
+
+    return string;
 }
 
 ObjString* copyString(const char* chars, int length) {
+    // Look for the string before building it, so the common case of a name or literal that has
+    // been seen before doesn't allocate at all.
     uint32_t   hash     = hashString(chars, length);
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) return interned;
+    if (interned != NULL) {
+        reviveString(interned);
+        return interned;
+    }
+
+    ObjString* string = newString(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+    push(OBJ_VAL(string));
+    tableSet(&vm.strings, string, NIL_VAL);
+    pop();
+
+    return string;
+}
 
-    return allocateString(heapChars, length, hash);
+// The buffer must already be allocated, since the rope's own allocation can set off a collection,
+// and nothing would keep a buffer no rope has taken yet alive through it.
+static ObjRope* newRope(RopeBuffer* buffer, int length) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length  = length;
+    rope->buffer  = buffer;
+    rope->flat    = NULL;
+    buffer->refCount++;
+    return rope;
+}
+
+// A buffer with room for capacity bytes, and no ropes sharing it yet.
+static RopeBuffer* newRopeBuffer(int capacity) {
+    char*       chars  = ALLOCATE(char, capacity);
+    RopeBuffer* buffer = ALLOCATE(RopeBuffer, 1);
+    buffer->refCount   = 0;
+    buffer->length     = 0;
+    buffer->capacity   = capacity;
+    buffer->chars      = chars;
+    return buffer;
+}
+
+void releaseRopeBuffer(RopeBuffer* buffer) {
+    if (--buffer->refCount > 0) return;
+    FREE_ARRAY(char, buffer->chars, buffer->capacity);
+    FREE(RopeBuffer, buffer);
+}
+
+/* Concatenates two strings of either kind, which the caller keeps reachable. The collector never
+moves anything, so their bytes stay put until a rope's buffer is grown here.
+
+A new rope's buffer is only as big as it needs to be, since most long strings are never appended
+to. The first append grows it, and it doubles each time after that, which is what makes a loop of
+appends linear overall. */
+Value concatenateStrings(Value a, Value b) {
+    int         aLength, bLength;
+    const char* aChars = stringBytes(a, &aLength);
+    const char* bChars = stringBytes(b, &bLength);
+    int         length = aLength + bLength;
+
+    if (length < ROPE_MIN_LENGTH) {
+        // The characters are copied straight into the string object that will be the result,
+        // rather than into a buffer that then has to be copied again.
+        ObjString* result = newString(length);
+        memcpy(result->chars, aChars, aLength);
+        memcpy(result->chars + aLength, bChars, bLength);
+        return OBJ_VAL(internString(result));
+    }
+
+    RopeBuffer* buffer;
+    if (IS_ROPE(a) && AS_ROPE(a)->length == AS_ROPE(a)->buffer->length) {
+        buffer = AS_ROPE(a)->buffer;
+        if (buffer->capacity < length) {
+            int oldCapacity = buffer->capacity;
+            int capacity    = oldCapacity;
+            while (capacity < length) capacity = GROW_CAPACITY(capacity);
+            buffer->chars    = GROW_ARRAY(char, buffer->chars, oldCapacity, capacity);
+            buffer->capacity = capacity;
+            // b may be the rope a was made from, or a itself, and then its bytes just moved. They
+            // come before the end of a, so they can't overlap where they're going.
+            bChars = stringBytes(b, &bLength);
+        }
+    } else {
+        buffer = newRopeBuffer(length);
+        memcpy(buffer->chars, aChars, aLength);
+    }
+
+    memcpy(buffer->chars + aLength, bChars, bLength);
+    buffer->length = length;
+    return OBJ_VAL(newRope(buffer, length));
+}
+
+// The rope has to be reachable, since interning the flat copy can set off a collection.
+ObjString* flattenRope(ObjRope* rope) {
+    if (rope->flat == NULL) {
+        ObjString* flat = copyString(rope->buffer->chars, rope->length);
+        rope->flat      = flat;
+        writeBarrier((Obj*)rope, OBJ_VAL(flat));
+    }
+    return rope->flat;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -135,23 +367,77 @@ ObjUpvalue* newUpvalue(Value* slot) {
     return upvalue;
 }
 
-static void printFunction(ObjFunction* function) {
+static void printFunction(FILE* file, ObjFunction* function) {
     if (function->name == NULL) {
-        printf("<script>");
+        fprintf(file, "<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    fprintf(file, "<fn %s>", function->name->chars);
 }
 
-void printObject(Value value) {
+/* A list can contain itself, directly or through other lists, so the ones being printed are kept
+on a stack of their own, and one that turns up again inside itself is printed as [...]. So is any
+list nested too deep for the stack, which is plenty for anything anyone wants to read. */
+#define PRINT_LIST_DEPTH_MAX 64
+
+static void printList(FILE* file, ObjList* list) {
+    static _Thread_local ObjList* printing[PRINT_LIST_DEPTH_MAX];
+    static _Thread_local int      depth = 0;
+
+    bool isNested = depth == PRINT_LIST_DEPTH_MAX;
+    for (int i = 0; i < depth && !isNested; i++) isNested = printing[i] == list;
+    if (isNested) {
+        fprintf(file, "[...]");
+        return;
+    }
+
+    printing[depth++] = list;
+    fputc('[', file);
+    for (int i = 0; i < list->count; i++) {
+        if (i > 0) fprintf(file, ", ");
+        fprintValue(file, list->items[i]);
+    }
+    fputc(']', file);
+    depth--;
+}
+
+void fprintObject(FILE* file, Value value) {
     switch (OBJ_TYPE(value)) {
-        case OBJ_BOUND_METHOD: printFunction(AS_BOUND_METHOD(value)->method->function); break;
-        case OBJ_CLASS: printf("%s", AS_CLASS(value)->name->chars); break;
-        case OBJ_CLOSURE: printFunction(AS_CLOSURE(value)->function); break;
-        case OBJ_FUNCTION: printFunction(AS_FUNCTION(value)); break;
-        case OBJ_INSTANCE: printf("%s instance", AS_INSTANCE(value)->klass->name->chars); break;
-        case OBJ_NATIVE: printf("<native fn>"); break;
-        case OBJ_STRING: printf("%s", AS_CSTRING(value)); break;
-        case OBJ_UPVALUE: printf("upvalue"); break;
+        case OBJ_BOUND_METHOD: printFunction(file, AS_BOUND_METHOD(value)->method->function); break;
+        case OBJ_CLASS: fprintf(file, "%s", AS_CLASS(value)->name->chars); break;
+        case OBJ_CLOSURE: printFunction(file, AS_CLOSURE(value)->function); break;
+        case OBJ_FUNCTION: printFunction(file, AS_FUNCTION(value)); break;
+        case OBJ_INSTANCE:
+            fprintf(file, "%s instance", AS_INSTANCE(value)->klass->name->chars);
+            break;
+        case OBJ_LIST: printList(file, AS_LIST(value)); break;
+        case OBJ_NATIVE: fprintf(file, "<native fn %s>", AS_NATIVE(value)->name->chars); break;
+        case OBJ_ROPE: {
+            // Printing doesn't need the rope flattened, only its bytes.
+            ObjRope* rope = AS_ROPE(value);
+            fwrite(rope->buffer->chars, 1, rope->length, file);
+            break;
+        }
+        case OBJ_SHAPE: fprintf(file, "shape"); break;
+        case OBJ_STRING: fprintf(file, "%s", AS_CSTRING(value)); break;
+        case OBJ_UPVALUE: fprintf(file, "upvalue"); break;
+    }
+}
+
+// The name a type goes by in the collector's statistics.
+const char* objTypeName(ObjType type) {
+    switch (type) {
+        case OBJ_BOUND_METHOD: return "boundMethod";
+        case OBJ_CLASS: return "class";
+        case OBJ_CLOSURE: return "closure";
+        case OBJ_FUNCTION: return "function";
+        case OBJ_INSTANCE: return "instance";
+        case OBJ_LIST: return "list";
+        case OBJ_NATIVE: return "native";
+        case OBJ_ROPE: return "rope";
+        case OBJ_SHAPE: return "shape";
+        case OBJ_STRING: return "string";
+        case OBJ_UPVALUE: return "upvalue";
     }
+    return "unknown";
 }
\ No newline at end of file
@@ -13,15 +13,23 @@
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
-#define IS_NATIVE(value)       ifObjType(value, OBJ_NATIVE)
+#define IS_LIST(value)         isObjType(value, OBJ_LIST)
+#define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
+#define IS_SHAPE(value)        isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+// Either kind of string, flat or not.
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
-#define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
+#define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      ((ObjString*)AS_OBJ(value))->chars
 
@@ -31,39 +39,87 @@ typedef enum ObjType {
     OBJ_CLOSURE,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_LIST,
     OBJ_NATIVE,
+    OBJ_ROPE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
 typedef struct Obj {
     ObjType type;
-    bool    isMarked;
-    Obj*    next;
+    bool    isMarked;      // Large objects only. Slab objects are marked in their page's bitmap.
+    bool    isOld;         // Survived a collection.
+    bool    isRemembered;  // Old, and sitting in the remembered set.
+    uint8_t sizeClass;     // Slab size class, or 0 for a large object on one of the object lists.
+    Obj*    next;          // Large objects only.
 } Obj;
 
 typedef struct ObjFunction {
-    Obj        obj;
-    int        arity;
-    int        upvalueCount;
-    Chunk      chunk;
-    ObjString* name;
+    Obj             obj;
+    int             arity;
+    int             upvalueCount;
+    int             maxSlots;  // The most stack slots a call uses at once, counting slot zero.
+    Chunk           chunk;
+    ObjString*      name;
+    // Calls and loop back-edges so far, counted while the JIT is on, and the machine code it
+    // compiled the function to once there were enough of them.
+    uint32_t        hotness;
+    struct JitCode* jit;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+/* A native function gets its arguments in args[0] to args[argCount - 1]. It stores its result in
+args[-1], the slot the function itself was called from, and returns true. To fail instead, it
+reports the error with nativeError() and returns what that does. The VM has already checked the
+number of arguments against the arity, unless that's -1. */
+typedef bool (*NativeFn)(int argCount, Value* args);
 
 typedef struct ObjNative {
-    Obj      obj;
-    NativeFn function;
+    Obj        obj;
+    NativeFn   function;
+    int        arity;  // The number of arguments it takes, or -1 for any number.
+    ObjString* name;
 } ObjNative;
 
+// The characters live in the same block as the header, NUL-terminated, so a string is one
+// allocation and comparing one against a table key stays within the same few cache lines.
 typedef struct ObjString {
     Obj      obj;
     int      length;
-    char*    chars;
     uint32_t hash;
+    char     chars[];
 } ObjString;
 
+/* Concatenation only builds an ObjString when the result is short. Anything longer becomes a rope,
+which keeps its bytes in a buffer of its own instead, left unhashed and out of the intern table
+until something needs it as a flat string. Appending to a rope writes into the spare room at the
+end of the same buffer whenever that's still free, and the result is another rope sharing the
+buffer, so building a long string a piece at a time copies each piece once, not everything before
+it over again, and leaves behind only small dead ropes rather than copies of the whole string.
+
+The buffer belongs to all the ropes sharing it and is freed along with the last of them. Each of
+those ropes is a prefix of it, and the one as long as what's been written so far is the one that
+can append in place. Appending to any other copies its bytes into a new buffer first. */
+typedef struct RopeBuffer {
+    int   refCount;
+    int   length;  // Bytes written so far.
+    int   capacity;
+    char* chars;   // Not NUL-terminated.
+} RopeBuffer;
+
+// Concatenations shorter than this build a flat, interned string right away.
+#define ROPE_MIN_LENGTH 64
+
+typedef struct ObjRope {
+    Obj         obj;
+    int         length;
+    RopeBuffer* buffer;
+    ObjString*  flat;  // The same string flattened and interned, once something needed it.
+} ObjRope;
+
 typedef struct ObjUpvalue {
     Obj                obj;
     Value*             location;
@@ -78,18 +134,56 @@ typedef struct ObjClosure {
     int          upvalueCount;
 } ObjClosure;
 
+/* A shape (hidden class) describes which fields an instance has and which slot of its field array
+each one lives in. Every class owns an empty root shape. Adding a field to an instance moves it
+from its current shape to the child shape for that field name, creating the child the first time
+any instance takes that step. Instances that get the same fields in the same order therefore end
+up sharing one shape, and a field access is a slot index instead of a hash table lookup. Shapes
+never change once created; the transition tree only ever grows. */
+typedef struct ObjShape {
+    Obj              obj;
+    struct ObjShape* parent;       // NULL for a class's root shape.
+    ObjString*       name;         // The field this shape added to its parent, in slot fieldCount-1.
+    int              fieldCount;
+    uint32_t         id;           // Unique across the VM, never reused. Used by the inline caches.
+    Table            transitions;  // Field name -> child ObjShape.
+} ObjShape;
+
+// Upper bound on how many field slots newInstance() will embed directly in the instance.
+#define INSTANCE_INLINE_FIELDS_MAX 16
+
 typedef struct ObjClass {
     Obj        obj;
     ObjString* name;
     Table      methods;
+    // Identifies the current contents of methods for the inline caches. Replaced with a fresh
+    // number from the VM every time the method table changes.
+    uint32_t  version;
+    ObjShape* rootShape;
+    // The most fields any instance of this class has had so far (capped). New instances reserve
+    // that many slots inline, so once a class has warmed up its instances never need a second
+    // allocation for their fields.
+    int inlineFields;
 } ObjClass;
 
 typedef struct ObjInstance {
     Obj       obj;
     ObjClass* klass;
-    Table     fields;
+    ObjShape* shape;
+    Value*    fields;          // Points at inlineFields until the instance outgrows them.
+    int       fieldCapacity;
+    int       inlineCapacity;  // Number of slots allocated in inlineFields.
+    Value     inlineFields[];
 } ObjInstance;
 
+// A growable array of values, stored contiguously, so indexing one is a bounds check and a load.
+typedef struct ObjList {
+    Obj    obj;
+    int    count;
+    int    capacity;
+    Value* items;
+} ObjList;
+
 typedef struct ObjBoundMethod {
     Obj         obj;
     Value       receiver;
@@ -102,13 +196,38 @@ static inline bool isObjType(Value value, ObjType type) {
 
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjClass*    newClass(ObjString* name);
+void         touchClass(ObjClass* klass);
 ObjClosure*  newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
-ObjNative*   newNative(NativeFn function);
-ObjString*   takeString(char* chars, int length);
+ObjList*     newList(Value* items, int count);
+void         listAppend(ObjList* list, Value value);
+int          shapeFieldSlot(ObjShape* shape, ObjString* name);
+void         instanceAddField(ObjInstance* instance, ObjString* name, Value value);
+ObjNative*   newNative(NativeFn function, int arity, ObjString* name);
+ObjString*   newString(int length);
+ObjString*   internString(ObjString* string);
 ObjString*   copyString(const char* chars, int length);
+Value        concatenateStrings(Value a, Value b);
+ObjString*   flattenRope(ObjRope* rope);
+void         releaseRopeBuffer(RopeBuffer* buffer);
 ObjUpvalue*  newUpvalue(Value* slot);
-void         printObject(Value value);
+void         fprintObject(FILE* file, Value value);
+const char*  objTypeName(ObjType type);
+
+// The bytes of either kind of string. Only a flat string's are followed by a NUL.
+static inline const char* stringBytes(Value value, int* length) {
+    if (IS_ROPE(value)) {
+        *length = AS_ROPE(value)->length;
+        return AS_ROPE(value)->buffer->chars;
+    }
+    *length = AS_STRING(value)->length;
+    return AS_STRING(value)->chars;
+}
+
+// Either kind of string as a flat one, flattening a rope if it hasn't been already.
+static inline ObjString* asFlatString(Value value) {
+    return IS_ROPE(value) ? flattenRope(AS_ROPE(value)) : AS_STRING(value);
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,716 @@
+#include "optimizer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object.h"
+#include "vm.h"
+
+/* The chunk is decoded into an array of instructions first, with each jump's destination held as
+the index of the instruction it lands on instead of a byte offset. Instructions can then be
+dropped or replaced freely without fixing up the jumps around them, and byte offsets are only
+worked out again once, when the result is encoded back into the chunk.
+
+Rewrites happen in rounds, repeated until one finds nothing left to do, since one rewrite often
+sets up the next: folding 1 + 2 + 3 takes two rounds, and removing a branch on a constant can make
+the code behind it unreachable. Every instruction keeps the line it was compiled on, and anything
+that replaces a group of them takes the line of the last, so runtimeError() reports the same lines
+as it would for the unoptimized code.
+
+No rewrite ever makes an instruction longer, so the code only shrinks, jumps only get shorter, and
+it all fits back into the chunk's existing arrays. That's also what lets the long jumps the
+compiler falls back on be narrowed: once nothing can move further apart, any that fit the short
+form are switched to it. */
+
+typedef struct Instruction {
+    uint8_t opcode;
+    int     offset;    // Where the instruction started in the original code.
+    int     length;
+    int     line;
+    // Set once the instruction has been replaced by one with its own operands, instead of those
+    // it had in the original code.
+    bool    rewritten;
+    uint8_t operands[2];
+    int     target;    // For a jump, the index of the instruction it lands on. Otherwise -1.
+    bool    isTarget;  // Some jump lands here, so control can arrive from somewhere other than
+                       // the instruction before. Rewrites never merge across one of these.
+    bool    dead;
+    bool    reached;
+} Instruction;
+
+typedef struct Optimizer {
+    Chunk*       chunk;
+    Instruction* instructions;
+    int          count;
+} Optimizer;
+
+#define STATS (vm.optimizerStats)
+
+static bool isLongJump(uint8_t opcode) {
+    return opcode == OP_JUMP_LONG || opcode == OP_JUMP_IF_FALSE_LONG || opcode == OP_LOOP_LONG;
+}
+
+static bool isJump(uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_TRUE ||
+           opcode == OP_LOOP || opcode == OP_LESS_JUMP_IF_FALSE ||
+           opcode == OP_GREATER_JUMP_IF_FALSE || isLongJump(opcode);
+}
+
+static bool isUnconditional(uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_LOOP || opcode == OP_JUMP_LONG ||
+           opcode == OP_LOOP_LONG;
+}
+
+static bool isConditional(uint8_t opcode) {
+    return opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_TRUE ||
+           opcode == OP_JUMP_IF_FALSE_LONG;
+}
+
+static bool jumpsIfFalse(uint8_t opcode) {
+    return opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_FALSE_LONG;
+}
+
+// How many bytes a jump's distance takes, and so the furthest it can reach.
+static int jumpWidth(uint8_t opcode) { return isLongJump(opcode) ? 3 : 2; }
+
+static int jumpReach(uint8_t opcode) { return isLongJump(opcode) ? UINT24_MAX : UINT16_MAX; }
+
+// Instructions that only push a value, with no side effects and no way to fail.
+static bool isPurePush(uint8_t opcode) {
+    return opcode == OP_CONSTANT || opcode == OP_NIL || opcode == OP_TRUE || opcode == OP_FALSE ||
+           opcode == OP_GET_LOCAL || opcode == OP_GET_UPVALUE || opcode == OP_CONSTANT_LONG ||
+           opcode == OP_GET_LOCAL_LONG || opcode == OP_GET_UPVALUE_LONG ||
+           opcode == OP_GET_ENCLOSING || opcode == OP_GET_ENCLOSING_LONG;
+}
+
+static bool isLiteral(uint8_t opcode) {
+    return opcode == OP_CONSTANT || opcode == OP_NIL || opcode == OP_TRUE || opcode == OP_FALSE ||
+           opcode == OP_CONSTANT_LONG;
+}
+
+static bool decode(Optimizer* optimizer, Chunk* chunk) {
+    int* indexAt = malloc(sizeof(int) * chunk->count);
+    optimizer->instructions = malloc(sizeof(Instruction) * chunk->count);
+    if (indexAt == NULL || optimizer->instructions == NULL) exit(1);
+    optimizer->chunk = chunk;
+    optimizer->count = 0;
+
+    for (int offset = 0; offset < chunk->count; offset++) indexAt[offset] = -1;
+
+    for (int offset = 0; offset < chunk->count;) {
+        indexAt[offset]          = optimizer->count;
+        Instruction* instruction = &optimizer->instructions[optimizer->count++];
+        instruction->opcode      = chunk->code[offset];
+        instruction->offset      = offset;
+        instruction->length      = instructionLength(chunk, offset);
+        instruction->line        = getLine(chunk, offset);
+        instruction->rewritten   = false;
+        instruction->target      = -1;
+        instruction->isTarget    = false;
+        instruction->dead        = false;
+        offset += instruction->length;
+    }
+
+    // Resolve each jump to the instruction it lands on. The compiler never emits a jump into the
+    // middle of an instruction, but if one turns up, leave the chunk alone rather than guess.
+    bool ok = true;
+    for (int i = 0; i < optimizer->count && ok; i++) {
+        Instruction* instruction = &optimizer->instructions[i];
+        if (!isJump(instruction->opcode)) continue;
+
+        int dest = jumpTarget(chunk, instruction->offset);
+        ok       = dest >= 0 && dest < chunk->count && indexAt[dest] != -1;
+        if (ok) instruction->target = indexAt[dest];
+    }
+
+    free(indexAt);
+    if (!ok) free(optimizer->instructions);
+    return ok;
+}
+
+// Finds the first live instruction at or after index.
+static int live(Optimizer* optimizer, int index) {
+    while (index < optimizer->count && optimizer->instructions[index].dead) index++;
+    return index;
+}
+
+static int nextLive(Optimizer* optimizer, int index) { return live(optimizer, index + 1); }
+
+// Drops an instruction. Jumps that landed on it now land on whatever follows, so that inherits its
+// status as a jump target.
+static void kill(Optimizer* optimizer, int index) {
+    Instruction* instruction = &optimizer->instructions[index];
+    instruction->dead        = true;
+    if (instruction->isTarget) {
+        int next = nextLive(optimizer, index);
+        if (next < optimizer->count) optimizer->instructions[next].isTarget = true;
+    }
+}
+
+static void removeUnreachable(Optimizer* optimizer) {
+    Instruction* instructions = optimizer->instructions;
+    for (int i = 0; i < optimizer->count; i++) instructions[i].reached = false;
+
+    // Each instruction pushes at most two successors, and only the first time it's reached.
+    int* worklist = malloc(sizeof(int) * (optimizer->count * 2 + 1));
+    if (worklist == NULL) exit(1);
+    int pending = 0;
+    worklist[pending++] = 0;
+
+    while (pending > 0) {
+        int          index       = worklist[--pending];
+        Instruction* instruction = &instructions[index];
+        if (instruction->reached) continue;
+        instruction->reached = true;
+
+        if (isJump(instruction->opcode)) worklist[pending++] = instruction->target;
+        bool fallsThrough =
+            !isUnconditional(instruction->opcode) && instruction->opcode != OP_RETURN;
+        if (fallsThrough && index + 1 < optimizer->count) worklist[pending++] = index + 1;
+    }
+    free(worklist);
+
+    for (int i = 0; i < optimizer->count; i++) {
+        if (!instructions[i].reached) {
+            instructions[i].dead = true;
+            STATS.unreachable++;
+        }
+    }
+}
+
+// Squeezes out dead instructions and recomputes which of the rest are jump targets.
+static void compact(Optimizer* optimizer) {
+    Instruction* instructions = optimizer->instructions;
+    int*         newIndex     = malloc(sizeof(int) * optimizer->count);
+    if (newIndex == NULL) exit(1);
+
+    int count = 0;
+    for (int i = 0; i < optimizer->count; i++) {
+        if (!instructions[i].dead) newIndex[i] = count++;
+    }
+
+    // Every live jump is reachable, and so is whatever it lands on, so live() always finds
+    // something here. Targets are all remapped before anything moves, since live() has to see
+    // the old array.
+    for (int i = 0; i < optimizer->count; i++) {
+        Instruction* instruction = &instructions[i];
+        if (instruction->dead || !isJump(instruction->opcode)) continue;
+        instruction->target = newIndex[live(optimizer, instruction->target)];
+    }
+
+    for (int i = 0; i < optimizer->count; i++) {
+        if (instructions[i].dead) continue;
+        instructions[i].isTarget  = false;
+        instructions[newIndex[i]] = instructions[i];
+    }
+    free(newIndex);
+    optimizer->count = count;
+
+    for (int i = 0; i < count; i++) {
+        if (isJump(instructions[i].opcode)) instructions[instructions[i].target].isTarget = true;
+    }
+}
+
+static uint8_t firstOperand(Optimizer* optimizer, Instruction* instruction) {
+    if (instruction->rewritten) return instruction->operands[0];
+    return optimizer->chunk->code[instruction->offset + 1];
+}
+
+static Value constantValue(Optimizer* optimizer, Instruction* instruction) {
+    Chunk* chunk = optimizer->chunk;
+    switch (instruction->opcode) {
+        case OP_NIL: return NIL_VAL;
+        case OP_TRUE: return BOOL_VAL(true);
+        case OP_FALSE: return BOOL_VAL(false);
+        // Nothing is ever rewritten into a long constant, so its operand is always the original.
+        case OP_CONSTANT_LONG:
+            return chunk->constants.values[readLongOperand(chunk, instruction->offset + 1)];
+        default: return chunk->constants.values[firstOperand(optimizer, instruction)];
+    }
+}
+
+static bool isNumberConstant(Optimizer* optimizer, Instruction* instruction) {
+    return (instruction->opcode == OP_CONSTANT || instruction->opcode == OP_CONSTANT_LONG) &&
+           IS_NUMBER(constantValue(optimizer, instruction));
+}
+
+static bool isFalseyLiteral(Optimizer* optimizer, Instruction* instruction) {
+    Value value = constantValue(optimizer, instruction);
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Finds or adds a number in the constant table. Returns -1 if it would need a long OP_CONSTANT,
+// which can be longer than what it replaces.
+static int numberConstant(Chunk* chunk, double number) {
+    for (int i = 0; i < chunk->constants.count && i <= UINT8_MAX; i++) {
+        Value value = chunk->constants.values[i];
+        if (!IS_NUMBER(value)) continue;
+        // Compared bit for bit, so that 0 and -0 stay distinct.
+        double existing = AS_NUMBER(value);
+        if (memcmp(&existing, &number, sizeof(double)) == 0) return i;
+    }
+
+    if (chunk->constants.count > UINT8_MAX) return -1;
+    return addConstant(chunk, NUMBER_VAL(number));
+}
+
+// Turns instruction into one that pushes the given number or boolean.
+static bool becomeLiteral(Optimizer* optimizer, Instruction* instruction, Value value) {
+    if (IS_BOOL(value)) {
+        instruction->opcode = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+        instruction->length = 1;
+        return true;
+    }
+
+    int constant = numberConstant(optimizer->chunk, AS_NUMBER(value));
+    if (constant == -1) return false;
+    instruction->opcode      = OP_CONSTANT;
+    instruction->length      = 2;
+    instruction->rewritten   = true;
+    instruction->operands[0] = (uint8_t)constant;
+    return true;
+}
+
+// Points a jump that lands on another jump straight at where that one goes, as far as the chain
+// leads. A conditional jump can also skip over a conditional jump of the same kind: it peeks at the
+// condition rather than popping it, so the second one sees the same value and is sure to jump too.
+static bool threadJump(Optimizer* optimizer, int index) {
+    Instruction* instructions = optimizer->instructions;
+    Instruction* jump         = &instructions[index];
+    int          target       = jump->target;
+
+    for (int steps = 0; steps < optimizer->count; steps++) {
+        Instruction* next    = &instructions[target];
+        bool         follows = isUnconditional(next->opcode) ||
+                       (isConditional(jump->opcode) && isConditional(next->opcode) &&
+                        jumpsIfFalse(next->opcode) == jumpsIfFalse(jump->opcode));
+        if (!follows) break;
+
+        // Conditional jumps only go forward, and no jump can reach further than its operand.
+        int distance = instructions[next->target].offset -
+                       (jump->offset + 1 + jumpWidth(jump->opcode));
+        int reach    = jumpReach(jump->opcode);
+        if (isConditional(jump->opcode) && distance <= 0) break;
+        if (distance > reach || -distance > reach) break;
+        target = next->target;
+    }
+
+    if (target == jump->target) return false;
+    jump->target                  = target;
+    instructions[target].isTarget = true;
+    STATS.jumpsThreaded++;
+    return true;
+}
+
+static bool foldBinary(Optimizer* optimizer, int a, int b, int c) {
+    Instruction* left  = &optimizer->instructions[a];
+    Instruction* right = &optimizer->instructions[b];
+    Instruction* op    = &optimizer->instructions[c];
+    if (right->isTarget || op->isTarget) return false;
+    if (!isNumberConstant(optimizer, left) || !isNumberConstant(optimizer, right)) return false;
+
+    double x = AS_NUMBER(constantValue(optimizer, left));
+    double y = AS_NUMBER(constantValue(optimizer, right));
+    Value  result;
+    switch (op->opcode) {
+        case OP_ADD: result = NUMBER_VAL(x + y); break;
+        case OP_SUBTRACT: result = NUMBER_VAL(x - y); break;
+        case OP_MULTIPLY: result = NUMBER_VAL(x * y); break;
+        case OP_DIVIDE: result = NUMBER_VAL(x / y); break;
+        case OP_GREATER: result = BOOL_VAL(x > y); break;
+        case OP_LESS: result = BOOL_VAL(x < y); break;
+        case OP_EQUAL: result = BOOL_VAL(x == y); break;
+        default: return false;
+    }
+
+    if (!becomeLiteral(optimizer, op, result)) return false;
+    kill(optimizer, a);
+    kill(optimizer, b);
+    STATS.constantsFolded++;
+    return true;
+}
+
+static bool foldUnary(Optimizer* optimizer, int a, int b) {
+    Instruction* operand = &optimizer->instructions[a];
+    Instruction* op      = &optimizer->instructions[b];
+    if (op->isTarget || !isLiteral(operand->opcode)) return false;
+
+    Value result;
+    if (op->opcode == OP_NEGATE && isNumberConstant(optimizer, operand)) {
+        result = NUMBER_VAL(-AS_NUMBER(constantValue(optimizer, operand)));
+    } else if (op->opcode == OP_NOT) {
+        result = BOOL_VAL(isFalseyLiteral(optimizer, operand));
+    } else {
+        return false;
+    }
+
+    if (!becomeLiteral(optimizer, op, result)) return false;
+    kill(optimizer, a);
+    STATS.constantsFolded++;
+    return true;
+}
+
+// A conditional jump right after a literal always goes the same way. When it never jumps it can
+// go, and the literal is then usually popped straight away and goes too. When it always jumps it
+// becomes an unconditional jump, and the code it used to fall into may become unreachable.
+static bool foldBranch(Optimizer* optimizer, int a, int b) {
+    Instruction* literal = &optimizer->instructions[a];
+    Instruction* jump    = &optimizer->instructions[b];
+    if (jump->isTarget || !isLiteral(literal->opcode) || !isConditional(jump->opcode)) {
+        return false;
+    }
+
+    bool falsey = isFalseyLiteral(optimizer, literal);
+    if (falsey == jumpsIfFalse(jump->opcode)) {
+        jump->opcode = isLongJump(jump->opcode) ? OP_JUMP_LONG : OP_JUMP;
+    } else {
+        kill(optimizer, b);
+    }
+    STATS.jumpsRemoved++;
+    return true;
+}
+
+// "if (!x)", "a != b" and "a <= b" all compile to an OP_NOT in front of the branch. When both ways
+// out of the branch start by popping the condition, nothing else ever sees it, and the OP_NOT can
+// go by flipping the jump instead.
+static bool foldNotBranch(Optimizer* optimizer, int a, int b) {
+    Instruction* instructions = optimizer->instructions;
+    Instruction* jump         = &instructions[b];
+    // There's no long form of OP_JUMP_IF_TRUE to flip a long jump to.
+    if (instructions[a].opcode != OP_NOT || jump->isTarget || !isConditional(jump->opcode) ||
+        isLongJump(jump->opcode)) {
+        return false;
+    }
+
+    int next = nextLive(optimizer, b);
+    if (next >= optimizer->count || instructions[next].opcode != OP_POP) return false;
+    if (instructions[live(optimizer, jump->target)].opcode != OP_POP) return false;
+
+    jump->opcode = jump->opcode == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE;
+    kill(optimizer, a);
+    STATS.constantsFolded++;
+    return true;
+}
+
+static bool rewrite(Optimizer* optimizer) {
+    Instruction* instructions = optimizer->instructions;
+    bool         changed      = false;
+
+    // Thread every jump first. Retargeting marks the new destinations as jump targets before any of
+    // the rewrites below go looking for sequences to merge.
+    for (int i = 0; i < optimizer->count; i++) {
+        if (isJump(instructions[i].opcode)) changed |= threadJump(optimizer, i);
+    }
+
+    for (int a = 0; a < optimizer->count; a++) {
+        if (instructions[a].dead) continue;
+        int b = nextLive(optimizer, a);
+        if (b >= optimizer->count) break;
+        int c = nextLive(optimizer, b);
+
+        // A jump, taken or not, to the very next instruction does nothing.
+        if (isJump(instructions[a].opcode) &&
+            live(optimizer, instructions[a].target) == b) {
+            kill(optimizer, a);
+            STATS.jumpsRemoved++;
+            changed = true;
+            continue;
+        }
+
+        if (c < optimizer->count && foldBinary(optimizer, a, b, c)) {
+            changed = true;
+            continue;
+        }
+
+        if (foldUnary(optimizer, a, b) || foldBranch(optimizer, a, b) ||
+            foldNotBranch(optimizer, a, b)) {
+            changed = true;
+            continue;
+        }
+
+        // A value pushed only to be popped right away, like a local read as an expression
+        // statement, or what's left after folding a constant branch.
+        if (isPurePush(instructions[a].opcode) && instructions[b].opcode == OP_POP &&
+            !instructions[b].isTarget) {
+            kill(optimizer, a);
+            kill(optimizer, b);
+            STATS.popsRemoved++;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// ---- Superinstructions ---- //
+
+/* Once the code is as small as the rewrites above can make it, the most common sequences in hot
+loops are each replaced by one instruction that does all their work, so the VM pays for one
+dispatch instead of several. Unlike the rewrites, this only runs once, at the end: none of the
+rewrites know about the fused instructions, and nothing fused ever fuses again. */
+
+// Collects up to max live instructions starting at index into sequence, stopping early at one
+// that's a jump target, and returns how many it found. Only the first one can be a target.
+static int sequenceAt(Optimizer* optimizer, int index, int* sequence, int max) {
+    int found        = 0;
+    sequence[found++] = index;
+    while (found < max) {
+        int next = nextLive(optimizer, sequence[found - 1]);
+        if (next >= optimizer->count || optimizer->instructions[next].isTarget) break;
+        sequence[found++] = next;
+    }
+    return found;
+}
+
+// Turns the first instruction of a sequence into a superinstruction, drops the rest of it, and
+// gives the result the line of the instruction in the sequence that could fail at runtime.
+static void fuse(Optimizer* optimizer, int* sequence, int count, uint8_t opcode, int length,
+                 int failing) {
+    Instruction* instruction = &optimizer->instructions[sequence[0]];
+    instruction->opcode      = opcode;
+    instruction->length      = length;
+    instruction->rewritten   = true;
+    instruction->line        = optimizer->instructions[sequence[failing]].line;
+    for (int i = 1; i < count; i++) kill(optimizer, sequence[i]);
+    STATS.fused += count;
+}
+
+static bool isOp(Optimizer* optimizer, int index, uint8_t opcode) {
+    return optimizer->instructions[index].opcode == opcode;
+}
+
+static void fuseSuperinstructions(Optimizer* optimizer) {
+    Instruction* instructions = optimizer->instructions;
+
+    for (int i = 0; i < optimizer->count; i++) {
+        if (instructions[i].dead) continue;
+        Instruction* first = &instructions[i];
+
+        int at[5];
+        int count = sequenceAt(optimizer, i, at, 5);
+
+        // i = i + k; as a statement, with k a number.
+        if (count >= 5 && isOp(optimizer, at[0], OP_GET_LOCAL) &&
+            isOp(optimizer, at[1], OP_CONSTANT) &&
+            isNumberConstant(optimizer, &instructions[at[1]]) && isOp(optimizer, at[2], OP_ADD) &&
+            isOp(optimizer, at[3], OP_SET_LOCAL) &&
+            firstOperand(optimizer, &instructions[at[3]]) == firstOperand(optimizer, first) &&
+            isOp(optimizer, at[4], OP_POP)) {
+            uint8_t constant = firstOperand(optimizer, &instructions[at[1]]);
+            first->operands[0] = firstOperand(optimizer, first);
+            first->operands[1] = constant;
+            fuse(optimizer, at, 5, OP_INCREMENT_LOCAL, 3, 2);
+            continue;
+        }
+
+        // local + k, with k a number.
+        if (count >= 3 && isOp(optimizer, at[0], OP_GET_LOCAL) &&
+            isOp(optimizer, at[1], OP_CONSTANT) &&
+            isNumberConstant(optimizer, &instructions[at[1]]) && isOp(optimizer, at[2], OP_ADD)) {
+            uint8_t constant = firstOperand(optimizer, &instructions[at[1]]);
+            first->operands[0] = firstOperand(optimizer, first);
+            first->operands[1] = constant;
+            fuse(optimizer, at, 3, OP_ADD_LOCAL_CONST, 3, 2);
+            continue;
+        }
+
+        // A comparison used only as a loop or if condition. Both ways out of the branch pop the
+        // condition, so the fused instruction never pushes it, and its jump goes one instruction
+        // further, past the pop at the target. That pop stays for any other jump that lands on it.
+        if (count >= 3 && (isOp(optimizer, at[0], OP_LESS) || isOp(optimizer, at[0], OP_GREATER)) &&
+            isOp(optimizer, at[1], OP_JUMP_IF_FALSE) && isOp(optimizer, at[2], OP_POP)) {
+            int target = instructions[at[1]].target;
+            int after  = nextLive(optimizer, target);
+            if (isOp(optimizer, target, OP_POP) && target != at[2] && after < optimizer->count) {
+                uint8_t opcode = first->opcode == OP_LESS ? OP_LESS_JUMP_IF_FALSE
+                                                          : OP_GREATER_JUMP_IF_FALSE;
+                first->target = after;
+                instructions[after].isTarget = true;
+                fuse(optimizer, at, 3, opcode, 3, 0);
+                continue;
+            }
+        }
+
+        // An assignment to a local as a statement.
+        if (count >= 2 && isOp(optimizer, at[0], OP_SET_LOCAL) && isOp(optimizer, at[1], OP_POP)) {
+            first->operands[0] = firstOperand(optimizer, first);
+            fuse(optimizer, at, 2, OP_SET_LOCAL_POP, 2, 0);
+            continue;
+        }
+
+        // The pops at the end of a block, one for each local going out of scope.
+        if (first->opcode == OP_POP) {
+            int run  = 1;
+            int last = i;
+            for (; run < UINT8_MAX; run++) {
+                int next = nextLive(optimizer, last);
+                if (next >= optimizer->count || !isOp(optimizer, next, OP_POP) ||
+                    instructions[next].isTarget) {
+                    break;
+                }
+                last = next;
+            }
+
+            if (run > 1) {
+                first->opcode      = OP_POP_N;
+                first->length      = 2;
+                first->rewritten   = true;
+                first->operands[0] = (uint8_t)run;
+                for (int j = 1; j < run; j++) kill(optimizer, nextLive(optimizer, i));
+                STATS.fused += run;
+            }
+            continue;
+        }
+
+        // The first few slots hold the receiver or closure and the leading parameters, which are
+        // read far more often than any other local, so they get instructions of their own.
+        if (first->opcode == OP_GET_LOCAL && firstOperand(optimizer, first) <= 3) {
+            first->opcode    = OP_GET_LOCAL_0 + firstOperand(optimizer, first);
+            first->length    = 1;
+            first->rewritten = true;
+            STATS.specialized++;
+        }
+    }
+}
+
+// Works out where each instruction will start once encoded, and returns the total length.
+static int layout(Optimizer* optimizer, int* offsets) {
+    int offset = 0;
+    for (int i = 0; i < optimizer->count; i++) {
+        offsets[i] = offset;
+        offset += optimizer->instructions[i].length;
+    }
+    return offset;
+}
+
+// The compiler only emits long jumps when some jump in the script was too far for the short form,
+// and then it emits nothing else, so most of them don't need it. Measured in the current layout,
+// with every long jump still long, a distance only shrinks as jumps around it are narrowed too.
+static void narrowJumps(Optimizer* optimizer) {
+    Instruction* instructions = optimizer->instructions;
+    int*         offsets      = malloc(sizeof(int) * optimizer->count);
+    if (offsets == NULL) exit(1);
+    layout(optimizer, offsets);
+
+    for (int i = 0; i < optimizer->count; i++) {
+        Instruction* instruction = &instructions[i];
+        if (!isLongJump(instruction->opcode)) continue;
+
+        int distance = offsets[instruction->target] - (offsets[i] + 3);
+        if (distance > UINT16_MAX || -distance > UINT16_MAX) continue;
+
+        switch (instruction->opcode) {
+            case OP_JUMP_LONG: instruction->opcode = OP_JUMP; break;
+            case OP_JUMP_IF_FALSE_LONG: instruction->opcode = OP_JUMP_IF_FALSE; break;
+            case OP_LOOP_LONG: instruction->opcode = OP_LOOP; break;
+        }
+        instruction->length = 3;
+        STATS.jumpsNarrowed++;
+    }
+
+    free(offsets);
+}
+
+static void encode(Optimizer* optimizer) {
+    Chunk*       chunk        = optimizer->chunk;
+    Instruction* instructions = optimizer->instructions;
+
+    // The operands are copied out of the original code, which is about to be overwritten.
+    uint8_t* original = malloc(chunk->count);
+    int*     offsets  = malloc(sizeof(int) * optimizer->count);
+    if (original == NULL || offsets == NULL) exit(1);
+    memcpy(original, chunk->code, chunk->count);
+
+    int offset = layout(optimizer, offsets);
+
+    // Every instruction keeps its line, so the line table is rebuilt from scratch as they go out.
+    chunk->lineCount = 0;
+
+    for (int i = 0; i < optimizer->count; i++) {
+        Instruction* instruction = &instructions[i];
+        uint8_t*     code        = &chunk->code[offsets[i]];
+        code[0]                  = instruction->opcode;
+
+        if (isJump(instruction->opcode)) {
+            // An unconditional jump picks its direction from wherever threading left its target.
+            // Every other kind only ever jumps forward.
+            bool isLong   = isLongJump(instruction->opcode);
+            int  distance = offsets[instruction->target] - (offsets[i] + 1 + (isLong ? 3 : 2));
+            if (isUnconditional(instruction->opcode)) {
+                if (isLong) {
+                    code[0] = distance < 0 ? OP_LOOP_LONG : OP_JUMP_LONG;
+                } else {
+                    code[0] = distance < 0 ? OP_LOOP : OP_JUMP;
+                }
+            }
+            if (distance < 0) distance = -distance;
+            if (isLong) {
+                code[1] = (distance >> 16) & 0xff;
+                code[2] = (distance >> 8) & 0xff;
+                code[3] = distance & 0xff;
+            } else {
+                code[1] = (distance >> 8) & 0xff;
+                code[2] = distance & 0xff;
+            }
+        } else if (instruction->rewritten) {
+            memcpy(&code[1], instruction->operands, instruction->length - 1);
+        } else {
+            memcpy(&code[1], &original[instruction->offset + 1], instruction->length - 1);
+        }
+
+        addLine(chunk, offsets[i], instruction->line);
+    }
+    chunk->count = offset;
+
+    free(offsets);
+    free(original);
+}
+
+void optimizeChunk(Chunk* chunk) {
+    Optimizer optimizer;
+    if (!decode(&optimizer, chunk)) return;
+
+    STATS.chunks++;
+    STATS.bytesBefore += chunk->count;
+
+    for (;;) {
+        removeUnreachable(&optimizer);
+        compact(&optimizer);
+        if (!rewrite(&optimizer)) break;
+    }
+
+    narrowJumps(&optimizer);
+    // Fused comparisons jump past the pop at their target, which may leave it unreachable.
+    fuseSuperinstructions(&optimizer);
+    removeUnreachable(&optimizer);
+    compact(&optimizer);
+    encode(&optimizer);
+
+    STATS.bytesAfter += chunk->count;
+    free(optimizer.instructions);
+}
+
+void printOptimizerStats() {
+    OptimizerStats* stats   = &vm.optimizerStats;
+    size_t          removed = stats->bytesBefore - stats->bytesAfter;
+    fprintf(vm.err, "optimizer: %d chunks, %zu bytes of code down to %zu, %zu removed (%.1f%%)\n",
+            stats->chunks, stats->bytesBefore, stats->bytesAfter, removed,
+            stats->bytesBefore > 0 ? 100.0 * removed / stats->bytesBefore : 0.0);
+    fprintf(vm.err,
+            "optimizer: %d constants folded, %d jumps threaded, %d removed, %d push/pop pairs "
+            "removed, %d unreachable instructions\n",
+            stats->constantsFolded, stats->jumpsThreaded, stats->jumpsRemoved, stats->popsRemoved,
+            stats->unreachable);
+    fprintf(vm.err, "optimizer: %d instructions fused into superinstructions, %d specialized\n",
+            stats->fused, stats->specialized);
+    if (stats->jumpsNarrowed > 0) {
+        fprintf(vm.err, "optimizer: %d long jumps narrowed\n", stats->jumpsNarrowed);
+    }
+    if (stats->upvaluesBorrowed > 0) {
+        fprintf(vm.err, "optimizer: %d upvalues borrowed instead of captured\n",
+                stats->upvaluesBorrowed);
+    }
+}
+
+#undef STATS
@@ -0,0 +1,34 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+#include "common.h"
+
+/* The compiler emits code in a single pass and never looks back at what it wrote, so it produces
+plenty of sequences a second look can shrink: arithmetic on literals, jumps to jumps, values
+pushed only to be popped, and code after a return that nothing can reach. When enabled, the
+optimizer rewrites each finished chunk in place before it's handed over to the VM, and finishes by
+fusing common sequences into superinstructions. Only optimized code uses those, so --no-optimize
+gets the plain instruction set the compiler emits. */
+
+typedef struct OptimizerStats {
+    int    chunks;
+    size_t bytesBefore;
+    size_t bytesAfter;
+    int    constantsFolded;  // Operations on literals replaced by their result, and negated
+                             // conditions folded into the branch that tests them.
+    int    jumpsThreaded;    // Jumps retargeted past a jump they used to land on.
+    int    jumpsRemoved;     // Jumps to the next instruction, and branches on a literal.
+    int    popsRemoved;      // Values pushed only to be popped again, dropped along with the pop.
+    int    unreachable;      // Instructions no path from the start of the chunk could reach.
+    int    fused;            // Instructions merged into superinstructions, counting every part.
+    int    specialized;      // Instructions replaced by a form with its operand built in.
+    int    jumpsNarrowed;    // Long jumps that turned out to fit in the short form.
+    int    upvaluesBorrowed; // Captured locals read in place by a local function that never
+                             // escapes. The compiler does this one.
+} OptimizerStats;
+
+void optimizeChunk(Chunk* chunk);
+void printOptimizerStats();
+
+#endif
@@ -0,0 +1,174 @@
+#include "profiler.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+void initProfile(Profile* profile) {
+    profile->count          = 0;
+    profile->capacity       = 0;
+    profile->stacks         = NULL;
+    profile->samples        = 0;
+    profile->buffer         = NULL;
+    profile->bufferCapacity = 0;
+}
+
+void freeProfile(Profile* profile) {
+    for (int i = 0; i < profile->capacity; i++) free(profile->stacks[i].frames);
+    free(profile->stacks);
+    free(profile->buffer);
+    initProfile(profile);
+}
+
+/* The timer's signal handler can't do much safely, and the VM may be halfway through an
+instruction when it arrives, so all it does is ask run() for a sample. run() takes it at the start
+of the next instruction, where every frame's ip is up to date. */
+static void onProfileTick(int signal) {
+    (void)signal;
+    requestSample();
+}
+
+// Starts sampling the calling thread's VM. Only one VM can be profiled at a time, since the timer
+// belongs to the whole process.
+void startProfiler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onProfileTick;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec  = 0;
+    timer.it_interval.tv_usec = PROFILE_INTERVAL_US;
+    timer.it_value            = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void stopProfiler() {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    // A tick may already be on its way, and by default SIGPROF kills the process.
+    signal(SIGPROF, SIG_IGN);
+}
+
+static void appendFrame(Profile* profile, size_t* length, const char* name, int line) {
+    // A frame's name and line never take more than this, with a separator in front.
+    size_t needed = *length + strlen(name) + 16;
+    if (profile->bufferCapacity < needed) {
+        while (profile->bufferCapacity < needed) {
+            profile->bufferCapacity = GROW_CAPACITY(profile->bufferCapacity);
+        }
+        profile->buffer = realloc(profile->buffer, profile->bufferCapacity);
+        if (profile->buffer == NULL) exit(1);
+    }
+
+    const char* separator = *length == 0 ? "" : ";";
+    *length += sprintf(profile->buffer + *length, "%s%s:%d", separator, name, line);
+}
+
+static uint32_t hashFrames(const char* frames) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = frames; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void growStacks(Profile* profile) {
+    int           capacity = GROW_CAPACITY(profile->capacity);
+    ProfileStack* stacks   = calloc(capacity, sizeof(ProfileStack));
+    if (stacks == NULL) exit(1);
+
+    for (int i = 0; i < profile->capacity; i++) {
+        ProfileStack* stack = &profile->stacks[i];
+        if (stack->frames == NULL) continue;
+        uint32_t index = stack->hash & (capacity - 1);
+        while (stacks[index].frames != NULL) index = (index + 1) & (capacity - 1);
+        stacks[index] = *stack;
+    }
+
+    free(profile->stacks);
+    profile->stacks   = stacks;
+    profile->capacity = capacity;
+}
+
+// Adds one to the tally for the stack the VM is in right now. Only ever called from run(), at the
+// start of an instruction.
+void recordSample() {
+    Profile* profile = &vm.profile;
+    size_t   length  = 0;
+
+    int first = 0;
+    if (vm.frameCount > PROFILE_MAX_DEPTH) {
+        // A stand-in for the frames left out, with how many there were for its line.
+        first = vm.frameCount - PROFILE_MAX_DEPTH;
+        appendFrame(profile, &length, "[deeper]", first);
+    }
+    for (int i = first; i < vm.frameCount; i++) {
+        CallFrame*   frame    = &vm.frames[i];
+        ObjFunction* function = frame->closure->function;
+        // Like the stack trace of an error, the ip is already past the current instruction.
+        int         line = getLine(&function->chunk, (int)(frame->ip - function->chunk.code - 1));
+        const char* name = function->name == NULL ? "script" : function->name->chars;
+        appendFrame(profile, &length, name, line);
+    }
+    if (length == 0) return;
+
+    if (profile->count + 1 > profile->capacity * 3 / 4) growStacks(profile);
+
+    uint32_t hash  = hashFrames(profile->buffer);
+    uint32_t index = hash & (profile->capacity - 1);
+    for (;;) {
+        ProfileStack* stack = &profile->stacks[index];
+        if (stack->frames == NULL) {
+            stack->frames = malloc(length + 1);
+            if (stack->frames == NULL) exit(1);
+            memcpy(stack->frames, profile->buffer, length + 1);
+            stack->samples = 0;
+            stack->hash    = hash;
+            profile->count++;
+        }
+        if (stack->hash == hash && strcmp(stack->frames, profile->buffer) == 0) {
+            stack->samples++;
+            break;
+        }
+        index = (index + 1) & (profile->capacity - 1);
+    }
+    profile->samples++;
+}
+
+static int compareStacks(const void* a, const void* b) {
+    return strcmp(((const ProfileStack*)a)->frames, ((const ProfileStack*)b)->frames);
+}
+
+// Writes the tallies to path in folded format, sorted by stack so the file is the same from run
+// to run given the same samples.
+bool writeProfile(const char* path) {
+    Profile* profile = &vm.profile;
+    FILE*    file    = fopen(path, "w");
+    if (file == NULL) return false;
+
+    ProfileStack* sorted = malloc(sizeof(ProfileStack) * (profile->count + 1));
+    if (sorted == NULL) exit(1);
+    int count = 0;
+    for (int i = 0; i < profile->capacity; i++) {
+        if (profile->stacks[i].frames != NULL) sorted[count++] = profile->stacks[i];
+    }
+    qsort(sorted, count, sizeof(ProfileStack), compareStacks);
+
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "%s %llu\n", sorted[i].frames, (unsigned long long)sorted[i].samples);
+    }
+    free(sorted);
+    return fclose(file) == 0;
+}
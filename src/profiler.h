@@ -0,0 +1,64 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include <time.h>
+
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Two ways of finding out where a program spends its time, both off unless asked for. Counting
+records how many times each instruction ran and how long went by between it and the next one.
+Sampling interrupts the program at a fixed rate of CPU time and notes the call stack it was in,
+keeping a tally of each distinct stack. The tallies come out in the folded format that
+flamegraph.pl and most other flame graph tools read: one line per stack, the outermost frame
+first, each frame as "function:line", separated by semicolons and followed by the count. */
+
+// The CPU time between samples, in microseconds.
+#define PROFILE_INTERVAL_US 1000
+// The most frames recorded for one sample. Deeper stacks lose their outermost frames.
+#define PROFILE_MAX_DEPTH 128
+
+typedef struct ProfileStack {
+    char*    frames;
+    uint64_t samples;
+    uint32_t hash;
+} ProfileStack;
+
+typedef struct Profile {
+    int           count;
+    int           capacity;
+    ProfileStack* stacks;  // Open addressed on the hash of frames; a NULL frames is empty.
+    uint64_t      samples;
+    char*         buffer;  // Where a sample's stack is put together before looking it up.
+    size_t        bufferCapacity;
+} Profile;
+
+// A timestamp for measuring how long instructions take: the cycle counter where there is one,
+// and nanoseconds otherwise.
+static inline uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TICKS_UNIT "cycles"
+#else
+#define TICKS_UNIT "ns"
+#endif
+
+void initProfile(Profile* profile);
+void freeProfile(Profile* profile);
+void startProfiler();
+void stopProfiler();
+void recordSample();
+bool writeProfile(const char* path);
+
+#endif
@@ -1,29 +1,139 @@
 #include "scanner.h"
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 
+typedef struct Window {
+    char*  bytes;
+    size_t capacity;
+} Window;
+
 typedef struct Scanner {
     const char* start;
     const char* current;
     int         line;
+    const char* source;  // Where a source in memory starts, for rewindScanner().
+
+    // The rest is only used for a file. For a source in memory fd is -1 and end is NULL.
+    int         fd;
+    off_t       origin;       // Where the source starts in the file, for rewindScanner().
+    const char* end;          // The terminator after the last byte read into the active window.
+    Window      windows[2];
+    int         active;
+    bool        atEnd;        // Nothing more to read.
+    bool        readFailed;   // Reading stopped on an error, which hasn't been reported yet.
+    bool        switched;     // The current scanToken() has already moved to the other window.
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
+
+// Where a file's scanner starts out, before it has read anything.
+static const char empty[] = "";
 
 void initScanner(const char* source) {
     scanner.start   = source;
     scanner.current = source;
     scanner.line    = 1;
+    scanner.source  = source;
+    scanner.fd      = -1;
+    scanner.end     = NULL;
+}
+
+void initFileScanner(int fd) {
+    scanner.start      = empty;
+    scanner.current    = empty;
+    scanner.line       = 1;
+    scanner.source     = NULL;
+    scanner.fd         = fd;
+    scanner.origin     = lseek(fd, 0, SEEK_CUR);
+    scanner.end        = empty;
+    scanner.active     = 0;
+    scanner.atEnd      = false;
+    scanner.readFailed = false;
+    scanner.switched   = false;
+    for (int i = 0; i < 2; i++) {
+        scanner.windows[i].bytes    = NULL;
+        scanner.windows[i].capacity = 0;
+    }
+}
+
+// Goes back to the beginning of the source, to scan it all again.
+void rewindScanner() {
+    if (scanner.fd < 0) {
+        initScanner(scanner.source);
+        return;
+    }
+
+    scanner.start      = empty;
+    scanner.current    = empty;
+    scanner.line       = 1;
+    scanner.end        = empty;
+    scanner.atEnd      = lseek(scanner.fd, scanner.origin, SEEK_SET) != scanner.origin;
+    scanner.readFailed = scanner.atEnd;
+}
+
+void freeScanner() {
+    if (scanner.fd < 0) return;
+    for (int i = 0; i < 2; i++) free(scanner.windows[i].bytes);
+    initScanner(NULL);
+}
+
+bool isScanningFile() { return scanner.fd >= 0; }
+
+/* Reads more of the file, keeping everything from the start of the token being scanned. The
+first time in a scanToken() it goes into the other window, since the compiler may still have the
+last token pointing into this one. After that the last token is safe in the other window, so the
+rest moves to the front of this one instead. Returns false if there's nothing more to read. */
+static bool refill() {
+    if (scanner.atEnd) return false;
+
+    int     target  = scanner.switched ? scanner.active : 1 - scanner.active;
+    Window* window  = &scanner.windows[target];
+    size_t  keep    = scanner.end - scanner.start;
+    size_t  current = scanner.current - scanner.start;
+
+    if (target == scanner.active) memmove(window->bytes, scanner.start, keep);
+    size_t capacity = window->capacity < SCANNER_WINDOW ? SCANNER_WINDOW : window->capacity;
+    while (capacity < keep + 1 + SCANNER_WINDOW / 2) capacity *= 2;
+    if (capacity != window->capacity) {
+        window->bytes = realloc(window->bytes, capacity);
+        if (window->bytes == NULL) exit(1);
+        window->capacity = capacity;
+    }
+    if (target != scanner.active) memcpy(window->bytes, scanner.start, keep);
+
+    ssize_t count;
+    do {
+        count = read(scanner.fd, window->bytes + keep, window->capacity - keep - 1);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+        scanner.atEnd      = true;
+        scanner.readFailed = count < 0;
+        count              = 0;
+    }
+
+    window->bytes[keep + count] = '\0';
+    scanner.active              = target;
+    scanner.switched            = true;
+    scanner.start               = window->bytes;
+    scanner.current             = window->bytes + current;
+    scanner.end                 = window->bytes + keep + count;
+    return count > 0;
 }
 
 static bool isDigit(char c) { return c >= '0' && c <= '9'; }
 
 static bool isAlpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
 
-static bool isAtEnd() { return *scanner.current == '\0'; }
+// A file's window ends in a terminator too, but there may be more of the file after it.
+static bool isAtEnd() {
+    return *scanner.current == '\0' && (scanner.current != scanner.end || !refill());
+}
 
 static char advance() { return *scanner.current++; }
 
@@ -35,10 +145,14 @@ static bool match(char expected) {
     return true;
 }
 
-static char peek() { return *scanner.current; }
+static char peek() {
+    if (scanner.current == scanner.end) refill();
+    return *scanner.current;
+}
 
 static char peekNext() {
     if (isAtEnd()) return '\0';
+    if (scanner.current + 1 == scanner.end) refill();
     return scanner.current[1];
 }
 
@@ -113,11 +227,11 @@ static TokenType identifierType() {
         case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
         case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
         case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 5, "uper", TOKEN_SUPER);
+        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
         case 't': {
             if (scanner.current - scanner.start > 1) {
                 switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 1, "is", TOKEN_THIS);
+                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
                     case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
                 }
             }
@@ -164,11 +278,18 @@ static Token string() {
 }
 
 Token scanToken() {
+    // Nothing before the current character has to be kept if the window moves while skipping.
+    scanner.start    = scanner.current;
+    scanner.switched = false;
     skipWhitespace();
 
     scanner.start = scanner.current;
 
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
+    if (isAtEnd()) {
+        if (!scanner.readFailed) return makeToken(TOKEN_EOF);
+        scanner.readFailed = false;
+        return errorToken("Could not read the rest of the file.");
+    }
 
     char c = advance();
     if (isAlpha(c)) return identifier();
@@ -179,6 +300,8 @@ Token scanToken() {
         case ')': return makeToken(TOKEN_RIGHT_PAREN);
         case '{': return makeToken(TOKEN_LEFT_BRACE);
         case '}': return makeToken(TOKEN_RIGHT_BRACE);
+        case '[': return makeToken(TOKEN_LEFT_BRACKET);
+        case ']': return makeToken(TOKEN_RIGHT_BRACKET);
         case ';': return makeToken(TOKEN_SEMICOLON);
         case ',': return makeToken(TOKEN_COMMA);
         case '.': return makeToken(TOKEN_DOT);
@@ -1,11 +1,14 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 // clang-format off
 typedef enum TokenType {
     // Single-character tokens.
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
     TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 
@@ -35,7 +38,26 @@ typedef struct Token {
     int line;
 } Token;
 
-void initScanner(const char* source);
+/* The scanner normally works on a whole source in memory, and its tokens point straight into it.
+A big file can instead be compiled straight from the file descriptor, a window at a time, so the
+source never has to be in memory all at once. The scanner keeps two windows and switches between
+them each time it reads more, so the token before the one being scanned, which the compiler may
+still be looking at, stays where it is. Identifiers are what the compiler keeps for longer, as the
+names of locals and classes, so it interns those as they come out and points them into the string
+instead. Anything else has to be done with before the next token but one is scanned. */
+
+// The least the scanner reads from a file in one go. A window only grows past this to hold a
+// single token that's longer.
+#define SCANNER_WINDOW (64 * 1024)
+
+// Files at least this big are compiled straight from the file instead of being read in first.
+#define SCANNER_STREAM_THRESHOLD (4 * 1024 * 1024)
+
+void  initScanner(const char* source);
+void  initFileScanner(int fd);
+void  rewindScanner();
+void  freeScanner();
+bool  isScanningFile();
 Token scanToken();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,442 @@
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "object.h"
+#include "vm.h"
+
+// A request's header is its length and a newline. Anything longer than this without the newline
+// can't be one.
+#define HEADER_MAX 21
+
+typedef struct Buffer {
+    char*  bytes;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+typedef struct Connection {
+    int    in;
+    int    out;      // The same as in for a socket.
+    Buffer input;    // Received, but not yet run.
+    Buffer output;   // Replies, of which the first sent bytes have gone out already.
+    size_t sent;
+    bool   closing;  // Nothing more is coming in. Closed once every reply is out.
+    bool   dead;     // Reading or writing failed. Closed straight away.
+    int    inPoll;   // Where in the server's polls each direction is this time around, or -1.
+    int    outPoll;
+} Connection;
+
+// The source is kept alongside its hash, since a hash match alone could be a different script.
+typedef struct CachedScript {
+    uint64_t hash;
+    size_t   length;
+    char*    source;  // A copy of the script's source, or NULL while the slot is empty.
+} CachedScript;
+
+/* The compiled scripts and the natives' values are kept in vm.pinned, where the collector can
+always see them: first one slot for each cache entry, holding its function or nil, and then the
+value every global slot the VM started with had before any script ran. */
+typedef struct Server {
+    int            listener;  // -1 when serving standard input.
+    Connection*    connections;
+    int            count;
+    int            capacity;
+    struct pollfd* polls;
+    int            pollCount;
+    int            pollCapacity;
+    CachedScript   cache[SERVER_CACHE_SLOTS];
+    int            pinnedStart;
+    int            builtins;  // Global slots that existed before the first script.
+} Server;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+// Makes room for count more bytes, and one past them for a terminator.
+static void reserve(Buffer* buffer, size_t count) {
+    if (buffer->count + count < buffer->capacity) return;
+    size_t capacity = buffer->capacity < 4096 ? 4096 : buffer->capacity;
+    while (capacity <= buffer->count + count) capacity *= 2;
+    buffer->bytes = realloc(buffer->bytes, capacity);
+    if (buffer->bytes == NULL) exit(1);
+    buffer->capacity = capacity;
+}
+
+static void writeBytes(Buffer* buffer, const char* bytes, size_t count) {
+    reserve(buffer, count);
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+static bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static void addConnection(Server* server, int in, int out) {
+    if (server->count == server->capacity) {
+        server->capacity    = server->capacity < 8 ? 8 : server->capacity * 2;
+        server->connections = realloc(server->connections, sizeof(Connection) * server->capacity);
+        if (server->connections == NULL) exit(1);
+    }
+    Connection* connection = &server->connections[server->count++];
+    memset(connection, 0, sizeof(Connection));
+    connection->in  = in;
+    connection->out = out;
+}
+
+static void closeConnection(Connection* connection) {
+    // Standard input and output belong to whoever started us, so they're left open.
+    if (connection->in != STDIN_FILENO) close(connection->in);
+    free(connection->input.bytes);
+    free(connection->output.bytes);
+}
+
+static int listenOn(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || !setNonBlocking(listener) ||
+        bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "Could not listen on \"%s\": %s.\n", path, strerror(errno));
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+static void acceptClients(Server* server) {
+    for (;;) {
+        int client = accept(server->listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // Out of descriptors, most likely, if it isn't just that nobody else is waiting.
+            // Whoever is left stays in the backlog until a connection closes.
+            return;
+        }
+        if (!setNonBlocking(client)) {
+            close(client);
+            continue;
+        }
+        addConnection(server, client, client);
+    }
+}
+
+// One read, however much it brings, so a client that sends quickly can't keep the others waiting.
+static void readInput(Connection* connection) {
+    reserve(&connection->input, 65536);
+    size_t  room = connection->input.capacity - connection->input.count - 1;
+    ssize_t n    = read(connection->in, connection->input.bytes + connection->input.count, room);
+    if (n > 0) {
+        connection->input.count += n;
+    } else if (n == 0) {
+        connection->closing = true;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        connection->dead = true;
+    }
+}
+
+// Sends what it can of the replies without waiting more, or at all, for a socket.
+static void writeOutput(Connection* connection) {
+    while (connection->sent < connection->output.count) {
+        ssize_t n = write(connection->out, connection->output.bytes + connection->sent,
+                          connection->output.count - connection->sent);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) connection->dead = true;
+            return;
+        }
+        connection->sent += n;
+    }
+    connection->output.count = 0;
+    connection->sent         = 0;
+}
+
+static size_t backlog(Connection* connection) {
+    return connection->output.count - connection->sent;
+}
+
+typedef enum RequestState {
+    REQUEST_PARTIAL,
+    REQUEST_READY,
+    REQUEST_MALFORMED,
+} RequestState;
+
+// Looks at the request at the front of connection's input and, once it's all there, where its
+// source starts and how long it is.
+static RequestState nextRequest(Connection* connection, size_t* start, size_t* length) {
+    Buffer* input = &connection->input;
+    size_t  limit = input->count < HEADER_MAX ? input->count : HEADER_MAX;
+    for (size_t i = 0; i < limit; i++) {
+        char c = input->bytes[i];
+        if (c == '\n') {
+            if (i == 0) return REQUEST_MALFORMED;
+            *start = i + 1;
+            return input->count - *start >= *length ? REQUEST_READY : REQUEST_PARTIAL;
+        }
+        if (c < '0' || c > '9') return REQUEST_MALFORMED;
+        if (i == 0) *length = 0;
+        *length = *length * 10 + (c - '0');
+        if (*length > SERVER_MAX_SCRIPT) return REQUEST_MALFORMED;
+    }
+    return input->count < HEADER_MAX ? REQUEST_PARTIAL : REQUEST_MALFORMED;
+}
+
+// The same status clox exits with when it runs a script itself.
+static int statusCode(InterpretResult result) {
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+static void writeReply(Connection* connection, int status, const char* out, size_t outLength,
+                       const char* err, size_t errLength) {
+    char header[64];
+    int  length = snprintf(header, sizeof(header), "%d %zu %zu\n", status, outLength, errLength);
+    writeBytes(&connection->output, header, length);
+    writeBytes(&connection->output, out, outLength);
+    writeBytes(&connection->output, err, errLength);
+}
+
+// Returns NULL if the source doesn't compile, with the errors reported to vm.err.
+static ObjFunction* compileCached(Server* server, const char* source, size_t length) {
+    uint64_t      hash  = hashSource(source, length);
+    int           index = (int)(hash % SERVER_CACHE_SLOTS);
+    CachedScript* entry = &server->cache[index];
+    Value*        slot  = &vm.pinned.values[server->pinnedStart + index];
+    if (IS_OBJ(*slot) && entry->hash == hash && entry->length == length &&
+        memcmp(entry->source, source, length) == 0) {
+        return AS_FUNCTION(*slot);
+    }
+
+    ObjFunction* function = compile(source);
+    if (function == NULL) return NULL;
+
+    char* copy = malloc(length + 1);
+    if (copy == NULL) exit(1);
+    memcpy(copy, source, length);
+    free(entry->source);
+    *slot         = OBJ_VAL(function);
+    entry->hash   = hash;
+    entry->length = length;
+    entry->source = copy;
+    return function;
+}
+
+// Puts the globals back the way they were before the first script: the natives as they were
+// defined, and everything else undefined again. The names stay, since cached scripts refer to
+// their slots.
+static void resetGlobals(Server* server) {
+    Value* builtins = &vm.pinned.values[server->pinnedStart + SERVER_CACHE_SLOTS];
+    for (int i = 0; i < vm.globalValues.count; i++) {
+        vm.globalValues.values[i] = i < server->builtins ? builtins[i] : UNDEFINED_VAL;
+    }
+}
+
+static void runScript(Server* server, Connection* connection, char* source, size_t length) {
+    char*  out;
+    size_t outLength;
+    char*  err;
+    size_t errLength;
+    FILE*  outStream = open_memstream(&out, &outLength);
+    FILE*  errStream = open_memstream(&err, &errLength);
+    if (outStream == NULL || errStream == NULL) exit(1);
+    vm.out = outStream;
+    vm.err = errStream;
+
+    // The source is followed by the next request, if anything, so it's terminated just for now.
+    char next      = source[length];
+    source[length] = '\0';
+    ObjFunction* function = compileCached(server, source, length);
+    int status = function == NULL ? 65 : statusCode(interpretFunction(function));
+    source[length] = next;
+
+    fclose(outStream);
+    fclose(errStream);
+    vm.out = stdout;
+    vm.err = stderr;
+    resetGlobals(server);
+
+    writeReply(connection, status, out, outLength, err, errLength);
+    free(out);
+    free(err);
+}
+
+// Runs the request at the front of connection's input, if it's all there. Returns whether there's
+// another one ready after it.
+static bool runNext(Server* server, Connection* connection) {
+    size_t start;
+    size_t length;
+    switch (nextRequest(connection, &start, &length)) {
+        case REQUEST_PARTIAL: return false;
+        case REQUEST_READY: break;
+        case REQUEST_MALFORMED: {
+            static const char message[] = "Malformed request header.\n";
+            // There's no telling where the next request would start, so that's the last one.
+            writeReply(connection, 64, "", 0, message, sizeof(message) - 1);
+            connection->input.count = 0;
+            connection->closing     = true;
+            return false;
+        }
+    }
+
+    Buffer* input = &connection->input;
+    runScript(server, connection, input->bytes + start, length);
+    input->count -= start + length;
+    memmove(input->bytes, input->bytes + start + length, input->count);
+    writeOutput(connection);
+    return backlog(connection) < SERVER_MAX_BACKLOG &&
+           nextRequest(connection, &start, &length) != REQUEST_PARTIAL;
+}
+
+static int addPoll(Server* server, int fd, short events) {
+    if (server->pollCount == server->pollCapacity) {
+        server->pollCapacity = server->pollCapacity < 8 ? 8 : server->pollCapacity * 2;
+        server->polls = realloc(server->polls, sizeof(struct pollfd) * server->pollCapacity);
+        if (server->polls == NULL) exit(1);
+    }
+    struct pollfd* entry = &server->polls[server->pollCount];
+    entry->fd            = fd;
+    entry->events        = events;
+    entry->revents       = 0;
+    return server->pollCount++;
+}
+
+static bool isReady(Server* server, int poll) {
+    return poll >= 0 && server->polls[poll].revents != 0;
+}
+
+static bool isDone(Connection* connection) {
+    size_t start;
+    size_t length;
+    return connection->dead ||
+           (connection->closing && backlog(connection) == 0 &&
+            nextRequest(connection, &start, &length) == REQUEST_PARTIAL);
+}
+
+/* Each time around, every connection is polled for input unless it has a whole request waiting
+already or too many replies it hasn't read, and for output while it has replies waiting. Then
+each gets at most one of its requests run, so a client that sends many at once takes turns with
+the others. Standard input and output aren't made nonblocking, since they're shared with whoever
+started us, but there's only the one client then anyway. */
+static void serveConnections(Server* server) {
+    bool moreReady = false;
+    while (!stopping && (server->listener >= 0 || server->count > 0)) {
+        server->pollCount = 0;
+        if (server->listener >= 0) addPoll(server, server->listener, POLLIN);
+
+        // Connections accepted below wait for the next time around to be looked at.
+        int polled = server->count;
+        for (int i = 0; i < polled; i++) {
+            Connection* connection = &server->connections[i];
+            size_t      start;
+            size_t      length;
+            connection->inPoll  = -1;
+            connection->outPoll = -1;
+            if (!connection->closing && backlog(connection) < SERVER_MAX_BACKLOG &&
+                nextRequest(connection, &start, &length) == REQUEST_PARTIAL) {
+                connection->inPoll = addPoll(server, connection->in, POLLIN);
+            }
+            if (backlog(connection) > 0) {
+                connection->outPoll = addPoll(server, connection->out, POLLOUT);
+            }
+        }
+
+        // With requests already waiting to run, only look for what's ready now.
+        if (poll(server->polls, server->pollCount, moreReady ? 0 : -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Could not wait for clients: %s.\n", strerror(errno));
+            return;
+        }
+
+        if (server->listener >= 0 && isReady(server, 0)) acceptClients(server);
+
+        moreReady = false;
+        for (int i = 0; i < polled; i++) {
+            Connection* connection = &server->connections[i];
+            if (isReady(server, connection->inPoll)) readInput(connection);
+            if (isReady(server, connection->outPoll)) writeOutput(connection);
+            if (!connection->dead && backlog(connection) < SERVER_MAX_BACKLOG &&
+                runNext(server, connection)) {
+                moreReady = true;
+            }
+        }
+
+        for (int i = 0; i < server->count;) {
+            if (isDone(&server->connections[i])) {
+                closeConnection(&server->connections[i]);
+                server->connections[i] = server->connections[--server->count];
+            } else {
+                i++;
+            }
+        }
+    }
+}
+
+int serve(const char* path) {
+    Server server;
+    memset(&server, 0, sizeof(server));
+
+    bool useStdin = strcmp(path, "-") == 0;
+    if (useStdin) {
+        server.listener = -1;
+        addConnection(&server, STDIN_FILENO, STDOUT_FILENO);
+    } else {
+        server.listener = listenOn(path);
+        if (server.listener < 0) return 74;
+    }
+
+    // Without SA_RESTART, so a signal to stop gets poll() to give up waiting.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    // A client that hangs up before its reply is sent shouldn't take the server down with it.
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+
+    server.pinnedStart = vm.pinned.count;
+    server.builtins    = vm.globalValues.count;
+    for (int i = 0; i < SERVER_CACHE_SLOTS; i++) writeValueArray(&vm.pinned, NIL_VAL);
+    for (int i = 0; i < server.builtins; i++) {
+        writeValueArray(&vm.pinned, vm.globalValues.values[i]);
+    }
+
+    serveConnections(&server);
+
+    for (int i = 0; i < server.count; i++) closeConnection(&server.connections[i]);
+    for (int i = 0; i < SERVER_CACHE_SLOTS; i++) free(server.cache[i].source);
+    free(server.connections);
+    free(server.polls);
+    if (server.listener >= 0) {
+        close(server.listener);
+        unlink(path);
+    }
+    vm.pinned.count = server.pinnedStart;
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,36 @@
+#ifndef clox_server_h
+#define clox_server_h
+
+#include "common.h"
+
+/* With --serve, clox stays up and runs scripts as they're sent to it, all on the one VM that was
+set up at the start rather than a fresh one for each. A script is sent as its length in bytes, in
+decimal, on a line of its own, then the source itself. The reply is a line with the exit status
+clox would have given for the script alone and the lengths of what it printed and of any errors
+it reported, separated by spaces, then the printed output and the errors, one after the other:
+
+    12\nprint 1 + 2;     ->     0 2 0\n3\n
+
+Scripts come in either over a Unix domain socket, from any number of clients at once, or on
+standard input with the replies on standard output. Reading requests and writing replies never
+waits on any one client, so one that's slow to send or to read doesn't hold up the others. The
+scripts themselves run one at a time, to the end.
+
+Compiled scripts are cached on a hash of their source, so sending the same script again goes
+straight to running it. Global variables a script defines are gone again by the next one. */
+
+// How many compiled scripts are kept. A new one takes the place of whichever shares its slot.
+#define SERVER_CACHE_SLOTS 64
+
+// The largest script accepted, in bytes.
+#define SERVER_MAX_SCRIPT (64 * 1024 * 1024)
+
+// How many bytes of replies can wait on a client before it gets no more scripts run until it
+// has read some of them.
+#define SERVER_MAX_BACKLOG (1024 * 1024)
+
+// Serves requests on the Unix domain socket at path, or on standard input and output if path is
+// "-", until standard input ends or the process is told to stop. Returns the exit status.
+int serve(const char* path);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,108 @@
+#include "slab.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+// The slots start after the page header, rounded up so every object stays 16-byte aligned.
+#define SLAB_HEADER_SIZE \
+    ((sizeof(SlabPage) + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE)
+
+void initSlabs() {
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        vm.slabClasses[i].pages   = NULL;
+        vm.slabClasses[i].current = NULL;
+    }
+}
+
+static SlabPage* newPage(int sizeClass) {
+    SlabPage* page = aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    if (page == NULL) exit(1);
+
+    memset(page, 0, SLAB_HEADER_SIZE);
+    page->slotSize  = (int)slabClassSize(sizeClass);
+    page->slotCount = (int)((SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / page->slotSize);
+    page->slots     = (char*)page + SLAB_HEADER_SIZE;
+
+    // Thread the free list back to front so slots are handed out in address order.
+    for (int i = page->slotCount - 1; i >= 0; i--) {
+        void** slot    = (void**)(page->slots + (size_t)i * page->slotSize);
+        *slot          = page->freeList;
+        page->freeList = slot;
+    }
+
+    SlabClass* slabClass = &vm.slabClasses[sizeClass - 1];
+    page->next           = slabClass->pages;
+    slabClass->pages     = page;
+    return page;
+}
+
+// Hands out a free slot of the given class. This never collects; the caller is expected to have
+// already accounted for the allocation and given the GC its chance to run.
+void* slabAllocate(int sizeClass) {
+    SlabClass* slabClass = &vm.slabClasses[sizeClass - 1];
+    SlabPage*  page      = slabClass->current;
+    while (page != NULL && page->freeList == NULL) page = page->next;
+    if (page == NULL) page = newPage(sizeClass);
+    slabClass->current = page;
+
+    void** slot    = page->freeList;
+    page->freeList = *slot;
+    page->liveCount++;
+    page->hasYoung = true;
+
+    int      granule = slabGranule(page, (Obj*)slot);
+    uint64_t bit     = 1ull << (granule & 63);
+    page->used[granule >> 6] |= bit;
+    page->young[granule >> 6] |= bit;
+    return slot;
+}
+
+void slabFree(Obj* object) {
+    SlabPage* page    = slabPageOf(object);
+    int       granule = slabGranule(page, object);
+    uint64_t  bit     = 1ull << (granule & 63);
+    page->used[granule >> 6] &= ~bit;
+    page->young[granule >> 6] &= ~bit;
+    page->marks[granule >> 6] &= ~bit;
+
+    void** slot    = (void**)object;
+    *slot          = page->freeList;
+    page->freeList = slot;
+    page->liveCount--;
+}
+
+// Gives completely empty pages back to the system. Only done after a full collection: the nursery
+// churns through the same few pages between those, and there's no point returning them just to ask
+// for them again.
+void slabReleaseEmptyPages() {
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        SlabClass* slabClass = &vm.slabClasses[i];
+        SlabPage** link      = &slabClass->pages;
+        while (*link != NULL) {
+            SlabPage* page = *link;
+            if (page->liveCount == 0) {
+                *link = page->next;
+                free(page);
+            } else {
+                link = &page->next;
+            }
+        }
+        // After a sweep, holes can be anywhere, so start looking from the first page again.
+        slabClass->current = slabClass->pages;
+    }
+}
+
+void freeSlabs() {
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        SlabPage* page = vm.slabClasses[i].pages;
+        while (page != NULL) {
+            SlabPage* next = page->next;
+            free(page);
+            page = next;
+        }
+        vm.slabClasses[i].pages   = NULL;
+        vm.slabClasses[i].current = NULL;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef clox_slab_h
+#define clox_slab_h
+
+#include "common.h"
+#include "value.h"
+
+/* Small objects are carved out of fixed-size pages, one size class per page, instead of each
+getting its own trip through malloc(). The pages are aligned to their own size, so the page an
+object lives in is found by masking its address. Instead of chasing a linked list, the collector
+keeps its bookkeeping in bitmaps at the front of each page and sweeps them a word at a time. The
+bitmaps have one bit per 16-byte granule, and an object's bits are the ones for the granule it
+starts at, so finding them never needs a division by the slot size. */
+
+#define SLAB_PAGE_SIZE    (64 * 1024)
+#define SLAB_GRANULE      16
+#define SLAB_CLASS_COUNT  16  // Slots of 16, 32, ... 256 bytes.
+#define SLAB_MAX_SIZE     (SLAB_GRANULE * SLAB_CLASS_COUNT)
+#define SLAB_BITMAP_WORDS (SLAB_PAGE_SIZE / SLAB_GRANULE / 64)
+
+typedef struct SlabPage {
+    struct SlabPage* next;
+    int              slotSize;
+    int              slotCount;
+    int              liveCount;
+    bool             hasYoung;  // Handed out a slot since the last collection.
+    void*            freeList;  // Threaded through the first word of each free slot.
+    char*            slots;
+
+    uint64_t used[SLAB_BITMAP_WORDS];   // Slots holding an object.
+    uint64_t young[SLAB_BITMAP_WORDS];  // Slots holding an object that hasn't been promoted.
+    uint64_t marks[SLAB_BITMAP_WORDS];
+} SlabPage;
+
+typedef struct SlabClass {
+    SlabPage* pages;
+    SlabPage* current;  // Where the search for a free slot starts.
+} SlabClass;
+
+// Returns the size class for an object of size bytes, or 0 if it's too big for any of them.
+static inline int slabSizeClass(size_t size) {
+    if (size > SLAB_MAX_SIZE) return 0;
+    return (int)((size + SLAB_GRANULE - 1) / SLAB_GRANULE);
+}
+
+static inline size_t slabClassSize(int sizeClass) { return (size_t)sizeClass * SLAB_GRANULE; }
+
+static inline SlabPage* slabPageOf(Obj* object) {
+    return (SlabPage*)((uintptr_t)object & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+static inline int slabGranule(SlabPage* page, Obj* object) {
+    return (int)(((char*)object - page->slots) / SLAB_GRANULE);
+}
+
+static inline Obj* slabObjectAt(SlabPage* page, int granule) {
+    return (Obj*)(page->slots + (size_t)granule * SLAB_GRANULE);
+}
+
+void  initSlabs();
+void* slabAllocate(int sizeClass);
+void  slabFree(Obj* object);
+void  slabReleaseEmptyPages();
+void  freeSlabs();
+
+#endif
@@ -23,7 +23,8 @@ void freeTable(Table* table) {
 static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
     if (capacity == 0) return NULL;
 
-    uint32_t index     = key->hash % capacity;
+    uint32_t mask      = (uint32_t)capacity - 1;
+    uint32_t index     = key->hash & mask;
     Entry*   tombstone = NULL;
 
     for (;;) {
@@ -43,7 +44,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
             // We found the key.
             return entry;
         }
-        index = (index + 1) % capacity;
+        index = (index + 1) & mask;
     }
 }
 
@@ -57,21 +58,27 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
+// The capacity must be a power of two, which GROW_CAPACITY() guarantees.
 static void adjustCapacity(Table* table, int capacity) {
     Entry* entries = ALLOCATE(Entry, capacity);
     for (int i = 0; i < capacity; i++) {
         entries[i].key   = NULL;
         entries[i].value = NIL_VAL;
+        entries[i].hash  = 0;
     }
 
-    table->count = 0;
+    // The new array has no tombstones and every key in it is different, so each entry just goes
+    // in the first empty bucket from where its hash points. The stored hash means the keys
+    // themselves are never touched.
+    uint32_t mask = (uint32_t)capacity - 1;
+    table->count  = 0;
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key   = entry->key;
-        dest->value = entry->value;
+        uint32_t index = entry->hash & mask;
+        while (entries[index].key != NULL) index = (index + 1) & mask;
+        entries[index] = *entry;
         table->count++;
     }
 
@@ -96,6 +103,7 @@ bool tableSet(Table* table, ObjString* key, Value value) {
 
     entry->key   = key;
     entry->value = value;
+    entry->hash  = key->hash;
     return isNewKey;
 }
 
@@ -125,7 +133,8 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash % table->capacity;
+    uint32_t mask  = (uint32_t)table->capacity - 1;
+    uint32_t index = hash & mask;
 
     for (;;) {
         Entry* entry = &table->entries[index];
@@ -133,22 +142,27 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
         if (entry->key == NULL) {
             // Stop if we find an empty non-tombstone entry.
             if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length && entry->key->hash == hash &&
+        } else if (entry->hash == hash && entry->key->length == length &&
                    memcmp(entry->key->chars, chars, length) == 0) {
             // We found it.
             return entry->key;
         }
-        index = (index + 1) % table->capacity;
+        index = (index + 1) & mask;
     }
 }
 
-void tableRemoveWhite(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
+// Deletes the entries whose keys are old and unmarked, looking at no more than count entries from
+// start, and returns the index to carry on from. Young keys were allocated after marking finished,
+// so they are live whatever their mark says.
+int tableRemoveWhite(Table* table, int start, int count) {
+    int end = start + count < table->capacity ? start + count : table->capacity;
+    for (int i = start; i < end; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
+        if (entry->key != NULL && entry->key->obj.isOld && !isObjectMarked((Obj*)entry->key)) {
             tableDelete(table, entry->key);
         }
     }
+    return end;
 }
 
 void markTable(Table* table) {
@@ -7,8 +7,10 @@
 typedef struct Entry {
     ObjString* key;
     Value      value;
+    uint32_t   hash;  // A copy of the key's, so probing past other keys never has to load them.
 } Entry;
 
+// The capacity is always zero or a power of two, so an index is found by masking the hash.
 typedef struct Table {
     int    count;
     int    capacity;
@@ -22,7 +24,7 @@ bool       tableSet(Table* table, ObjString* key, Value value);
 bool       tableDelete(Table* table, ObjString* key);
 void       tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
-void       tableRemoveWhite(Table* table);
+int        tableRemoveWhite(Table* table, int start, int count);
 void       markTable(Table* table);
 
 #endif
\ No newline at end of file
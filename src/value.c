@@ -28,16 +28,41 @@ void freeValueArray(ValueArray* array) {
     initValueArray(array);
 }
 
-void printValue(Value value) {
+void fprintValue(FILE* file, Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        fprintf(file, AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        fprintf(file, "nil");
+    } else if (IS_NUMBER(value)) {
+        fprintf(file, "%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        fprintObject(file, value);
+    } else if (IS_UNDEFINED(value)) {
+        fprintf(file, "undefined");
+    }
+#else
     switch (value.type) {
-        case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
-        case VAL_NIL: printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-        case VAL_OBJ: printObject(value); break;
+        case VAL_BOOL: fprintf(file, AS_BOOL(value) ? "true" : "false"); break;
+        case VAL_NIL: fprintf(file, "nil"); break;
+        case VAL_NUMBER: fprintf(file, "%g", AS_NUMBER(value)); break;
+        case VAL_OBJ: fprintObject(file, value); break;
+        case VAL_UNDEFINED: fprintf(file, "undefined"); break;
     }
+#endif
 }
 
+void printValue(Value value) { fprintValue(stdout, value); }
+
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Compare numbers as doubles rather than bit patterns so that NaN != NaN and 0 == -0, exactly
+    // like the tagged-union representation does.
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+#else
     if (a.type != b.type) return false;
 
     switch (a.type) {
@@ -45,6 +70,8 @@ bool valuesEqual(Value a, Value b) {
         case VAL_NIL: return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_UNDEFINED: return true;
         default: return false;  // Unreachable.
     }
-}
\ No newline at end of file
+#endif
+}
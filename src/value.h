@@ -1,16 +1,76 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <stdio.h>
+#include <string.h>
+
 #include "common.h"
 
 typedef struct Obj       Obj;
 typedef struct ObjString ObjString;
 
+/* Besides the values Lox code can see, there is one internal marker, UNDEFINED_VAL. It fills the
+global variable slots the compiler has handed out for names that haven't been defined (yet), so
+the VM can tell an undefined global apart from one holding nil. It never ends up on the stack. */
+
+#ifdef NAN_BOXING
+
+/* With NaN boxing every Value is a single 64-bit word. A double is stored as-is. Everything else
+hides inside the unused payload of a quiet NaN: when all of the QNAN bits are set the hardware
+never produces that pattern from arithmetic, so the remaining low bits are free for our own tags.
+Nil, true and false get small tag values in the lowest bits, and an Obj* (which only uses the
+low 48 bits on x86-64 and AArch64) is stored with the sign bit also set to tell it apart. */
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL       1  // 001.
+#define TAG_FALSE     2  // 010.
+#define TAG_TRUE      3  // 011.
+#define TAG_UNDEFINED 4  // 100.
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)    ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+#define AS_BOOL(value)   ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value)    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL     ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num)   numToValue(num)
+#define OBJ_VAL(object)   (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+
+// Type punning through memcpy() is the one way of reinterpreting the bits that every compiler
+// agrees is defined behavior, and they all optimize it down to a plain register move.
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum ValueType {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct Value {
@@ -27,6 +87,8 @@ typedef struct Value {
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)    ((value).type == VAL_OBJ)
 
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+
 #define AS_BOOL(value)   ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_OBJ(value)    ((value).as.obj)
@@ -35,6 +97,9 @@ typedef struct Value {
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
+
+#endif
 
 typedef struct ValueArray {
     int    capacity;
@@ -46,6 +111,7 @@ bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
+void fprintValue(FILE* file, Value value);
 void printValue(Value value);
 
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "vm.h"
 
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,36 +9,80 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
+#include "native.h"
 #include "object.h"
-#include "time.h"
 #include "value.h"
 
-VM vm;
+_Thread_local VM vm;
 
-static Value clockNative(int argCount, Value* args) {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
-}
+static void resetStack();
+static void growFrames(int capacity);
+static void growStack(int capacity);
 
 void initVM() {
+    vm.frames        = NULL;
+    vm.frameCapacity = 0;
+    vm.stack         = NULL;
+    vm.stackCapacity = 0;
+    growFrames(FRAMES_INITIAL);
+    growStack(STACK_INITIAL);
     resetStack();
     vm.objects      = NULL;
+    vm.youngObjects = NULL;
     vm.openUpvalues = NULL;
+    vm.youngGlobals = false;
+    vm.classVersion = 0;
+    vm.shapeId      = 0;
 
     vm.bytesAllocated = 0;
-    vm.nextGC         = 1024 * 1024;
-
-    vm.grayCount    = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack    = NULL;
-
-    initTable(&vm.globals);
+    vm.nextGC         = GC_INITIAL_HEAP;
+    vm.gcGrowthFactor = GC_HEAP_GROW_FACTOR;
+    vm.gcMaxHeap      = 0;
+    vm.youngBytes     = 0;
+
+    vm.collectingYoung = false;
+    vm.gcPhase         = GC_IDLE;
+    vm.gcSliceBudget   = GC_SLICE_BUDGET;
+    vm.gcDebt          = 0;
+    memset(&vm.gcStats, 0, sizeof(vm.gcStats));
+
+    vm.out      = stdout;
+    vm.err      = stderr;
+    vm.optimize = true;
+    vm.jit      = false;
+    memset(&vm.optimizerStats, 0, sizeof(vm.optimizerStats));
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+    vm.countOpcodes = true;
+#else
+    vm.countOpcodes = false;
+#endif
+    memset(vm.opcodeCounts, 0, sizeof(vm.opcodeCounts));
+    memset(vm.opcodeTicks, 0, sizeof(vm.opcodeTicks));
+    vm.lastTick   = 0;
+    vm.lastOpcode = 0;
+    initProfile(&vm.profile);
+
+    vm.marker.grayCount    = 0;
+    vm.marker.grayCapacity = 0;
+    vm.marker.grayStack    = NULL;
+    vm.marker.pool         = NULL;
+    vm.gcThreads           = 1;
+
+    vm.rememberedCount    = 0;
+    vm.rememberedCapacity = 0;
+    vm.rememberedSet      = NULL;
+
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.pinned);
+    initTable(&vm.globalNames);
     initTable(&vm.strings);
 
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
 
-    defineNative("clock", clockNative);
+    defineNatives();
 }
 
 static void resetStack() {
@@ -45,28 +90,58 @@ static void resetStack() {
     vm.frameCount = 0;
 }
 
-static void runtimeError(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    fputs("\n", stderr);
+static void reportError(const char* format, va_list args) {
+    vfprintf(vm.err, format, args);
+    fputs("\n", vm.err);
 
+    // Deep recursion can leave far too many frames to list. Past TRACE_MAX, only the innermost
+    // and outermost halves are shown.
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        if (vm.frameCount > TRACE_MAX && i == vm.frameCount - TRACE_MAX / 2 - 1) {
+            int skipped = vm.frameCount - TRACE_MAX;
+            fprintf(vm.err, "... %d more frames ...\n", skipped);
+            i -= skipped - 1;
+            continue;
+        }
+
         CallFrame*   frame    = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
         // -1 because the IP is sittting on the next instruction to be executed.
         size_t instruction = frame->ip - function->chunk.code - 1;
-        int    line        = function->chunk.lines[instruction];
-        fprintf(stderr, "[line %d] in ", line);
-        function->name == NULL ? fprintf(stderr, "script\n")
-                               : fprintf(stderr, "%s()\n", function->name->chars);
+        int    line        = getLine(&function->chunk, (int)instruction);
+        fprintf(vm.err, "[line %d] in ", line);
+        function->name == NULL ? fprintf(vm.err, "script\n")
+                               : fprintf(vm.err, "%s()\n", function->name->chars);
     }
 
     resetStack();
 }
 
-static void defineNative(const char* name, NativeFn function) {
+static void runtimeError(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    reportError(format, args);
+    va_end(args);
+}
+
+// Reports a runtime error from inside a native function, which then returns the false this returns
+// to have the VM unwind.
+bool nativeError(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    reportError(format, args);
+    va_end(args);
+    return false;
+}
+
+// The globals aren't a heap object, so they can't go in the remembered set. Instead a single flag
+// covers all of them: a minor collection only rescans the globals if one was pointed at a young
+// object since the last collection.
+static inline void globalBarrier(Value value) {
+    if (IS_OBJ(value) && !AS_OBJ(value)->isOld) vm.youngGlobals = true;
+}
+
+void defineNative(const char* name, int arity, NativeFn function) {
     /* You’re probably wondering why we push and pop the name and function on the
     stack. That looks weird, right? This is the kind of stuff you have to worry about
     when garbage collection gets involved. Both copyString() and
@@ -76,19 +151,100 @@ static void defineNative(const char* name, NativeFn function) {
     doesn’t free them out from under us. Storing them on the value stack
     accomplishes that. */
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VAL(newNative(function, arity, AS_STRING(vm.stack[0]))));
+    int slot                     = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
+    globalBarrier(vm.stack[1]);
     pop();
     pop();
 }
 
 void freeVM() {
-    freeTable(&vm.globals);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.pinned);
+    freeTable(&vm.globalNames);
     freeTable(&vm.strings);
     vm.initString = NULL;
     freeObjects();
+    free(vm.frames);
+    free(vm.stack);
+    freeProfile(&vm.profile);
+}
+
+// Returns the slot for a global variable name, handing out a new undefined one the first time the
+// name is seen. Slots are never taken back, so code compiled earlier (in the REPL, say) keeps
+// pointing at the right variable.
+int globalSlot(ObjString* name) {
+    Value index;
+    if (tableGet(&vm.globalNames, name, &index)) return (int)AS_NUMBER(index);
+
+    push(OBJ_VAL(name));
+    int slot = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    tableSet(&vm.globalNames, name, NUMBER_VAL((double)slot));
+    globalBarrier(OBJ_VAL(name));
+    pop();
+    return slot;
+}
+
+// Maps a slot back to its variable name. Only needed for error messages and the disassembler, so a
+// linear scan over the name table is fine.
+ObjString* globalName(int slot) {
+    for (int i = 0; i < vm.globalNames.capacity; i++) {
+        Entry* entry = &vm.globalNames.entries[i];
+        if (entry->key != NULL && AS_NUMBER(entry->value) == slot) return entry->key;
+    }
+    return NULL;
+}
+
+/* The stacks live outside the GC heap and are grown with the system allocator, like the gray
+stack. Nothing in the VM ever holds a pointer to a CallFrame across a call, since run() reloads its
+own after every one, so the frame stack can simply be reallocated. */
+static void growFrames(int capacity) {
+    vm.frames        = realloc(vm.frames, sizeof(CallFrame) * capacity);
+    vm.frameCapacity = capacity;
+    if (vm.frames == NULL) exit(1);
 }
 
+/* The value stack is another matter: stackTop, every frame's slots and every open upvalue point
+straight into it. Once it has moved, they're all shifted by however far it went. So it's copied
+to the new block by hand rather than reallocated, and everything is moved across while the old
+block is still there to measure from. Natives get a pointer to their arguments too, but nothing a
+native does can grow the stack. */
+static void growStack(int capacity) {
+    Value* stack = malloc(sizeof(Value) * capacity);
+    if (stack == NULL) exit(1);
+
+    if (vm.stack != NULL) {
+        memcpy(stack, vm.stack, sizeof(Value) * vm.stackCapacity);
+        vm.stackTop = stack + (vm.stackTop - vm.stack);
+        for (int i = 0; i < vm.frameCount; i++) {
+            vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+        }
+        for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+            upvalue->location = stack + (upvalue->location - vm.stack);
+        }
+        free(vm.stack);
+    }
+    vm.stack         = stack;
+    vm.stackCapacity = capacity;
+}
+
+// Makes sure there's room for at least the given number of values above stackTop. Only fails
+// once the stack would have to grow past STACK_MAX.
+bool reserveStack(int slots) {
+    size_t needed = (size_t)(vm.stackTop - vm.stack) + slots;
+    if (needed <= (size_t)vm.stackCapacity) return true;
+    if (needed > STACK_MAX) return false;
+
+    int capacity = vm.stackCapacity;
+    while ((size_t)capacity < needed) capacity *= 2;
+    growStack(capacity < STACK_MAX ? capacity : STACK_MAX);
+    return true;
+}
+
+// Pushing never checks for room. call() reserves what each function needs up front, and leaves
+// STACK_SLACK to spare for anything else.
 void push(Value value) { *vm.stackTop++ = value; }
 
 Value pop() { return *--vm.stackTop; }
@@ -101,16 +257,24 @@ static bool call(ObjClosure* closure, int argCount) {
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    // The compiler records the most stack slots the function can use at once, so this is the one
+    // place the stack needs checking. Slot zero and the arguments are already on it.
+    Value* frameEnd = vm.stackTop - argCount - 1 + closure->function->maxSlots + STACK_SLACK;
+    if (frameEnd > vm.stack + vm.stackCapacity && !reserveStack((int)(frameEnd - vm.stackTop))) {
         runtimeError("Stack overflow.");
         return false;
     }
+    if (vm.frameCount == vm.frameCapacity) growFrames(vm.frameCapacity * 2);
 
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure   = closure;
     frame->ip        = closure->function->chunk.code;
     // -1 to skip over local slot zero, which contains function being called.
     frame->slots = vm.stackTop - argCount - 1;
+
+#ifdef CLOX_JIT
+    if (vm.jit && ++closure->function->hotness == JIT_THRESHOLD) compileFunction(closure->function);
+#endif
     return true;
 }
 
@@ -138,10 +302,14 @@ static bool callValue(Value callee, int argCount) {
             }
             case OBJ_CLOSURE: return call(AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value    result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
+                ObjNative* native = AS_NATIVE(callee);
+                if (native->arity >= 0 && argCount != native->arity) {
+                    runtimeError("Expected %d arguments, but got %d.", native->arity, argCount);
+                    return false;
+                }
+                // The result is left where the native was, which is just where it belongs.
+                if (!native->function(argCount, vm.stackTop - argCount)) return false;
+                vm.stackTop -= argCount;
                 return true;
             }
             default: break;  // Non-callable object type.
@@ -162,7 +330,62 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
     return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
+static bool bindMethod(ObjClass* klass, ObjString* name) {
+    Value method;
+    if (!tableGet(&klass->methods, name, &method)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+
+    pop(); // Receiver.
+    push(OBJ_VAL(bound));
+    return true;
+}
+
+static InlineCacheEntry* findCacheEntry(InlineCache* cache, ObjInstance* instance) {
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        InlineCacheEntry* entry = &cache->entries[i];
+        if (entry->shapeId == instance->shape->id &&
+            entry->classVersion == instance->klass->version) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Claims the first way of the cache for a receiver shape, pushing the older entries down and
+// evicting the least recently filled one once every way is in use.
+static InlineCacheEntry* fillCacheEntry(InlineCache* cache, ObjShape* shape, ObjClass* klass) {
+    memmove(&cache->entries[1], &cache->entries[0],
+            sizeof(InlineCacheEntry) * (INLINE_CACHE_WAYS - 1));
+
+    InlineCacheEntry* entry = &cache->entries[0];
+    entry->shapeId          = shape->id;
+    entry->classVersion     = klass->version;
+    entry->slot             = -1;
+    entry->method           = NULL;
+    entry->transition       = NULL;
+    return entry;
+}
+
+// Works out what a property name means for this instance's shape, a field slot or a method, and
+// records it in the cache. Returns NULL if the instance has neither.
+static InlineCacheEntry* resolveProperty(InlineCache* cache, ObjInstance* instance,
+                                         ObjString* name) {
+    // A field with the same name takes priority over a method, so look at the shape first.
+    int   slot = shapeFieldSlot(instance->shape, name);
+    Value method;
+    if (slot == -1 && !tableGet(&instance->klass->methods, name, &method)) return NULL;
+
+    InlineCacheEntry* entry = fillCacheEntry(cache, instance->shape, instance->klass);
+    entry->slot             = slot;
+    if (slot == -1) entry->method = AS_CLOSURE(method);
+    return entry;
+}
+
+static bool invoke(ObjString* name, int argCount, InlineCache* cache) {
     Value receiver = peek(argCount);
 
     if (!IS_INSTANCE(receiver)) {
@@ -170,32 +393,59 @@ static bool invoke(ObjString* name, int argCount) {
         return false;
     }
 
-    ObjInstance* instance = AS_INSTANCE(receiver);
-
-    // Before looking up a method on the instance’s class, we look
-    // for a field with the same name. If we find a field, then we store it on the stack in
-    // place of the receiver, under the argument list.
-    Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+    ObjInstance*      instance = AS_INSTANCE(receiver);
+    InlineCacheEntry* entry    = findCacheEntry(cache, instance);
+    if (entry == NULL && (entry = resolveProperty(cache, instance, name)) == NULL) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    if (entry->slot == -1) return call(entry->method, argCount);
+
+    // The name is a field. Store its value on the stack in place of the receiver, under the
+    // argument list, and call whatever it holds.
+    Value value                = instance->fields[entry->slot];
+    vm.stackTop[-argCount - 1] = value;
+    return callValue(value, argCount);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'", name->chars);
-        return false;
+static void setProperty(ObjInstance* instance, ObjString* name, Value value, InlineCache* cache) {
+    InlineCacheEntry* entry = findCacheEntry(cache, instance);
+    if (entry != NULL) {
+        if (entry->transition == NULL) {
+            instance->fields[entry->slot] = value;
+            writeBarrier((Obj*)instance, value);
+            return;
+        }
+
+        // Adding the same field every instance from this site gets. As long as there is already
+        // room for it, and the class's inline field estimate doesn't need bumping, this is just
+        // a store and a shape swap.
+        if (entry->slot < instance->fieldCapacity && entry->slot < instance->klass->inlineFields) {
+            instance->fields[entry->slot] = value;
+            instance->shape               = entry->transition;
+            writeBarrier((Obj*)instance, value);
+            writeBarrier((Obj*)instance, OBJ_VAL(entry->transition));
+            return;
+        }
+
+        instanceAddField(instance, name, value);
+        return;
     }
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjShape* shape = instance->shape;
+    int       slot  = shapeFieldSlot(shape, name);
+    if (slot != -1) {
+        instance->fields[slot] = value;
+        writeBarrier((Obj*)instance, value);
+        fillCacheEntry(cache, shape, instance->klass)->slot = slot;
+        return;
+    }
 
-    pop(); // Receiver.
-    push(OBJ_VAL(bound));
-    return true;
+    instanceAddField(instance, name, value);
+    entry             = fillCacheEntry(cache, shape, instance->klass);
+    entry->slot       = shape->fieldCount;
+    entry->transition = instance->shape;
 }
 
 static ObjUpvalue* captureUpvalue(Value* local) {
@@ -238,6 +488,7 @@ static void closeUpvalues(Value* last) {
         upvalue->closed     = *upvalue->location;
         upvalue->location   = &upvalue->closed;
         vm.openUpvalues     = upvalue->next;
+        writeBarrier((Obj*)upvalue, upvalue->closed);
     }
 }
 
@@ -245,32 +496,364 @@ static void defineMethod(ObjString* name) {
     Value     method = peek(0);
     ObjClass* klass  = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    writeBarrier((Obj*)klass, method);
+    touchClass(klass);
+    pop();
+}
+
+// The bodies of OP_GET_PROPERTY and OP_SET_PROPERTY, shared with their long forms.
+static bool loadProperty(ObjString* name, InlineCache* cache) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance*      instance = AS_INSTANCE(peek(0));
+    InlineCacheEntry* entry    = findCacheEntry(cache, instance);
+    if (entry == NULL && (entry = resolveProperty(cache, instance, name)) == NULL) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    if (entry->slot != -1) {
+        Value value = instance->fields[entry->slot];
+        pop();  // Instance.
+        push(value);
+        return true;
+    }
+
+    ObjBoundMethod* bound = newBoundMethod(peek(0), entry->method);
+    pop();  // Instance.
+    push(OBJ_VAL(bound));
+    return true;
+}
+
+static bool storeProperty(ObjString* name, InlineCache* cache) {
+    if (!IS_INSTANCE(peek(1))) {
+        runtimeError("Only instances have fields.");
+        return false;
+    }
+
+    setProperty(AS_INSTANCE(peek(1)), name, peek(0), cache);
+
+    // A setter is itself an expression whose result is the assigned value,
+    // so we need to leave that value on the stack.
+    Value value = pop();
     pop();
+    push(value);
+    return true;
+}
+
+// Checks that the value distance slots down is a list and the one above it an index into it, and
+// returns the list with the index in slot.
+static ObjList* indexedList(int distance, int* slot) {
+    if (!IS_LIST(peek(distance))) {
+        runtimeError("Only lists can be indexed.");
+        return NULL;
+    }
+    ObjList* list  = AS_LIST(peek(distance));
+    Value    index = peek(distance - 1);
+    if (!IS_NUMBER(index)) {
+        runtimeError("List index must be a number.");
+        return NULL;
+    }
+
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < list->count)) {
+        runtimeError("List index %g out of range for a list of %d.", number, list->count);
+        return NULL;
+    }
+    if (number != (int)number) {
+        runtimeError("List index must be a whole number, not %g.", number);
+        return NULL;
+    }
+    *slot = (int)number;
+    return list;
+}
+
+// Fills in the upvalues of a closure that was just pushed, reading the (isLocal, index) pairs
+// that follow OP_CLOSURE or OP_CLOSURE_LONG. The long form's indexes take three bytes.
+static void captureUpvalues(CallFrame* frame, ObjClosure* closure, bool isLong) {
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = *frame->ip++;
+        int     index   = *frame->ip++;
+        if (isLong) {
+            index = (index << 16) | (frame->ip[0] << 8) | frame->ip[1];
+            frame->ip += 2;
+        }
+
+        // A borrowed local is read in place, so there's nothing to capture. The entry stays NULL.
+        if (isLocal == 2) continue;
+
+        if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        // Capturing allocates, so the closure may have been promoted part way through.
+        writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
+    }
 }
 
 static bool isFalsey(Value value) { return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)); }
 
+// The bodies of OP_EQUAL, OP_INHERIT, OP_GET_INDEX and OP_SET_INDEX, shared with the JIT.
+static void testEqual() {
+    // Flat strings are interned, so two are equal only if they're the same object. A rope has to
+    // be flattened to compare it the same way, and it's done in place on the stack to keep both
+    // operands reachable while the flat copy is made.
+    if (IS_ROPE(peek(0))) vm.stackTop[-1] = OBJ_VAL(flattenRope(AS_ROPE(peek(0))));
+    if (IS_ROPE(peek(1))) vm.stackTop[-2] = OBJ_VAL(flattenRope(AS_ROPE(peek(1))));
+    Value a = pop();
+    Value b = pop();
+    push(BOOL_VAL(valuesEqual(a, b)));
+}
+
+static bool inherit() {
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass)) {
+        runtimeError("Superclass must be a class.");
+        return false;
+    }
+
+    ObjClass* subclass = AS_CLASS(peek(0));
+    tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+    // Some of the copied methods may be young. Rather than check them one by one, just remember
+    // the subclass.
+    if (subclass->obj.isOld && !subclass->obj.isRemembered) rememberObject((Obj*)subclass);
+    touchClass(subclass);
+    pop(); // Subclass.
+    return true;
+}
+
+static bool loadIndex() {
+    int      slot;
+    ObjList* list = indexedList(1, &slot);
+    if (list == NULL) return false;
+    vm.stackTop -= 2;
+    push(list->items[slot]);
+    return true;
+}
+
+// Appends the top itemCount values to the list under them, and pops them. They stay on the stack
+// until the list has them, since growing it can set off a collection.
+static void extendList(int itemCount) {
+    ObjList* list = AS_LIST(vm.stackTop[-itemCount - 1]);
+    for (Value* item = vm.stackTop - itemCount; item < vm.stackTop; item++) {
+        listAppend(list, *item);
+    }
+    vm.stackTop -= itemCount;
+}
+
+static bool storeIndex() {
+    int      slot;
+    ObjList* list = indexedList(2, &slot);
+    if (list == NULL) return false;
+    Value value       = peek(0);
+    list->items[slot] = value;
+    writeBarrier((Obj*)list, value);
+    // Like any assignment, this leaves the value on the stack.
+    vm.stackTop -= 3;
+    push(value);
+    return true;
+}
+
 static void concatenate() {
     // Concatenating two strings requires allocating a new character array on the heap, which can in
     // turn trigger a GC. Since we’ve already popped the operand strings by that point, they can
     // potentially be missed by the mark phase and get swept away. Instead of popping them off the
     // stack eagerly, we peek them, so they remain on the stack while the string is created. Once
     // that’s done, we can safely pop them off and replace them with the result.
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+    Value result = concatenateStrings(peek(1), peek(0));
+    pop();
+    pop();
+    push(result);
+}
 
-    int   length = a->length + b->length;
-    char* chars  = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+#ifdef CLOX_JIT
+/* The helpers compiled code calls, declared in jit.h. Each does what run() does for the same
+instruction, given the operands run() would have read. By the time one is called, frame->ip is
+past those operands and vm.stackTop is up to date. */
+JitStatus jitSetGlobal(int slot) {
+    if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+        runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
+        return JIT_ERROR;
+    }
+    vm.globalValues.values[slot] = peek(0);
+    globalBarrier(peek(0));
+    return JIT_CONTINUE;
+}
 
-    ObjString* result = takeString(chars, length);
+void jitDefineGlobal(int slot) {
+    vm.globalValues.values[slot] = peek(0);
+    globalBarrier(peek(0));
     pop();
+}
+
+void jitSetUpvalue(int slot) {
+    ObjUpvalue* upvalue = vm.frames[vm.frameCount - 1].closure->upvalues[slot];
+    *upvalue->location  = peek(0);
+    writeBarrier((Obj*)upvalue, peek(0));
+}
+
+JitStatus jitGetProperty(ObjString* name, InlineCache* cache) {
+    return loadProperty(name, cache) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+JitStatus jitSetProperty(ObjString* name, InlineCache* cache) {
+    return storeProperty(name, cache) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+JitStatus jitGetSuper(ObjString* name) {
+    ObjClass* superclass = AS_CLASS(pop());
+    return bindMethod(superclass, name) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+void jitEqual() { testEqual(); }
+
+// Only called once the operands turned out not to be two numbers.
+JitStatus jitAdd() {
+    if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+        concatenate();
+        return JIT_CONTINUE;
+    }
+    runtimeError("Operands must be two numbers or two strings.");
+    return JIT_ERROR;
+}
+
+void jitPrint() {
+    fprintValue(vm.out, pop());
+    fputc('\n', vm.out);
+}
+
+// A call that pushed a frame says so, and the compiled code goes on with the callee. A native, or
+// a class without an initializer, is done by the time callValue() returns.
+JitStatus jitCall(int argCount) {
+    int frameCount = vm.frameCount;
+    if (!callValue(peek(argCount), argCount)) return JIT_ERROR;
+    return vm.frameCount == frameCount ? JIT_CONTINUE : JIT_FRAME;
+}
+
+JitStatus jitInvoke(ObjString* name, int argCount, InlineCache* cache) {
+    int frameCount = vm.frameCount;
+    if (!invoke(name, argCount, cache)) return JIT_ERROR;
+    return vm.frameCount == frameCount ? JIT_CONTINUE : JIT_FRAME;
+}
+
+JitStatus jitSuperInvoke(ObjString* name, int argCount) {
+    ObjClass* superclass = AS_CLASS(pop());
+    return invokeFromClass(superclass, name, argCount) ? JIT_FRAME : JIT_ERROR;
+}
+
+// frame->ip points at the upvalue operands, for captureUpvalues() to read.
+void jitClosure(ObjFunction* function, bool isLong) {
+    ObjClosure* closure = newClosure(function);
+    push(OBJ_VAL(closure));
+    captureUpvalues(&vm.frames[vm.frameCount - 1], closure, isLong);
+}
+
+void jitCloseUpvalue() {
+    closeUpvalues(vm.stackTop - 1);
     pop();
-    push(OBJ_VAL(result));
 }
 
+JitStatus jitReturn() {
+    CallFrame* frame  = &vm.frames[vm.frameCount - 1];
+    Value      result = pop();
+    closeUpvalues(frame->slots);
+    vm.frameCount--;
+
+    if (vm.frameCount == 0) {
+        pop();
+        return JIT_DONE;
+    }
+
+    vm.stackTop = frame->slots;
+    push(result);
+    return JIT_FRAME;
+}
+
+void jitClass(ObjString* name) { push(OBJ_VAL(newClass(name))); }
+
+JitStatus jitInherit() { return inherit() ? JIT_CONTINUE : JIT_ERROR; }
+
+void jitMethod(ObjString* name) { defineMethod(name); }
+
+void jitBuildList(int itemCount) {
+    ObjList* list = newList(vm.stackTop - itemCount, itemCount);
+    vm.stackTop -= itemCount;
+    push(OBJ_VAL(list));
+}
+
+void jitExtendList(int itemCount) { extendList(itemCount); }
+
+JitStatus jitGetIndex() { return loadIndex() ? JIT_CONTINUE : JIT_ERROR; }
+
+JitStatus jitSetIndex() { return storeIndex() ? JIT_CONTINUE : JIT_ERROR; }
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame* frame) {
+    printf("          ");
+    for (Value* value = vm.stack; value < vm.stackTop; value++) {
+        printf("[ ");
+        printValue(*value);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(&frame->closure->function->chunk,
+                           (int)(frame->ip - frame->closure->function->chunk.code));
+}
+#endif
+
+// Charges the time since the last instruction started to that one, and counts this one.
+static inline uint8_t countInstruction(uint8_t instruction) {
+    uint64_t now = readTicks();
+    vm.opcodeTicks[vm.lastOpcode] += now - vm.lastTick;
+    vm.opcodeCounts[instruction]++;
+    vm.lastTick   = now;
+    vm.lastOpcode = instruction;
+    return instruction;
+}
+
+/* Profiling must cost nothing while it's off, so it isn't a check on every instruction. In the
+threaded build, run() jumps through a per-thread dispatch table, and turning profiling on chiefly
+means pointing entries elsewhere. Counting points every entry at a stub that counts the
+instruction and goes on to its handler. A sample is requested, from the profiler's signal handler,
+by pointing every entry at a stub that puts the table back, records the sample and carries on to
+wherever the table then says. The portable build has no such table, and pays for a check of two
+flags on each instruction instead. */
+#ifdef COMPUTED_GOTO
+static _Thread_local void* volatile dispatchTable[OPCODE_COUNT];
+static _Thread_local void*          sampleStub;  // NULL until run() has first set the table up.
+
+static void resetDispatch(void* const* handlers, void* countStub) {
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        dispatchTable[i] = vm.countOpcodes ? countStub : handlers[i];
+    }
+}
+
+// Only touches the table, so it's safe to call from a signal handler.
+void requestSample() {
+    void* stub = sampleStub;
+    if (stub == NULL) return;
+    for (int i = 0; i < OPCODE_COUNT; i++) dispatchTable[i] = stub;
+}
+#else
+static _Thread_local volatile sig_atomic_t samplePending;
+
+void requestSample() { samplePending = 1; }
+
+static uint8_t profileInstruction(uint8_t instruction) {
+    if (samplePending) {
+        samplePending = 0;
+        recordSample();
+    }
+    if (vm.countOpcodes) countInstruction(instruction);
+    return instruction;
+}
+#endif
+
 static InterpretResult run() {
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
 
@@ -278,7 +861,15 @@ static InterpretResult run() {
 #define READ_SHORT()    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING()   AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                          \
+#define READ_LONG() \
+    (frame->ip += 3, (uint32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_CONSTANT_LONG() (frame->closure->function->chunk.constants.values[READ_LONG()])
+#define READ_STRING_LONG()   AS_STRING(READ_CONSTANT_LONG())
+#define READ_CACHE()    (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_CACHE_LONG()  (&frame->closure->function->chunk.caches[READ_LONG()])
+// Every instruction BINARY_OP handles takes no operands, so frame->ip[-1] is its opcode, and
+// once it's worked it rewrites that into its quickened form for numbers.
+#define BINARY_OP(valueType, op, quickened)               \
     do {                                                  \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
             runtimeError("Operands must be numbers.");    \
@@ -287,305 +878,651 @@ static InterpretResult run() {
         double b = AS_NUMBER(pop());                      \
         double a = AS_NUMBER(pop());                      \
         push(valueType(a op b));                          \
+        frame->ip[-1] = quickened;                        \
+    } while (false)
+// The quickened form works on the stack in place. When its guard fails, it steps back and turns
+// the instruction into the generic one again, which the next dispatch then runs.
+#define NUMBER_OP(valueType, op, generic)               \
+    do {                                                \
+        if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) { \
+            double b = AS_NUMBER(vm.stackTop[-1]);      \
+            double a = AS_NUMBER(vm.stackTop[-2]);      \
+            vm.stackTop[-2] = valueType(a op b);        \
+            vm.stackTop--;                              \
+        } else {                                        \
+            *--frame->ip = generic;                     \
+        }                                               \
     } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* value = vm.stack; value < vm.stackTop; value++) {
-            printf("[ ");
-            printValue(*value);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk,
-                               (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() traceExecution(frame)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
 
-            case OP_SET_LOCAL: {
-                uint8_t slot       = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
+#ifdef CLOX_JIT
+    // Wherever the innermost frame may have changed, its function may have compiled code to run
+    // instead. That goes on until it hands a frame back with JIT_INTERPRET.
+#define ENTER_JIT()                                                  \
+    do {                                                             \
+        if (vm.jit && frame->closure->function->jit != NULL) {       \
+            JitStatus status = runJit();                             \
+            if (status == JIT_ERROR) return INTERPRET_RUNTIME_ERROR; \
+            if (status == JIT_DONE) return INTERPRET_OK;             \
+            frame = &vm.frames[vm.frameCount - 1];                   \
+        }                                                            \
+    } while (false)
+    // A loop back-edge counts towards the function's hotness the way a call does, and a hot loop
+    // moves into the compiled code right away, at the top of the loop.
+#define BACK_EDGE()                                                                    \
+    do {                                                                               \
+        ObjFunction* function = frame->closure->function;                              \
+        if (vm.jit && function->jit == NULL && ++function->hotness == JIT_THRESHOLD) { \
+            compileFunction(function);                                                 \
+        }                                                                              \
+        ENTER_JIT();                                                                   \
+    } while (false)
+#else
+#define ENTER_JIT() ((void)0)
+#define BACK_EDGE() ((void)0)
+#endif
 
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value      value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
-            }
 
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
-            }
+    /* Both dispatch strategies share the same handler bodies. A handler finishes by invoking
+    DISPATCH(), which either jumps straight to the next opcode's label through the dispatch table
+    (each handler ends in its own indirect jump, so the branch predictor gets a separate history
+    per opcode) or, in the portable build, goes back around the loop to the switch. */
+#ifdef COMPUTED_GOTO
+    static void* const handlers[] = {
+#define OPCODE(name, operands) &&do_##name,
+        FOR_EACH_OPCODE(OPCODE)
+#undef OPCODE
+    };
+    sampleStub = &&sample;
+    resetDispatch(handlers, &&count);
+    vm.lastTick = readTicks();
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name)     do_##name
+#define DISPATCH()                        \
+    do {                                  \
+        TRACE_INSTRUCTION();              \
+        goto* dispatchTable[READ_BYTE()]; \
+    } while (false)
+#else
+    vm.lastTick = readTicks();
+
+#define PROFILE_INSTRUCTION(instruction) \
+    (samplePending | vm.countOpcodes ? profileInstruction(instruction) : (instruction))
+#define INTERPRET_LOOP \
+    for (;;)           \
+        switch (TRACE_INSTRUCTION(), PROFILE_INSTRUCTION(READ_BYTE()))
+#define CASE(name) case name
+#define DISPATCH() continue
+#endif
 
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    // The key already exists, cannot implicity define variables.
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                // Do not pop the resuling value off the stack, since assignment is an expression
-                // and may be nested inside another expression.
-                break;
-            }
+    INTERPRET_LOOP {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL): push(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE): push(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE): push(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP): pop(); DISPATCH();
+
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(frame->slots[slot]);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot       = READ_BYTE();
+            frame->slots[slot] = peek(0);
+            DISPATCH();
+        }
 
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+        CASE(OP_GET_GLOBAL): {
+            int   slot  = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
+            push(value);
+            DISPATCH();
+        }
+
+        CASE(OP_DEFINE_GLOBAL): {
+            vm.globalValues.values[READ_SHORT()] = peek(0);
+            globalBarrier(peek(0));
+            pop();
+            DISPATCH();
+        }
 
-            case OP_SET_UPVALUE: {
-                uint8_t slot                              = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+        CASE(OP_SET_GLOBAL): {
+            int slot = READ_SHORT();
+            // Assignment can't implicitly define a variable.
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
+            vm.globalValues.values[slot] = peek(0);
+            globalBarrier(peek(0));
+            // Do not pop the resuling value off the stack, since assignment is an expression
+            // and may be nested inside another expression.
+            DISPATCH();
+        }
 
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            push(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
 
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString*   name     = READ_STRING();
+        CASE(OP_SET_UPVALUE): {
+            ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+            *upvalue->location  = peek(0);
+            // Only needed once the upvalue is closed. Remembering an open one costs a wasted
+            // rescan at worst, which is cheaper than checking every time.
+            writeBarrier((Obj*)upvalue, peek(0));
+            DISPATCH();
+        }
 
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop();  // Instance.
-                    push(value);
-                    break;
-                }
+        // A borrowed local lives in the caller's frame, which is on the stack, so storing to it
+        // needs no write barrier.
+        CASE(OP_GET_ENCLOSING): {
+            uint8_t slot = READ_BYTE();
+            push(frame[-1].slots[slot]);
+            DISPATCH();
+        }
 
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
+        CASE(OP_SET_ENCLOSING): {
+            uint8_t slot          = READ_BYTE();
+            frame[-1].slots[slot] = peek(0);
+            DISPATCH();
+        }
 
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE(OP_GET_PROPERTY): {
+            ObjString*   name  = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            if (!loadProperty(name, cache)) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
 
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+        CASE(OP_SET_PROPERTY): {
+            ObjString*   name  = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            if (!storeProperty(name, cache)) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
 
-                // A setter is itself an expression whose result is the assigned value,
-                // so we need to leave that value on the stack.
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+        CASE(OP_GET_SUPER): {
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = AS_CLASS(pop());
+            if (!bindMethod(superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            DISPATCH();
+        }
 
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
+        CASE(OP_EQUAL): {
+            // Only two numbers are worth quickening for. Everything else needs valuesEqual(), after
+            // any ropes have been flattened.
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) frame->ip[-1] = OP_EQUAL_NUM;
+            testEqual();
+            DISPATCH();
+        }
 
-            case OP_EQUAL: {
-                Value a = pop();
-                Value b = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+        CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); DISPATCH();
+        CASE(OP_LESS): BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); DISPATCH();
+        CASE(OP_ADD): {
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
+                frame->ip[-1] = OP_ADD_NUM;
+            } else if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+                concatenate();
+                frame->ip[-1] = OP_ADD_STR;
+            } else {
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); DISPATCH();
+        CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); DISPATCH();
+
+        // Doubles compare the same way valuesEqual() compares two numbers.
+        CASE(OP_EQUAL_NUM): NUMBER_OP(BOOL_VAL, ==, OP_EQUAL); DISPATCH();
+        CASE(OP_GREATER_NUM): NUMBER_OP(BOOL_VAL, >, OP_GREATER); DISPATCH();
+        CASE(OP_LESS_NUM): NUMBER_OP(BOOL_VAL, <, OP_LESS); DISPATCH();
+        CASE(OP_ADD_NUM): NUMBER_OP(NUMBER_VAL, +, OP_ADD); DISPATCH();
+        CASE(OP_ADD_STR): {
+            if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+                concatenate();
+            } else {
+                *--frame->ip = OP_ADD;
+            }
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_NUM): NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); DISPATCH();
+        CASE(OP_MULTIPLY_NUM): NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+        CASE(OP_DIVIDE_NUM): NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE); DISPATCH();
+        CASE(OP_NOT): push(BOOL_VAL(isFalsey(pop()))); DISPATCH();
+        CASE(OP_NEGATE): {
+            if (!IS_NUMBER(peek(0))) {
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
 
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(peek(0));
-                    double a = AS_NUMBER(peek(1));
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                }
-                break;
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            DISPATCH();
+        }
+
+        CASE(OP_PRINT): {
+            fprintValue(vm.out, pop());
+            fputc('\n', vm.out);
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip += offset;
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(0))) frame->ip += offset;
+            DISPATCH();
+        }
+
+        // Only emitted by the optimizer, which turns OP_NOT, OP_JUMP_IF_FALSE into this.
+        CASE(OP_JUMP_IF_TRUE): {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsey(peek(0))) frame->ip += offset;
+            DISPATCH();
+        }
+
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip -= offset;
+            BACK_EDGE();
+            DISPATCH();
+        }
+
+        CASE(OP_CALL): {
+            int argCount = READ_BYTE();
+            if (!callValue(peek(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            /* If callValue() is successful, there will be a new frame on the CallFrame stack
+            for the called function. The run() function has its own cached pointer to the
+            current frame, so we need to update that */
+            frame = &vm.frames[vm.frameCount - 1];
+            ENTER_JIT();
+            DISPATCH();
+            /* Since the bytecode dispatch loop reads from that frame variable, when the VM
+            goes to execute the next instruction, it will read the ip from the newly called
+            function’s CallFrame and jump to its code. */
+        }
 
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
+        CASE(OP_INVOKE): {
+            ObjString*   method   = READ_STRING();
+            int          argCount = READ_BYTE();
+            InlineCache* cache    = READ_CACHE();
+            if (!invoke(method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            frame = &vm.frames[vm.frameCount - 1];
+            ENTER_JIT();
+            DISPATCH();
+        }
 
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-                break;
+        CASE(OP_SUPER_INVOKE): {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            ObjClass* superclass = AS_CLASS(pop());
+            if (!invokeFromClass(superclass, method, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            frame = &vm.frames[vm.frameCount - 1];
+            ENTER_JIT();
+            DISPATCH();
+        }
 
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+        CASE(OP_CLOSURE): {
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure*  closure  = newClosure(function);
+            push(OBJ_VAL(closure));
+            captureUpvalues(frame, closure, false);
+            DISPATCH();
+        }
+
+        CASE(OP_CLOSE_UPVALUE): {
+            closeUpvalues(vm.stackTop - 1);
+            pop();
+            DISPATCH();
+        }
+
+        CASE(OP_RETURN): {
+            Value result = pop();  // Pop return value.
+
+            closeUpvalues(frame->slots);  // Close every remaining open upvalue owned by the
+                                          // returning function.
+            vm.frameCount--;
+
+            // If it's the last callframe, we're done with top level execution.
+            if (vm.frameCount == 0) {
+                pop();
+                return INTERPRET_OK;
             }
 
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+            vm.stackTop = frame->slots;             // Discard call frame.
+            push(result);                           // Push return value.
+            frame = &vm.frames[vm.frameCount - 1];  // Update cached pointer to current frame.
+            ENTER_JIT();
+            DISPATCH();
+        }
+
+        CASE(OP_CLASS): {
+            push(OBJ_VAL(newClass(READ_STRING())));
+            DISPATCH();
+        }
+
+        CASE(OP_INHERIT): {
+            if (!inherit()) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+
+        CASE(OP_METHOD): {
+            defineMethod(READ_STRING());
+            DISPATCH();
+        }
+
+        CASE(OP_BUILD_LIST): {
+            uint8_t  itemCount = READ_BYTE();
+            ObjList* list      = newList(vm.stackTop - itemCount, itemCount);
+            vm.stackTop -= itemCount;
+            push(OBJ_VAL(list));
+            DISPATCH();
+        }
+
+        CASE(OP_EXTEND_LIST): {
+            extendList(READ_BYTE());
+            DISPATCH();
+        }
+
+        CASE(OP_GET_INDEX): {
+            if (!loadIndex()) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+
+        CASE(OP_SET_INDEX): {
+            if (!storeIndex()) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+
+        // Superinstructions. Each does the work of the sequence it was fused from, and fails with
+        // the same error that sequence would have.
+        CASE(OP_GET_LOCAL_0): push(frame->slots[0]); DISPATCH();
+        CASE(OP_GET_LOCAL_1): push(frame->slots[1]); DISPATCH();
+        CASE(OP_GET_LOCAL_2): push(frame->slots[2]); DISPATCH();
+        CASE(OP_GET_LOCAL_3): push(frame->slots[3]); DISPATCH();
+
+        CASE(OP_SET_LOCAL_POP): {
+            uint8_t slot       = READ_BYTE();
+            frame->slots[slot] = pop();
+            DISPATCH();
+        }
+
+        CASE(OP_POP_N): vm.stackTop -= READ_BYTE(); DISPATCH();
+
+        // The optimizer only fuses these when the constant is a number, so only the local needs
+        // checking. It can't be a string to concatenate with, either.
+        CASE(OP_ADD_LOCAL_CONST): {
+            Value local    = frame->slots[READ_BYTE()];
+            Value constant = READ_CONSTANT();
+            if (!IS_NUMBER(local)) {
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
+            push(NUMBER_VAL(AS_NUMBER(local) + AS_NUMBER(constant)));
+            DISPATCH();
+        }
 
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+        CASE(OP_INCREMENT_LOCAL): {
+            Value* local    = &frame->slots[READ_BYTE()];
+            Value  constant = READ_CONSTANT();
+            if (!IS_NUMBER(*local)) {
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
+            *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(constant));
+            DISPATCH();
+        }
 
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                /* If callValue() is successful, there will be a new frame on the CallFrame stack
-                for the called function. The run() function has its own cached pointer to the
-                current frame, so we need to update that */
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-                /* Since the bytecode dispatch loop reads from that frame variable, when the VM
-                goes to execute the next instruction, it will read the ip from the newly called
-                function’s CallFrame and jump to its code. */
+        CASE(OP_LESS_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
             }
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            if (!(a < b)) frame->ip += offset;
+            DISPATCH();
+        }
 
-            case OP_INVOKE: {
-                ObjString* method   = READ_STRING();
-                int        argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+        CASE(OP_GREATER_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
             }
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            if (!(a > b)) frame->ip += offset;
+            DISPATCH();
+        }
 
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+        // Long forms, for operands that don't fit in the instructions above. Each one behaves
+        // exactly like its short namesake.
+        CASE(OP_CONSTANT_LONG): push(READ_CONSTANT_LONG()); DISPATCH();
+        CASE(OP_GET_LOCAL_LONG): push(frame->slots[READ_LONG()]); DISPATCH();
+
+        CASE(OP_SET_LOCAL_LONG): {
+            uint32_t slot      = READ_LONG();
+            frame->slots[slot] = peek(0);
+            DISPATCH();
+        }
+
+        CASE(OP_GET_UPVALUE_LONG): {
+            uint32_t slot = READ_LONG();
+            push(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_UPVALUE_LONG): {
+            ObjUpvalue* upvalue = frame->closure->upvalues[READ_LONG()];
+            *upvalue->location  = peek(0);
+            writeBarrier((Obj*)upvalue, peek(0));
+            DISPATCH();
+        }
+
+        CASE(OP_GET_ENCLOSING_LONG): {
+            uint32_t slot = READ_LONG();
+            push(frame[-1].slots[slot]);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_ENCLOSING_LONG): {
+            uint32_t slot         = READ_LONG();
+            frame[-1].slots[slot] = peek(0);
+            DISPATCH();
+        }
+
+        CASE(OP_GET_GLOBAL_LONG): {
+            uint32_t slot  = READ_LONG();
+            Value    value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
+            push(value);
+            DISPATCH();
+        }
 
-            case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure*  closure  = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index   = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
+        CASE(OP_DEFINE_GLOBAL_LONG): {
+            vm.globalValues.values[READ_LONG()] = peek(0);
+            globalBarrier(peek(0));
+            pop();
+            DISPATCH();
+        }
+
+        CASE(OP_SET_GLOBAL_LONG): {
+            uint32_t slot = READ_LONG();
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
+            vm.globalValues.values[slot] = peek(0);
+            globalBarrier(peek(0));
+            DISPATCH();
+        }
 
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+        CASE(OP_GET_PROPERTY_LONG): {
+            ObjString*   name  = READ_STRING_LONG();
+            InlineCache* cache = READ_CACHE_LONG();
+            if (!loadProperty(name, cache)) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+
+        CASE(OP_SET_PROPERTY_LONG): {
+            ObjString*   name  = READ_STRING_LONG();
+            InlineCache* cache = READ_CACHE_LONG();
+            if (!storeProperty(name, cache)) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+
+        CASE(OP_GET_SUPER_LONG): {
+            ObjString* name       = READ_STRING_LONG();
+            ObjClass*  superclass = AS_CLASS(pop());
+            if (!bindMethod(superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            DISPATCH();
+        }
 
-            case OP_RETURN: {
-                Value result = pop();  // Pop return value.
+        CASE(OP_JUMP_LONG): {
+            uint32_t offset = READ_LONG();
+            frame->ip += offset;
+            DISPATCH();
+        }
 
-                closeUpvalues(frame->slots);  // Close every remaining open upvalue owned by the
-                                              // returning function.
-                vm.frameCount--;
+        CASE(OP_JUMP_IF_FALSE_LONG): {
+            uint32_t offset = READ_LONG();
+            if (isFalsey(peek(0))) frame->ip += offset;
+            DISPATCH();
+        }
 
-                // If it's the last callframe, we're done with top level execution.
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
+        CASE(OP_LOOP_LONG): {
+            uint32_t offset = READ_LONG();
+            frame->ip -= offset;
+            BACK_EDGE();
+            DISPATCH();
+        }
 
-                vm.stackTop = frame->slots;             // Discard call frame.
-                push(result);                           // Push return value.
-                frame = &vm.frames[vm.frameCount - 1];  // Update cached pointer to current frame.
-                break;
+        CASE(OP_INVOKE_LONG): {
+            ObjString*   method   = READ_STRING_LONG();
+            int          argCount = READ_BYTE();
+            InlineCache* cache    = READ_CACHE_LONG();
+            if (!invoke(method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            frame = &vm.frames[vm.frameCount - 1];
+            ENTER_JIT();
+            DISPATCH();
+        }
 
-            case OP_CLASS: {
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
+        CASE(OP_SUPER_INVOKE_LONG): {
+            ObjString* method     = READ_STRING_LONG();
+            int        argCount   = READ_BYTE();
+            ObjClass*  superclass = AS_CLASS(pop());
+            if (!invokeFromClass(superclass, method, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            frame = &vm.frames[vm.frameCount - 1];
+            ENTER_JIT();
+            DISPATCH();
+        }
 
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE(OP_CLOSURE_LONG): {
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT_LONG());
+            ObjClosure*  closure  = newClosure(function);
+            push(OBJ_VAL(closure));
+            captureUpvalues(frame, closure, true);
+            DISPATCH();
+        }
 
-                ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
-            }
+        CASE(OP_CLASS_LONG): {
+            push(OBJ_VAL(newClass(READ_STRING_LONG())));
+            DISPATCH();
+        }
 
-            case OP_METHOD: {
-                defineMethod(READ_STRING());
-                break;
-            }
+        CASE(OP_METHOD_LONG): {
+            defineMethod(READ_STRING_LONG());
+            DISPATCH();
         }
     }
+
+#ifdef COMPUTED_GOTO
+    // Where the dispatch table sends instructions while profiling. Either way, the opcode has
+    // already been read.
+count:
+    goto* handlers[countInstruction(frame->ip[-1])];
+
+sample: {
+        uint8_t instruction = frame->ip[-1];
+        resetDispatch(handlers, &&count);
+        recordSample();
+        goto* dispatchTable[instruction];
+    }
+#endif
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_LONG
+#undef READ_CONSTANT_LONG
+#undef READ_STRING_LONG
+#undef READ_CACHE
+#undef READ_CACHE_LONG
+#undef BINARY_OP
+#undef NUMBER_OP
+#undef TRACE_INSTRUCTION
+#undef ENTER_JIT
+#undef BACK_EDGE
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
 InterpretResult interpret(const char* source) {
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+    return interpretFunction(function);
+}
+
+// Runs an already compiled script, whether it came from compile() or a bytecode file.
+InterpretResult interpretFunction(ObjFunction* function) {
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
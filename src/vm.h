@@ -3,10 +3,24 @@
 
 #include "chunk.h"
 #include "object.h"
+#include "optimizer.h"
+#include "profiler.h"
+#include "slab.h"
 #include "table.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX  (FRAMES_MAX * UINT8_COUNT)
+// Both stacks start small and grow as calls need them, up to STACK_MAX values. That still allows
+// recursion hundreds of thousands of calls deep, while catching runaway recursion before it eats
+// all of memory. Every frame takes at least one slot, so the frame stack is bounded as well.
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL  256
+#define STACK_MAX      (1 << 22)
+
+// The most frames a runtime error's stack trace lists.
+#define TRACE_MAX 64
+
+// Spare slots kept above every frame, for the values the VM pushes itself to keep them safe from
+// the GC while it allocates: a string being interned, say, or a native's name.
+#define STACK_SLACK 8
 
 typedef struct CallFrame {
     ObjClosure* closure;
@@ -14,28 +28,129 @@ typedef struct CallFrame {
     Value*      slots;  // Points into the VM's value stack at the first slot this closure can use.
 } CallFrame;
 
+// A major collection runs a little at a time, interleaved with the program, moving through these
+// phases in order.
+typedef enum GCPhase {
+    GC_IDLE,
+    GC_MARK,           // Tracing gray objects.
+    GC_SWEEP_STRINGS,  // Deleting dead strings from the intern table.
+    GC_SWEEP_OBJECTS,  // Freeing dead objects on the old large-object list.
+    GC_SWEEP_PAGES,    // Freeing dead old slots in the slab pages.
+} GCPhase;
+
+// Objects that have been marked but whose references haven't been traced yet. The VM has one, and
+// so does every helper thread during a parallel mark.
+typedef struct Marker {
+    int              grayCount;
+    int              grayCapacity;
+    Obj**            grayStack;
+    struct MarkPool* pool;  // Shared by every thread marking at once, or NULL when marking alone.
+} Marker;
+
+// Every pause, minor collection or major slice, is counted in a bucket by how long it took. Bucket
+// 0 holds pauses under a microsecond, bucket i those under 2^i microseconds that didn't fit the one
+// before, and the last one everything longer.
+#define GC_PAUSE_BUCKETS 20
+
+typedef struct GCStats {
+    int      minorCount;
+    int      majorCount;
+    int      majorSlices;
+    size_t   promotedObjects;
+    size_t   bytesFreed;       // By collections of both kinds together.
+    size_t   peakBytes;        // The most bytesAllocated has been when a collection started.
+    double   minorPauseTotal;  // Pause times are in seconds.
+    double   minorPauseMax;
+    double   majorPauseTotal;  // Summed over every slice of every major collection.
+    double   majorPauseMax;    // The longest single slice.
+    uint64_t pauseHistogram[GC_PAUSE_BUCKETS];
+} GCStats;
+
 typedef struct VM {
-    CallFrame frames[FRAMES_MAX];
-    int       frameCount;
-    Value     stack[STACK_MAX];
-    Value*    stackTop;
+    CallFrame* frames;
+    int        frameCount;
+    int        frameCapacity;
+    Value*     stack;
+    Value*     stackTop;
+    int        stackCapacity;
 
-    Table       globals;
+    // Global variables are resolved to slots at compile time. globalValues holds the slots,
+    // UNDEFINED_VAL until the variable is defined, and globalNames maps each name to its slot
+    // index for the compiler.
+    ValueArray  globalValues;
+    Table       globalNames;
     Table       strings;
     ObjString*  initString;
+    bool        youngGlobals;  // A global slot or name may point into the nursery.
     ObjUpvalue* openUpvalues;
+    uint32_t    classVersion;  // Last version number handed out by touchClass().
+    uint32_t    shapeId;       // Last id handed out to a new shape.
+
+    // Values the host keeps alive between scripts, like the compiled scripts the server caches.
+    // Always a root.
+    ValueArray pinned;
 
     size_t bytesAllocated;
-    size_t nextGC;
+    size_t nextGC;          // A major collection starts once bytesAllocated gets past this.
+    double gcGrowthFactor;  // How far the heap may grow past what survived the last one.
+    size_t gcMaxHeap;       // A soft cap on nextGC, or 0 for none.
+    size_t youngBytes;       // Allocated since the last collection of either kind.
+    bool   collectingYoung;  // Set for the duration of a minor collection.
+
+    GCPhase gcPhase;
+    int     gcSliceBudget;  // Units of work, roughly an object or table entry each, per slice.
+    size_t  gcDebt;         // Allocated since the last slice of the current major collection.
+
+    // Where each sweep phase got to at the end of the last slice.
+    int       sweepIndex;
+    int       sweepCapacity;  // Capacity of vm.strings when sweepIndex was valid.
+    Obj**     sweepLink;
+    int       sweepClass;
+    SlabPage* sweepPage;
+
+    // Objects that fit a size class live in the slab pages. Anything bigger is allocated on its
+    // own and starts out in the young list, moving to the old one by the first collection it
+    // survives.
+    SlabClass slabClasses[SLAB_CLASS_COUNT];
+    Obj*      objects;
+    Obj*      youngObjects;
+
+    Marker marker;
+    int    gcThreads;  // Threads sharing the marking of a major collection, counting this one.
+
+    // Old objects that may hold pointers to young ones. A minor collection treats them as roots.
+    int   rememberedCount;
+    int   rememberedCapacity;
+    Obj** rememberedSet;
+
+    GCStats gcStats;
+
+    // Where print statements write, and where compile and runtime errors are reported.
+    FILE* out;
+    FILE* err;
+
+    bool           optimize;  // Run the optimizer over each chunk the compiler finishes.
+    OptimizerStats optimizerStats;
+
+    // Compile hot functions to machine code. Ignored by builds without the JIT.
+    bool jit;
 
-    Obj* objects;
+    // While countOpcodes is set, run() counts every instruction it executes and the ticks until
+    // the next one, which the instrumented build does from the start.
+    bool     countOpcodes;
+    uint64_t opcodeCounts[OPCODE_COUNT];
+    uint64_t opcodeTicks[OPCODE_COUNT];
+    uint64_t lastTick;
+    uint8_t  lastOpcode;
 
-    int   grayCount;
-    int   grayCapacity;
-    Obj** grayStack;
+    Profile profile;
 } VM;
 
-extern VM vm;
+/* Each thread has a VM of its own, with its own heap, globals, intern table and collector, and
+initVM() and freeVM() set up and tear down the calling thread's. Values never cross from one VM to
+another, so any number of threads can run Lox side by side without locking. The compiler and
+scanner keep their state per thread the same way. */
+extern _Thread_local VM vm;
 
 typedef enum InterpretResult {
     INTERPRET_OK,
@@ -44,12 +159,17 @@ typedef enum InterpretResult {
 } InterpretResult;
 
 void            initVM();
-static void     resetStack();
-static void     defineNative(const char* name, NativeFn function);
+void            defineNative(const char* name, int arity, NativeFn function);
+bool            nativeError(const char* format, ...);
 void            freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
+int             globalSlot(ObjString* name);
+ObjString*      globalName(int slot);
 void            push(Value value);
 Value           pop();
 Value           peek(int distance);
+bool            reserveStack(int slots);
+void            requestSample();
 
 #endif
\ No newline at end of file